@@ -345,7 +345,7 @@ void ClangdLSPServer::onInitialize(const InitializeParams &Params,
             {"codeActionProvider", true},
             {"completionProvider",
              llvm::json::Object{
-                 {"resolveProvider", false},
+                 {"resolveProvider", CCOpts.DeferIndexComments},
                  // We do extra checks for '>' and ':' in completion to only
                  // trigger on '->' and '::'.
                  {"triggerCharacters", {".", ">", ":"}},
@@ -389,6 +389,21 @@ void ClangdLSPServer::onSync(const NoParams &Params,
                                   "Not idle after a minute"));
 }
 
+// $/memoryUsage is a clangd extension: it reports the estimated memory usage
+// of each open file.
+void ClangdLSPServer::onMemoryUsage(
+    const NoParams &Params, Callback<std::vector<FileMemoryUsage>> Reply) {
+  std::vector<FileMemoryUsage> Result;
+  for (const auto &FileAndBytes : Server->getUsedBytesPerFile()) {
+    FileMemoryUsage Usage;
+    Usage.uri = URIForFile::canonicalize(FileAndBytes.first,
+                                         /*TUPath=*/FileAndBytes.first);
+    Usage.bytes = FileAndBytes.second;
+    Result.push_back(std::move(Usage));
+  }
+  Reply(std::move(Result));
+}
+
 void ClangdLSPServer::onDocumentDidOpen(
     const DidOpenTextDocumentParams &Params) {
   PathRef File = Params.textDocument.uri.file();
@@ -720,6 +735,11 @@ void ClangdLSPServer::onCompletion(const CompletionParams &Params,
                            std::move(Reply)));
 }
 
+void ClangdLSPServer::onCompletionResolve(const CompletionItem &Params,
+                                          Callback<CompletionItem> Reply) {
+  Server->resolveCompletion(Params, std::move(Reply));
+}
+
 void ClangdLSPServer::onSignatureHelp(const TextDocumentPositionParams &Params,
                                       Callback<SignatureHelp> Reply) {
   Server->signatureHelp(Params.textDocument.uri.file(), Params.position,
@@ -863,11 +883,13 @@ ClangdLSPServer::ClangdLSPServer(class Transport &Transp,
   MsgHandler->bind("initialize", &ClangdLSPServer::onInitialize);
   MsgHandler->bind("shutdown", &ClangdLSPServer::onShutdown);
   MsgHandler->bind("sync", &ClangdLSPServer::onSync);
+  MsgHandler->bind("$/memoryUsage", &ClangdLSPServer::onMemoryUsage);
   MsgHandler->bind("textDocument/rangeFormatting", &ClangdLSPServer::onDocumentRangeFormatting);
   MsgHandler->bind("textDocument/onTypeFormatting", &ClangdLSPServer::onDocumentOnTypeFormatting);
   MsgHandler->bind("textDocument/formatting", &ClangdLSPServer::onDocumentFormatting);
   MsgHandler->bind("textDocument/codeAction", &ClangdLSPServer::onCodeAction);
   MsgHandler->bind("textDocument/completion", &ClangdLSPServer::onCompletion);
+  MsgHandler->bind("completionItem/resolve", &ClangdLSPServer::onCompletionResolve);
   MsgHandler->bind("textDocument/signatureHelp", &ClangdLSPServer::onSignatureHelp);
   MsgHandler->bind("textDocument/definition", &ClangdLSPServer::onGoToDefinition);
   MsgHandler->bind("textDocument/declaration", &ClangdLSPServer::onGoToDeclaration);
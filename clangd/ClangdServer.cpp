@@ -29,6 +29,7 @@
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/ScopeExit.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
@@ -65,9 +66,11 @@ public:
 };
 
 // Update the FileIndex with new ASTs and plumb the diagnostics responses.
+// Also pauses the background index while open files have pending work.
 struct UpdateIndexCallbacks : public ParsingCallbacks {
-  UpdateIndexCallbacks(FileIndex *FIndex, DiagnosticsConsumer &DiagConsumer)
-      : FIndex(FIndex), DiagConsumer(DiagConsumer) {}
+  UpdateIndexCallbacks(FileIndex *FIndex, DiagnosticsConsumer &DiagConsumer,
+                       BackgroundIndex *PausedIndex)
+      : FIndex(FIndex), DiagConsumer(DiagConsumer), PausedIndex(PausedIndex) {}
 
   void onPreambleAST(PathRef Path, ASTContext &Ctx,
                      std::shared_ptr<clang::Preprocessor> PP,
@@ -76,6 +79,11 @@ struct UpdateIndexCallbacks : public ParsingCallbacks {
       FIndex->updatePreamble(Path, Ctx, std::move(PP), CanonIncludes);
   }
 
+  void onPreambleReused(PathRef Path, PathRef BuiltFor) override {
+    if (FIndex)
+      FIndex->sharePreamble(Path, BuiltFor);
+  }
+
   void onMainAST(PathRef Path, ParsedAST &AST) override {
     if (FIndex)
       FIndex->updateMain(Path, AST);
@@ -87,19 +95,43 @@ struct UpdateIndexCallbacks : public ParsingCallbacks {
 
   void onFileUpdated(PathRef File, const TUStatus &Status) override {
     DiagConsumer.onFileUpdated(File, Status);
+    setBusy(File, Status.Action.S != TUAction::Idle);
   }
 
+  void onFileRemoved(PathRef File) override { setBusy(File, false); }
+
 private:
+  void setBusy(PathRef File, bool Busy) {
+    if (!PausedIndex)
+      return;
+    std::lock_guard<std::mutex> Lock(BusyFilesMu);
+    bool WasBusy = !BusyFiles.empty();
+    if (Busy)
+      BusyFiles.insert(File);
+    else
+      BusyFiles.erase(File);
+    if (!WasBusy && !BusyFiles.empty())
+      PausedIndex->pause();
+    else if (WasBusy && BusyFiles.empty())
+      PausedIndex->resume();
+  }
+
   FileIndex *FIndex;
   DiagnosticsConsumer &DiagConsumer;
+  BackgroundIndex *PausedIndex;
+  std::mutex BusyFilesMu;
+  llvm::StringSet<> BusyFiles; /* GUARDED_BY(BusyFilesMu) */
 };
 } // namespace
 
 ClangdServer::Options ClangdServer::optsForTest() {
   ClangdServer::Options Opts;
-  Opts.UpdateDebounce = std::chrono::steady_clock::duration::zero(); // Faster!
+  Opts.UpdateDebounce = DebouncePolicy::fixed(
+      std::chrono::steady_clock::duration::zero()); // Faster!
   Opts.StorePreamblesInMemory = true;
   Opts.AsyncThreadsCount = 4; // Consistent!
+  // Reads should reflect header changes as soon as the update is processed.
+  Opts.AsyncPreambleBuilds = false;
   return Opts;
 }
 
@@ -109,21 +141,34 @@ ClangdServer::ClangdServer(const GlobalCompilationDatabase &CDB,
                            const Options &Opts)
     : CDB(CDB), FSProvider(FSProvider),
       DynamicIdx(Opts.BuildDynamicSymbolIndex
-                     ? new FileIndex(Opts.HeavyweightDynamicSymbolIndex)
+                     ? new FileIndex(
+                           Opts.HeavyweightDynamicSymbolIndex,
+                           /*AsyncRebuilds=*/Opts.AsyncThreadsCount != 0)
                      : nullptr),
+      BackgroundIdx(Opts.BackgroundIndex
+                        ? new BackgroundIndex(
+                              Context::current().clone(), FSProvider, CDB,
+                              BackgroundIndexStorage::
+                                  createDiskBackedStorageFactory(),
+                              Opts.BackgroundIndexRebuildPeriodMs,
+                              llvm::heavyweight_hardware_concurrency(),
+                              Opts.BackgroundLimits)
+                        : nullptr),
       ClangTidyOptProvider(Opts.ClangTidyOptProvider),
       SuggestMissingIncludes(Opts.SuggestMissingIncludes),
+      SkipUnchangedBodiesMinSize(Opts.SkipUnchangedBodiesMinSize),
       WorkspaceRoot(Opts.WorkspaceRoot),
       PCHs(std::make_shared<PCHContainerOperations>()),
       // Pass a callback into `WorkScheduler` to extract symbols from a newly
-      // parsed file and rebuild the file index synchronously each time an AST
-      // is parsed.
-      // FIXME(ioeric): this can be slow and we may be able to index on less
-      // critical paths.
+      // parsed file each time an AST is parsed. Unless requests are processed
+      // synchronously, the file index is rebuilt from them on other threads.
       WorkScheduler(Opts.AsyncThreadsCount, Opts.StorePreamblesInMemory,
-                    llvm::make_unique<UpdateIndexCallbacks>(DynamicIdx.get(),
-                                                            DiagConsumer),
-                    Opts.UpdateDebounce, Opts.RetentionPolicy) {
+                    llvm::make_unique<UpdateIndexCallbacks>(
+                        DynamicIdx.get(), DiagConsumer,
+                        Opts.PauseBackgroundIndexWhileBusy ? BackgroundIdx.get()
+                                                           : nullptr),
+                    Opts.UpdateDebounce, Opts.RetentionPolicy,
+                    Opts.AsyncPreambleBuilds) {
   // Adds an index to the stack, at higher priority than existing indexes.
   auto AddIndex = [&](SymbolIndex *Idx) {
     if (this->Index != nullptr) {
@@ -135,13 +180,8 @@ ClangdServer::ClangdServer(const GlobalCompilationDatabase &CDB,
   };
   if (Opts.StaticIndex)
     AddIndex(Opts.StaticIndex);
-  if (Opts.BackgroundIndex) {
-    BackgroundIdx = llvm::make_unique<BackgroundIndex>(
-        Context::current().clone(), FSProvider, CDB,
-        BackgroundIndexStorage::createDiskBackedStorageFactory(),
-        Opts.BackgroundIndexRebuildPeriodMs);
+  if (BackgroundIdx)
     AddIndex(BackgroundIdx.get());
-  }
   if (DynamicIdx)
     AddIndex(DynamicIdx.get());
 }
@@ -153,6 +193,7 @@ void ClangdServer::addDocument(PathRef File, llvm::StringRef Contents,
   if (ClangTidyOptProvider)
     Opts.ClangTidyOpts = ClangTidyOptProvider->getOptions(File);
   Opts.SuggestMissingIncludes = SuggestMissingIncludes;
+  Opts.SkipUnchangedBodiesMinSize = SkipUnchangedBodiesMinSize;
   // FIXME: some build systems like Bazel will take time to preparing
   // environment to build the file, it would be nice if we could emit a
   // "PreparingBuild" status to inform users, it is non-trivial given the
@@ -164,9 +205,19 @@ void ClangdServer::addDocument(PathRef File, llvm::StringRef Contents,
   Inputs.Opts = std::move(Opts);
   Inputs.Index = Index;
   WorkScheduler.update(File, Inputs, WantDiags);
+  if (BackgroundIdx)
+    BackgroundIdx->boostRelated(File);
 }
 
-void ClangdServer::removeDocument(PathRef File) { WorkScheduler.remove(File); }
+void ClangdServer::removeDocument(PathRef File) {
+  {
+    // Candidates computed before the file was closed may be stale once it's
+    // reopened, e.g. if the headers changed in the meantime.
+    std::lock_guard<std::mutex> Lock(CompletionCandidatePoolMutex);
+    CompletionCandidatePoolByFile.erase(File);
+  }
+  WorkScheduler.remove(File);
+}
 
 void ClangdServer::codeComplete(PathRef File, Position Pos,
                                 const clangd::CodeCompleteOptions &Opts,
@@ -175,6 +226,8 @@ void ClangdServer::codeComplete(PathRef File, Position Pos,
   auto CodeCompleteOpts = Opts;
   if (!CodeCompleteOpts.Index) // Respect overridden index.
     CodeCompleteOpts.Index = Index;
+  if (!CodeCompleteOpts.FileProximityCache)
+    CodeCompleteOpts.FileProximityCache = &FileProximityCache;
 
   // Copy PCHs to avoid accessing this->PCHs concurrently
   std::shared_ptr<PCHContainerOperations> PCHs = this->PCHs;
@@ -188,6 +241,19 @@ void ClangdServer::codeComplete(PathRef File, Position Pos,
     if (isCancelled())
       return CB(llvm::make_error<CancelledError>());
 
+    llvm::Optional<CompletionCandidatePool> Pool;
+    if (CodeCompleteOpts.ReuseCandidates) {
+      std::shared_ptr<const CompletionCandidatePool> LastPool;
+      {
+        std::lock_guard<std::mutex> Lock(CompletionCandidatePoolMutex);
+        LastPool = CompletionCandidatePoolByFile.lookup(File);
+      }
+      if (LastPool)
+        if (auto Result = reuseCompletionCandidates(*LastPool, IP->Contents,
+                                                    Pos, CodeCompleteOpts))
+          return CB(std::move(*Result));
+    }
+
     llvm::Optional<SpeculativeFuzzyFind> SpecFuzzyFind;
     if (CodeCompleteOpts.Index && CodeCompleteOpts.SpeculativeIndexRequest) {
       SpecFuzzyFind.emplace();
@@ -201,7 +267,8 @@ void ClangdServer::codeComplete(PathRef File, Position Pos,
     // both the old and the new version in case only one of them matches.
     CodeCompleteResult Result = clangd::codeComplete(
         File, IP->Command, IP->Preamble, IP->Contents, Pos, FS, PCHs,
-        CodeCompleteOpts, SpecFuzzyFind ? SpecFuzzyFind.getPointer() : nullptr);
+        CodeCompleteOpts, SpecFuzzyFind ? SpecFuzzyFind.getPointer() : nullptr,
+        CodeCompleteOpts.ReuseCandidates ? &Pool : nullptr);
     {
       clang::clangd::trace::Span Tracer("Completion results callback");
       CB(std::move(Result));
@@ -211,6 +278,14 @@ void ClangdServer::codeComplete(PathRef File, Position Pos,
       CachedCompletionFuzzyFindRequestByFile[File] =
           SpecFuzzyFind->NewReq.getValue();
     }
+    if (CodeCompleteOpts.ReuseCandidates) {
+      std::lock_guard<std::mutex> Lock(CompletionCandidatePoolMutex);
+      if (Pool)
+        CompletionCandidatePoolByFile[File] =
+            std::make_shared<const CompletionCandidatePool>(std::move(*Pool));
+      else
+        CompletionCandidatePoolByFile.erase(File);
+    }
     // SpecFuzzyFind is only destroyed after speculative fuzzy find finishes.
     // We don't want `codeComplete` to wait for the async call if it doesn't use
     // the result (e.g. non-index completion, speculation fails), so that `CB`
@@ -532,8 +607,28 @@ tooling::CompileCommand ClangdServer::getCompileCommand(PathRef File) {
 }
 
 void ClangdServer::onFileEvent(const DidChangeWatchedFilesParams &Params) {
-  // FIXME: Do nothing for now. This will be used for indexing and potentially
-  // invalidating other caches.
+  // FIXME: This will be used for indexing and potentially invalidating other
+  // caches.
+  for (const FileEvent &Event : Params.changes)
+    FSProvider.fileChanged(Event.uri.file());
+}
+
+void ClangdServer::resolveCompletion(CompletionItem Item,
+                                     Callback<CompletionItem> CB) {
+  if (!Item.data || !Index)
+    return CB(std::move(Item));
+  WorkScheduler.run(
+      "ResolveCompletion",
+      Bind(
+          [this](CompletionItem Item, decltype(CB) CB) {
+            LookupRequest Req;
+            Req.IDs.insert(*Item.data);
+            Index->lookup(Req, [&](const Symbol &S) {
+              Item.documentation = S.Documentation;
+            });
+            CB(std::move(Item));
+          },
+          std::move(Item), std::move(CB)));
 }
 
 void ClangdServer::workspaceSymbols(
@@ -594,6 +689,8 @@ ClangdServer::getUsedBytesPerFile() const {
 LLVM_NODISCARD bool
 ClangdServer::blockUntilIdleForTest(llvm::Optional<double> TimeoutSeconds) {
   return WorkScheduler.blockUntilIdle(timeoutSeconds(TimeoutSeconds)) &&
+         (!DynamicIdx ||
+          DynamicIdx->blockUntilIdleForTest(timeoutSeconds(TimeoutSeconds))) &&
          (!BackgroundIdx ||
           BackgroundIdx->blockUntilIdleForTest(TimeoutSeconds));
 }
@@ -14,6 +14,7 @@
 #include "ClangdUnit.h"
 #include "CodeComplete.h"
 #include "FSProvider.h"
+#include "FileDistance.h"
 #include "Function.h"
 #include "GlobalCompilationDatabase.h"
 #include "Protocol.h"
@@ -92,6 +93,11 @@ public:
     /// periodically every BuildIndexPeriodMs milliseconds; otherwise, the
     /// symbol index will be updated for each indexed file.
     size_t BackgroundIndexRebuildPeriodMs = 0;
+    /// Limits on the memory and CPU time used by the background index.
+    BackgroundIndexLimits BackgroundLimits;
+    /// If true, the background index doesn't start indexing new TUs while
+    /// open files have pending updates or AST reads.
+    bool PauseBackgroundIndexWhileBusy = true;
 
     /// If set, use this index to augment code completion results.
     SymbolIndex *StaticIndex = nullptr;
@@ -114,11 +120,21 @@ public:
     /// obtain the standard resource directory.
     llvm::Optional<std::string> ResourceDir = llvm::None;
 
-    /// Time to wait after a new file version before computing diagnostics.
-    std::chrono::steady_clock::duration UpdateDebounce =
-        std::chrono::milliseconds(500);
+    /// Decides how long to wait after a new file version before computing
+    /// diagnostics.
+    DebouncePolicy UpdateDebounce;
+
+    /// If true, preambles invalidated by changes to the included headers are
+    /// rebuilt in the background, while diagnostics and other requests use the
+    /// stale preamble in the meantime.
+    bool AsyncPreambleBuilds = true;
 
     bool SuggestMissingIncludes = false;
+
+    /// Files at least this large (in bytes) are first reparsed without the
+    /// function bodies that were not edited, so that diagnostics are reported
+    /// faster. A full parse follows. 0 disables this.
+    std::size_t SkipUnchangedBodiesMinSize = 0;
   };
   // Sensible default options for use in tests.
   // Features like indexing must be enabled if desired.
@@ -164,6 +180,10 @@ public:
                     const clangd::CodeCompleteOptions &Opts,
                     Callback<CodeCompleteResult> CB);
 
+  /// Fills in the documentation that CodeCompleteOptions::DeferIndexComments
+  /// left out of a completion item. Other items are returned unchanged.
+  void resolveCompletion(CompletionItem Item, Callback<CompletionItem> CB);
+
   /// Provide signature help for \p File at \p Pos.  This method should only be
   /// called for tracked files.
   void signatureHelp(PathRef File, Position Pos, Callback<SignatureHelp> CB);
@@ -289,11 +309,22 @@ private:
   // can be caused by missing includes (e.g. member access in incomplete type).
   bool SuggestMissingIncludes = false;
 
+  std::size_t SkipUnchangedBodiesMinSize = 0;
+
   // GUARDED_BY(CachedCompletionFuzzyFindRequestMutex)
   llvm::StringMap<llvm::Optional<FuzzyFindRequest>>
       CachedCompletionFuzzyFindRequestByFile;
   mutable std::mutex CachedCompletionFuzzyFindRequestMutex;
 
+  // GUARDED_BY(CompletionCandidatePoolMutex)
+  llvm::StringMap<std::shared_ptr<const CompletionCandidatePool>>
+      CompletionCandidatePoolByFile;
+  mutable std::mutex CompletionCandidatePoolMutex;
+
+  // Shares the file proximity scoring between completions in files whose
+  // includes didn't change.
+  URIDistanceCache FileProximityCache{/*MaxSize=*/10};
+
   llvm::Optional<std::string> WorkspaceRoot;
   std::shared_ptr<PCHContainerOperations> PCHs;
   // WorkScheduler has to be the last member, because its destructor has to be
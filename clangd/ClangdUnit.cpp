@@ -9,6 +9,7 @@
 #include "ClangdUnit.h"
 #include "../clang-tidy/ClangTidyDiagnosticConsumer.h"
 #include "../clang-tidy/ClangTidyModuleRegistry.h"
+#include "Cancellation.h"
 #include "Compiler.h"
 #include "Diagnostics.h"
 #include "Headers.h"
@@ -56,12 +57,67 @@ template <class T> std::size_t getUsedBytes(const std::vector<T> &Vec) {
   return Vec.capacity() * sizeof(T);
 }
 
+/// Finds the offsets of the braces around the body of \p D in the main file.
+/// Called before the body is parsed, so this runs the raw lexer. Returns None
+/// if anything but braces and virt-specifiers follows the declarator, e.g.
+/// constructor initializers, or if the body contains preprocessor directives.
+llvm::Optional<std::pair<unsigned, unsigned>>
+findFunctionBody(const Decl &D, const SourceManager &SM,
+                 const LangOptions &LangOpts) {
+  SourceLocation DeclEnd = D.getEndLoc();
+  if (DeclEnd.isInvalid() || !DeclEnd.isFileID() ||
+      !SM.isWrittenInMainFile(DeclEnd))
+    return None;
+  FileID FID = SM.getMainFileID();
+  llvm::StringRef Code = SM.getBufferData(FID);
+  Lexer Lex(SM.getLocForStartOfFile(FID), LangOpts, Code.begin(),
+            Code.begin() + SM.getFileOffset(DeclEnd), Code.end());
+  Token Tok;
+  // Skip the last token of the declarator.
+  if (Lex.LexFromRawLexer(Tok))
+    return None;
+  while (true) {
+    if (Lex.LexFromRawLexer(Tok))
+      return None;
+    if (Tok.is(tok::l_brace))
+      break;
+    if (!Tok.is(tok::raw_identifier) ||
+        (Tok.getRawIdentifier() != "override" &&
+         Tok.getRawIdentifier() != "final"))
+      return None;
+  }
+  unsigned Begin = SM.getFileOffset(Tok.getLocation());
+  for (unsigned Depth = 1; Depth > 0;) {
+    if (Lex.LexFromRawLexer(Tok))
+      return None;
+    if (Tok.is(tok::hash) && Tok.isAtStartOfLine())
+      return None;
+    if (Tok.is(tok::l_brace))
+      ++Depth;
+    else if (Tok.is(tok::r_brace))
+      --Depth;
+  }
+  return std::make_pair(Begin, SM.getFileOffset(Tok.getEndLoc()));
+}
+
 class DeclTrackingASTConsumer : public ASTConsumer {
 public:
-  DeclTrackingASTConsumer(std::vector<Decl *> &TopLevelDecls)
-      : TopLevelDecls(TopLevelDecls) {}
+  struct SkippedBody {
+    const Decl *D;
+    std::pair<unsigned, unsigned> Offsets;
+  };
+
+  DeclTrackingASTConsumer(
+      std::vector<Decl *> &TopLevelDecls, std::vector<SkippedBody> &Skipped,
+      const CompilerInstance &CI,
+      llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn)
+      : TopLevelDecls(TopLevelDecls), Skipped(Skipped), CI(CI),
+        ParseBodiesIn(ParseBodiesIn) {}
 
   bool HandleTopLevelDecl(DeclGroupRef DG) override {
+    // Stop parsing if the build was cancelled, e.g. because it's obsolete.
+    if (isCancelled())
+      return false;
     for (Decl *D : DG) {
       if (D->isFromASTFile())
         continue;
@@ -75,22 +131,59 @@ public:
     return true;
   }
 
+  // Only called when FrontendOptions::SkipFunctionBodies is set.
+  bool shouldSkipFunctionBody(Decl *D) override {
+    if (!ParseBodiesIn)
+      return false;
+    auto Body = findFunctionBody(*D, CI.getSourceManager(), CI.getLangOpts());
+    if (!Body || (Body->first <= ParseBodiesIn->second &&
+                  ParseBodiesIn->first <= Body->second))
+      return false;
+    Skipped.push_back({D, *Body});
+    return true;
+  }
+
 private:
   std::vector<Decl *> &TopLevelDecls;
+  std::vector<SkippedBody> &Skipped;
+  const CompilerInstance &CI;
+  llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn;
 };
 
 class ClangdFrontendAction : public SyntaxOnlyAction {
 public:
+  ClangdFrontendAction(
+      llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn)
+      : ParseBodiesIn(ParseBodiesIn) {}
+
   std::vector<Decl *> takeTopLevelDecls() { return std::move(TopLevelDecls); }
 
+  /// Returns the ranges of the function bodies that were skipped.
+  std::vector<Range> takeSkippedBodies(llvm::StringRef Code) {
+    std::vector<Range> Result;
+    for (const auto &S : Skipped) {
+      const FunctionDecl *FD = S.D->getAsFunction();
+      // The parser may have failed to skip the body.
+      if (!FD || !FD->hasSkippedBody())
+        continue;
+      Result.push_back({offsetToPosition(Code, S.Offsets.first),
+                        offsetToPosition(Code, S.Offsets.second)});
+    }
+    Skipped.clear();
+    return Result;
+  }
+
 protected:
   std::unique_ptr<ASTConsumer>
   CreateASTConsumer(CompilerInstance &CI, llvm::StringRef InFile) override {
-    return llvm::make_unique<DeclTrackingASTConsumer>(/*ref*/ TopLevelDecls);
+    return llvm::make_unique<DeclTrackingASTConsumer>(
+        /*ref*/ TopLevelDecls, /*ref*/ Skipped, CI, ParseBodiesIn);
   }
 
 private:
   std::vector<Decl *> TopLevelDecls;
+  std::vector<DeclTrackingASTConsumer::SkippedBody> Skipped;
+  llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn;
 };
 
 class CppFilePreambleCallbacks : public PreambleCallbacks {
@@ -236,6 +329,18 @@ private:
   const LangOptions &LangOpts;
 };
 
+// Returns true if the preamble region of \p Code starts with the one of
+// \p Preamble and is longer.
+bool extendsPreamble(const PreambleData &Preamble, llvm::StringRef Code,
+                     const LangOptions &LangOpts) {
+  if (!Code.startswith(Preamble.MainFilePreamble))
+    return false;
+  auto Buffer = llvm::MemoryBuffer::getMemBuffer(
+      Code, /*BufferName=*/"", /*RequiresNullTerminator=*/false);
+  return ComputePreambleBounds(LangOpts, Buffer.get(), 0).Size >
+         Preamble.MainFilePreamble.size();
+}
+
 } // namespace
 
 void dumpAST(ParsedAST &AST, llvm::raw_ostream &OS) {
@@ -253,19 +358,31 @@ ParsedAST::build(std::unique_ptr<CompilerInvocation> CI,
   // Command-line parsing sets DisableFree to true by default, but we don't want
   // to leak memory in clangd.
   CI->getFrontendOpts().DisableFree = false;
+  // The AST consumer decides which function bodies are skipped.
+  if (Opts.ParseBodiesIn)
+    CI->getFrontendOpts().SkipFunctionBodies = true;
   const PrecompiledPreamble *PreamblePCH =
       Preamble ? &Preamble->Preamble : nullptr;
 
   StoreDiags ASTDiags;
   std::string Content = Buffer->getBuffer();
+  bool PatchPreamble =
+      Preamble && extendsPreamble(*Preamble, Content, *CI->getLangOpts());
 
   auto Clang =
       prepareCompilerInstance(std::move(CI), PreamblePCH, std::move(Buffer),
                               std::move(PCHs), VFS, ASTDiags);
   if (!Clang)
     return None;
+  // Only skip the part of the preamble region covered by the preamble, the
+  // directives appended after it are parsed as part of the main file.
+  if (PatchPreamble) {
+    PreambleBounds Bounds = Preamble->Preamble.getBounds();
+    Clang->getPreprocessorOpts().PrecompiledPreambleBytes = {
+        Bounds.Size, Bounds.PreambleEndsAtStartOfLine};
+  }
 
-  auto Action = llvm::make_unique<ClangdFrontendAction>();
+  auto Action = llvm::make_unique<ClangdFrontendAction>(Opts.ParseBodiesIn);
   const FrontendInputFile &MainInput = Clang->getFrontendOpts().Inputs[0];
   if (!Action->BeginSourceFile(*Clang, MainInput)) {
     log("BeginSourceFile() failed when building AST for {0}",
@@ -311,7 +428,8 @@ ParsedAST::build(std::unique_ptr<CompilerInvocation> CI,
     auto Style = getFormatStyleForFile(MainInput.getFile(), Content, VFS.get());
     auto Inserter = std::make_shared<IncludeInserter>(
         MainInput.getFile(), Content, Style, BuildDir.get(),
-        Clang->getPreprocessor().getHeaderSearchInfo());
+        Clang->getPreprocessor().getHeaderSearchInfo(),
+        Preamble ? &Preamble->IncludePaths : nullptr);
     if (Preamble) {
       for (const auto &Inc : Preamble->Includes.MainFileIncludes)
         Inserter->addExisting(Inc);
@@ -350,8 +468,15 @@ ParsedAST::build(std::unique_ptr<CompilerInvocation> CI,
 
   if (!Action->Execute())
     log("Execute() failed when building AST for {0}", MainInput.getFile());
+  // The parse may have stopped early, the AST is incomplete.
+  if (isCancelled()) {
+    vlog("Cancelled building AST for {0}", MainInput.getFile());
+    Action->EndSourceFile();
+    return None;
+  }
 
   std::vector<Decl *> ParsedDecls = Action->takeTopLevelDecls();
+  std::vector<Range> SkippedBodies = Action->takeSkippedBodies(Content);
   // AST traversals should exclude the preamble, to avoid performance cliffs.
   Clang->getASTContext().setTraversalScope(ParsedDecls);
   {
@@ -375,9 +500,11 @@ ParsedAST::build(std::unique_ptr<CompilerInvocation> CI,
   // Add diagnostics from the preamble, if any.
   if (Preamble)
     Diags.insert(Diags.begin(), Preamble->Diags.begin(), Preamble->Diags.end());
-  return ParsedAST(std::move(Preamble), std::move(Clang), std::move(Action),
+  ParsedAST Result(std::move(Preamble), std::move(Clang), std::move(Action),
                    std::move(ParsedDecls), std::move(Diags),
                    std::move(Includes), std::move(CanonIncludes));
+  Result.SkippedBodies = std::move(SkippedBodies);
+  return std::move(Result);
 }
 
 ParsedAST::ParsedAST(ParsedAST &&Other) = default;
@@ -504,6 +631,7 @@ buildPreamble(PathRef FileName, CompilerInvocation &CI,
 
   trace::Span Tracer("BuildPreamble");
   SPAN_ATTACH(Tracer, "File", FileName);
+  TraceFileSystemOperations FSOps(Tracer);
   StoreDiags PreambleDiagnostics;
   llvm::IntrusiveRefCntPtr<DiagnosticsEngine> PreambleDiagsEngine =
       CompilerInstance::createDiagnostics(&CI.getDiagnosticOpts(),
@@ -539,16 +667,47 @@ buildPreamble(PathRef FileName, CompilerInvocation &CI,
   if (BuiltPreamble) {
     vlog("Built preamble of size {0} for file {1}", BuiltPreamble->getSize(),
          FileName);
-    return std::make_shared<PreambleData>(
+    auto Result = std::make_shared<PreambleData>(
         std::move(*BuiltPreamble), PreambleDiagnostics.take(),
         SerializedDeclsCollector.takeIncludes(), std::move(StatCache),
         SerializedDeclsCollector.takeCanonicalIncludes());
+    Result->CompileCommand = Inputs.CompileCommand;
+    Result->MainFilePreamble = Inputs.Contents.substr(0, Bounds.Size);
+    return Result;
   } else {
     elog("Could not build a preamble for file {0}", FileName);
     return nullptr;
   }
 }
 
+bool isPreambleCompatible(const PreambleData &Preamble,
+                          const ParseInputs &Inputs,
+                          const CompilerInvocation &CI) {
+  if (!compileCommandsAreEqual(Inputs.CompileCommand, Preamble.CompileCommand))
+    return false;
+  auto ContentsBuffer = llvm::MemoryBuffer::getMemBuffer(Inputs.Contents);
+  auto Bounds =
+      ComputePreambleBounds(*CI.getLangOpts(), ContentsBuffer.get(), 0);
+  return llvm::StringRef(Inputs.Contents).take_front(Bounds.Size) ==
+         Preamble.MainFilePreamble;
+}
+
+bool canPatchPreamble(const PreambleData &Preamble, const ParseInputs &Inputs,
+                      const CompilerInvocation &CI) {
+  return compileCommandsAreEqual(Inputs.CompileCommand,
+                                 Preamble.CompileCommand) &&
+         extendsPreamble(Preamble, Inputs.Contents, *CI.getLangOpts());
+}
+
+bool isPreambleUpToDate(const PreambleData &Preamble, const ParseInputs &Inputs,
+                        const CompilerInvocation &CI) {
+  auto ContentsBuffer = llvm::MemoryBuffer::getMemBuffer(Inputs.Contents);
+  auto Bounds =
+      ComputePreambleBounds(*CI.getLangOpts(), ContentsBuffer.get(), 0);
+  return Preamble.Preamble.CanReuse(CI, ContentsBuffer.get(), Bounds,
+                                    Inputs.FS.get());
+}
+
 llvm::Optional<ParsedAST>
 buildAST(PathRef FileName, std::unique_ptr<CompilerInvocation> Invocation,
          const ParseInputs &Inputs,
@@ -556,6 +715,7 @@ buildAST(PathRef FileName, std::unique_ptr<CompilerInvocation> Invocation,
          std::shared_ptr<PCHContainerOperations> PCHs) {
   trace::Span Tracer("BuildAST");
   SPAN_ATTACH(Tracer, "File", FileName);
+  TraceFileSystemOperations FSOps(Tracer);
 
   auto VFS = Inputs.FS;
   if (Preamble && Preamble->StatCache)
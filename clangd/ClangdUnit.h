@@ -53,6 +53,9 @@ struct PreambleData {
                CanonicalIncludes CanonIncludes);
 
   tooling::CompileCommand CompileCommand;
+  // The part of the main file covered by the preamble. Used to check whether
+  // an AST for newer contents can still be built on top of this preamble.
+  std::string MainFilePreamble;
   PrecompiledPreamble Preamble;
   std::vector<Diag> Diags;
   // Processes like code completions and go-to-definitions will need #include
@@ -62,6 +65,10 @@ struct PreambleData {
   // When reusing a preamble, this cache can be consumed to save IO.
   std::unique_ptr<PreambleFileStatusCache> StatCache;
   CanonicalIncludes CanonIncludes;
+  // Include paths calculated for the headers suggested by code completion and
+  // include fixes. They only depend on the header search paths, which are
+  // fixed by the preamble.
+  mutable IncludePathCache IncludePaths;
 };
 
 /// Stores and provides access to parsed AST.
@@ -69,6 +76,8 @@ class ParsedAST {
 public:
   /// Attempts to run Clang and store parsed AST. If \p Preamble is non-null
   /// it is reused during parsing.
+  /// Parsing stops early and None is returned if the current context is
+  /// cancelled meanwhile.
   static llvm::Optional<ParsedAST>
   build(std::unique_ptr<clang::CompilerInvocation> CI,
         std::shared_ptr<const PreambleData> Preamble,
@@ -105,6 +114,13 @@ public:
   const IncludeStructure &getIncludeStructure() const;
   const CanonicalIncludes &getCanonicalIncludes() const;
 
+  /// Returns the ranges of the function bodies that were not parsed, as
+  /// requested by ParseOptions::ParseBodiesIn. Features that look inside
+  /// function bodies should not use an AST with skipped bodies.
+  llvm::ArrayRef<Range> getSkippedFunctionBodies() const {
+    return SkippedBodies;
+  }
+
 private:
   ParsedAST(std::shared_ptr<const PreambleData> Preamble,
             std::unique_ptr<CompilerInstance> Clang,
@@ -130,6 +146,7 @@ private:
   std::vector<Decl *> LocalTopLevelDecls;
   IncludeStructure Includes;
   CanonicalIncludes CanonIncludes;
+  std::vector<Range> SkippedBodies;
 };
 
 using PreambleParsedCallback =
@@ -150,6 +167,27 @@ buildPreamble(PathRef FileName, CompilerInvocation &CI,
               std::shared_ptr<PCHContainerOperations> PCHs, bool StoreInMemory,
               PreambleParsedCallback PreambleCallback);
 
+/// Returns true if an AST for \p Inputs can be built on top of \p Preamble,
+/// i.e. it was built with the same compile command for the same preamble
+/// region of the main file. The headers it includes may have changed since, so
+/// the preamble can be stale.
+bool isPreambleCompatible(const PreambleData &Preamble,
+                          const ParseInputs &Inputs,
+                          const CompilerInvocation &CI);
+
+/// Returns true if \p Inputs only appended directives, e.g. an #include, to
+/// the preamble region of \p Preamble, and were compiled with the same
+/// command. An AST can then be built on top of \p Preamble, the appended
+/// directives are parsed as part of the main file.
+bool canPatchPreamble(const PreambleData &Preamble, const ParseInputs &Inputs,
+                      const CompilerInvocation &CI);
+
+/// Returns true if \p Preamble covers the same preamble region as \p Inputs
+/// and none of the files it includes changed since it was built. Unlike
+/// isPreambleCompatible, this doesn't check the compile command.
+bool isPreambleUpToDate(const PreambleData &Preamble, const ParseInputs &Inputs,
+                        const CompilerInvocation &CI);
+
 /// Build an AST from provided user inputs. This function does not check if
 /// preamble can be reused, as this function expects that \p Preamble is the
 /// result of calling buildPreamble.
@@ -24,6 +24,7 @@
 #include "Compiler.h"
 #include "Diagnostics.h"
 #include "ExpectedTypes.h"
+#include "FS.h"
 #include "FileDistance.h"
 #include "FuzzyMatch.h"
 #include "Headers.h"
@@ -242,6 +243,9 @@ struct CompletionCandidate {
 };
 using ScoredBundle =
     std::pair<CompletionCandidate::Bundle, CodeCompletion::Scores>;
+// Beyond this many candidates, converting all of them to CodeCompletions to
+// reuse them later costs more than running completion again.
+const size_t MaxCandidatePoolSize = 1000;
 struct ScoredBundleGreater {
   bool operator()(const ScoredBundle &L, const ScoredBundle &R) {
     if (L.second.Total != R.second.Total)
@@ -267,6 +271,7 @@ struct CodeCompletionBuilder {
                         CodeCompletionContext::Kind ContextKind,
                         const CodeCompleteOptions &Opts)
       : ASTCtx(ASTCtx), ExtractDocumentation(Opts.IncludeComments),
+        DeferIndexDocumentation(Opts.DeferIndexComments),
         EnableFunctionArgSnippets(Opts.EnableFunctionArgSnippets) {
     add(C, SemaCCS);
     if (C.SemaResult) {
@@ -370,8 +375,12 @@ struct CodeCompletionBuilder {
       S.SnippetSuffix = C.IndexResult->CompletionSnippetSuffix;
       S.ReturnType = C.IndexResult->ReturnType;
     }
-    if (ExtractDocumentation && Completion.Documentation.empty()) {
-      if (C.IndexResult)
+    if (ExtractDocumentation && Completion.Documentation.empty() &&
+        !Completion.DeferredDocumentation) {
+      if (C.IndexResult && DeferIndexDocumentation &&
+          !C.IndexResult->Documentation.empty())
+        Completion.DeferredDocumentation = C.IndexResult->ID;
+      else if (C.IndexResult)
         Completion.Documentation = C.IndexResult->Documentation;
       else if (C.SemaResult)
         Completion.Documentation = getDocComment(ASTCtx, *C.SemaResult,
@@ -473,6 +482,7 @@ private:
   CodeCompletion Completion;
   llvm::SmallVector<BundledEntry, 1> Bundled;
   bool ExtractDocumentation;
+  bool DeferIndexDocumentation;
   bool EnableFunctionArgSnippets;
 };
 
@@ -994,6 +1004,7 @@ bool semaCodeComplete(std::unique_ptr<CodeCompleteConsumer> Consumer,
                       const SemaCompleteInput &Input,
                       IncludeStructure *Includes = nullptr) {
   trace::Span Tracer("Sema completion");
+  TraceFileSystemOperations FSOps(Tracer);
   llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS = Input.VFS;
   if (Input.Preamble && Input.Preamble->StatCache)
     VFS = Input.Preamble->StatCache->getConsumingFS(std::move(VFS));
@@ -1008,6 +1019,8 @@ bool semaCodeComplete(std::unique_ptr<CodeCompleteConsumer> Consumer,
     return false;
   }
   auto &FrontendOpts = CI->getFrontendOpts();
+  // In code completion mode, the parser still parses the function body that
+  // contains the completion point, and skips all the others.
   FrontendOpts.SkipFunctionBodies = true;
   // Disable typo correction in Sema.
   CI->getLangOpts()->SpellChecking = false;
@@ -1135,7 +1148,10 @@ speculativeFuzzyFindRequestForCompletion(FuzzyFindRequest CachedReq,
 //   - we may get duplicate results from Sema and the Index, we need to merge.
 //
 // So we start Sema completion first, and do all our work in its callback.
-// We use the Sema context information to query the index.
+// We use the Sema context information to query the index. If a speculative
+// query with the same request already started before Sema ran, we look up the
+// SymbolIDs of the Sema results while it runs and then wait for its results.
+// Otherwise we run the query on this thread.
 // Then we merge the two result sets, producing items that are Sema/Index/Both.
 // These items are scored, and the top N are synthesized into the LSP response.
 // Finally, we can clean up the data structures created by Sema completion.
@@ -1155,6 +1171,7 @@ class CodeCompleteFlow {
   PathRef FileName;
   IncludeStructure Includes;           // Complete once the compiler runs.
   SpeculativeFuzzyFind *SpecFuzzyFind; // Can be nullptr.
+  llvm::Optional<CompletionCandidatePool> *Pool; // Can be nullptr.
   const CodeCompleteOptions &Opts;
 
   // Sema takes ownership of Recorder. Recorder is valid until Sema cleanup.
@@ -1171,29 +1188,40 @@ class CodeCompleteFlow {
   // Include-insertion and proximity scoring rely on the include structure.
   // This is available after Sema has run.
   llvm::Optional<IncludeInserter> Inserter;  // Available during runWithSema.
-  llvm::Optional<URIDistance> FileProximity; // Initialized once Sema runs.
+  std::shared_ptr<URIDistance> FileProximity; // Initialized once Sema runs.
   /// Speculative request based on the cached request and the filter text before
   /// the cursor.
   /// Initialized right before sema run. This is only set if `SpecFuzzyFind` is
   /// set and contains a cached request.
   llvm::Optional<FuzzyFindRequest> SpecReq;
+  /// When the speculative index query started, before Sema.
+  std::chrono::steady_clock::time_point IndexStart;
+  /// How long the index query ran while we did other work, and how long we
+  /// then blocked on its results. Only speculative queries overlap with other
+  /// work, both are zero if the index wasn't queried.
+  std::chrono::steady_clock::duration IndexOverlap{}, IndexWait{};
 
 public:
   // A CodeCompleteFlow object is only useful for calling run() exactly once.
   CodeCompleteFlow(PathRef FileName, const IncludeStructure &Includes,
                    SpeculativeFuzzyFind *SpecFuzzyFind,
+                   llvm::Optional<CompletionCandidatePool> *Pool,
                    const CodeCompleteOptions &Opts)
       : FileName(FileName), Includes(Includes), SpecFuzzyFind(SpecFuzzyFind),
-        Opts(Opts) {}
+        Pool(Pool), Opts(Opts) {}
 
   CodeCompleteResult run(const SemaCompleteInput &SemaCCInput) && {
     trace::Span Tracer("CodeCompleteFlow");
+    if (Pool)
+      Pool->reset();
     if (Opts.Index && SpecFuzzyFind && SpecFuzzyFind->CachedReq.hasValue()) {
       assert(!SpecFuzzyFind->Result.valid());
       if ((SpecReq = speculativeFuzzyFindRequestForCompletion(
                *SpecFuzzyFind->CachedReq, SemaCCInput.FileName,
-               SemaCCInput.Contents, SemaCCInput.Pos)))
+               SemaCCInput.Contents, SemaCCInput.Pos))) {
+        IndexStart = std::chrono::steady_clock::now();
         SpecFuzzyFind->Result = startAsyncFuzzyFind(*Opts.Index, *SpecReq);
+      }
     }
 
     // We run Sema code completion first. It builds an AST and calculates:
@@ -1206,10 +1234,13 @@ public:
           SemaCCInput.FileName, SemaCCInput.Contents, SemaCCInput.VFS.get());
       // If preprocessor was run, inclusions from preprocessor callback should
       // already be added to Includes.
+      // The include paths of index results are calculated once per preamble.
       Inserter.emplace(
           SemaCCInput.FileName, SemaCCInput.Contents, Style,
           SemaCCInput.Command.Directory,
-          Recorder->CCSema->getPreprocessor().getHeaderSearchInfo());
+          Recorder->CCSema->getPreprocessor().getHeaderSearchInfo(),
+          SemaCCInput.Preamble ? &SemaCCInput.Preamble->IncludePaths
+                               : nullptr);
       for (const auto &Inc : Includes.MainFileIncludes)
         Inserter->addExisting(Inc);
 
@@ -1217,6 +1248,8 @@ public:
       // structures based on the observed includes, once per query. Conceptually
       // that happens here (though the per-URI-scheme initialization is lazy).
       // The per-result proximity scoring is (amortized) very cheap.
+      // If the includes didn't change since an earlier query, we share its
+      // structures and the distances it computed.
       FileDistanceOptions ProxOpts{}; // Use defaults.
       const auto &SM = Recorder->CCSema->getSourceManager();
       llvm::StringMap<SourceParams> ProxSources;
@@ -1230,9 +1263,13 @@ public:
         if (Entry.getValue() > 0)
           Source.MaxUpTraversals = 1;
       }
-      FileProximity.emplace(ProxSources, ProxOpts);
+      FileProximity =
+          Opts.FileProximityCache
+              ? Opts.FileProximityCache->get(std::move(ProxSources), ProxOpts)
+              : std::make_shared<URIDistance>(std::move(ProxSources),
+                                              ProxOpts);
 
-      Output = runWithSema();
+      Output = runWithSema(SemaCCInput);
       Inserter.reset(); // Make sure this doesn't out-live Clang.
       SPAN_ATTACH(Tracer, "sema_completion_kind",
                   getCompletionKindString(Recorder->CCContext.getKind()));
@@ -1254,6 +1291,13 @@ public:
     SPAN_ATTACH(Tracer, "merged_results", NBoth);
     SPAN_ATTACH(Tracer, "returned_results", int64_t(Output.Completions.size()));
     SPAN_ATTACH(Tracer, "incomplete", Output.HasMore);
+    SPAN_ATTACH(Tracer, "index_overlap_ms",
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    IndexOverlap)
+                    .count());
+    SPAN_ATTACH(Tracer, "index_wait_ms",
+                std::chrono::duration_cast<std::chrono::milliseconds>(IndexWait)
+                    .count());
     log("Code complete: {0} results from Sema, {1} from Index, "
         "{2} matched, {3} returned{4}.",
         NSema, NIndex, NBoth, Output.Completions.size(),
@@ -1267,7 +1311,7 @@ public:
 private:
   // This is called by run() once Sema code completion is done, but before the
   // Sema data structures are torn down. It does all the real work.
-  CodeCompleteResult runWithSema() {
+  CodeCompleteResult runWithSema(const SemaCompleteInput &SemaCCInput) {
     const auto &CodeCompletionRange = CharSourceRange::getCharRange(
         Recorder->CCSema->getPreprocessor().getCodeCompletionTokenRange());
     Range TextEditRange;
@@ -1299,27 +1343,93 @@ private:
     //        explicitly request symbols corresponding to Sema results.
     //        We can use their signals even if the index can't suggest them.
     // We must copy index results to preserve them, but there are at most Limit.
-    auto IndexResults = (Opts.Index && allowIndex(Recorder->CCContext))
-                            ? queryIndex()
-                            : SymbolSlab();
+    std::vector<llvm::Optional<SymbolID>> SemaIDs;
+    SymbolSlab IndexResults;
+    bool QueriedIndex = Opts.Index && allowIndex(Recorder->CCContext);
+    if (QueriedIndex)
+      IndexResults = queryIndex(SemaIDs);
+    // The candidates can only be reused if the index gave us all its matches,
+    // and if a longer filter can't match more. Dex only looks up filters of one
+    // or two characters by the start of the names, e.g. "f" doesn't find
+    // getFoo() while "foo" does.
+    size_t FilterLength = Filter->pattern().size();
+    bool KeepAll = Pool && !Incomplete &&
+                   !(Opts.Limit && IndexResults.size() >= Opts.Limit) &&
+                   !(QueriedIndex && FilterLength > 0 && FilterLength < 3);
     trace::Span Tracer("Populate CodeCompleteResult");
     // Merge Sema and Index results, score them, and pick the winners.
-    auto Top = mergeResults(Recorder->Results, IndexResults);
+    auto Top = mergeResults(Recorder->Results, SemaIDs, IndexResults, KeepAll);
+    size_t NumReturned = Top.size();
+    if (Opts.Limit && NumReturned > Opts.Limit) {
+      NumReturned = Opts.Limit;
+      Incomplete = true;
+    }
+    llvm::Optional<CompletionCandidatePool> NewPool;
+    if (KeepAll && Top.size() <= MaxCandidatePoolSize)
+      NewPool = createPool(SemaCCInput.Contents, SemaCCInput.Pos);
     CodeCompleteResult Output;
 
     // Convert the results to final form, assembling the expensive strings.
-    for (auto &C : Top) {
-      Output.Completions.push_back(toCodeCompletion(C.first));
-      Output.Completions.back().Score = C.second;
-      Output.Completions.back().CompletionTokenRange = TextEditRange;
+    // The ones we don't return are only needed for the pool.
+    for (size_t I = 0; I < Top.size() && (I < NumReturned || NewPool); ++I) {
+      auto &C = Top[I];
+      CodeCompletion Completion = toCodeCompletion(C.first);
+      Completion.Score = C.second;
+      Completion.CompletionTokenRange = TextEditRange;
+      if (NewPool) {
+        const CompletionCandidate &First = C.first.front();
+        NewPool->Candidates.emplace_back();
+        auto &Candidate = NewPool->Candidates.back();
+        Candidate.FilterName = First.Name;
+        Candidate.NameMatch = *fuzzyScore(First);
+        Candidate.PrefixMatchOnly =
+            First.SemaResult &&
+            First.SemaResult->Kind == CodeCompletionResult::RK_Macro;
+        Candidate.Completion = Completion;
+      }
+      if (I < NumReturned)
+        Output.Completions.push_back(std::move(Completion));
     }
     Output.HasMore = Incomplete;
     Output.Context = Recorder->CCContext.getKind();
+    if (NewPool) {
+      NewPool->Context = Output.Context;
+      *Pool = std::move(NewPool);
+    }
 
     return Output;
   }
 
-  SymbolSlab queryIndex() {
+  // Returns an empty pool for the candidates of this completion, or None if
+  // the filter Sema used is not the identifier before the cursor, as we'd
+  // compute it when reusing the pool.
+  llvm::Optional<CompletionCandidatePool> createPool(llvm::StringRef Contents,
+                                                     Position Pos) {
+    auto Offset = positionToOffset(Contents, Pos);
+    if (!Offset) {
+      llvm::consumeError(Offset.takeError());
+      return None;
+    }
+    auto SpeculatedFilter = speculateCompletionFilter(Contents, Pos);
+    if (!SpeculatedFilter) {
+      llvm::consumeError(SpeculatedFilter.takeError());
+      return None;
+    }
+    if (*SpeculatedFilter != Filter->pattern())
+      return None;
+    CompletionCandidatePool Result;
+    Result.Contents = Contents;
+    Result.Cursor = *Offset;
+    Result.FilterStart = *Offset - SpeculatedFilter->size();
+    return Result;
+  }
+
+  // Queries the index, and computes the SymbolIDs of the Sema results that are
+  // needed to merge them with the index results.
+  // If the speculative query matches, its results are awaited after computing
+  // SemaIDs. Otherwise the query runs on this thread: there is too little work
+  // to overlap with it to pay for starting another thread.
+  SymbolSlab queryIndex(std::vector<llvm::Optional<SymbolID>> &SemaIDs) {
     trace::Span Tracer("Query index");
     SPAN_ATTACH(Tracer, "limit", int64_t(Opts.Limit));
 
@@ -1339,31 +1449,43 @@ private:
 
     if (SpecFuzzyFind)
       SpecFuzzyFind->NewReq = Req;
+    for (const auto &SemaResult : Recorder->Results)
+      SemaIDs.push_back(
+          getSymbolID(SemaResult, Recorder->CCSema->getSourceManager()));
     if (SpecFuzzyFind && SpecFuzzyFind->Result.valid() && (*SpecReq == Req)) {
       vlog("Code complete: speculative fuzzy request matches the actual index "
            "request. Waiting for the speculative index results.");
       SPAN_ATTACH(Tracer, "Speculative results", true);
-
-      trace::Span WaitSpec("Wait speculative results");
-      return SpecFuzzyFind->Result.get();
+      trace::Span WaitIndex("Wait index results");
+      auto WaitStart = std::chrono::steady_clock::now();
+      SymbolSlab Results = SpecFuzzyFind->Result.get();
+      IndexOverlap = WaitStart - IndexStart;
+      IndexWait = std::chrono::steady_clock::now() - WaitStart;
+      return Results;
     }
 
     SPAN_ATTACH(Tracer, "Speculative results", false);
 
     // Run the query against the index.
+    auto QueryStart = std::chrono::steady_clock::now();
     SymbolSlab::Builder ResultsBuilder;
     if (Opts.Index->fuzzyFind(
             Req, [&](const Symbol &Sym) { ResultsBuilder.insert(Sym); }))
       Incomplete = true;
+    IndexWait = std::chrono::steady_clock::now() - QueryStart;
     return std::move(ResultsBuilder).build();
   }
 
   // Merges Sema and Index results where possible, to form CompletionCandidates.
+  // SemaIDs are the SymbolIDs of the Sema results, or empty if there are no
+  // Index results.
   // Groups overloads if desired, to form CompletionCandidate::Bundles. The
-  // bundles are scored and top results are returned, best to worst.
+  // bundles are scored and top results are returned, best to worst. If KeepAll
+  // is set, all the results are returned, not only the top Opts.Limit.
   std::vector<ScoredBundle>
   mergeResults(const std::vector<CodeCompletionResult> &SemaResults,
-               const SymbolSlab &IndexResults) {
+               llvm::ArrayRef<llvm::Optional<SymbolID>> SemaIDs,
+               const SymbolSlab &IndexResults, bool KeepAll) {
     trace::Span Tracer("Merge and score results");
     std::vector<CompletionCandidate::Bundle> Bundles;
     llvm::DenseMap<size_t, size_t> BundleLookup;
@@ -1386,21 +1508,18 @@ private:
       }
     };
     llvm::DenseSet<const Symbol *> UsedIndexResults;
-    auto CorrespondingIndexResult =
-        [&](const CodeCompletionResult &SemaResult) -> const Symbol * {
-      if (auto SymID =
-              getSymbolID(SemaResult, Recorder->CCSema->getSourceManager())) {
-        auto I = IndexResults.find(*SymID);
-        if (I != IndexResults.end()) {
-          UsedIndexResults.insert(&*I);
-          return &*I;
-        }
-      }
-      return nullptr;
+    auto CorrespondingIndexResult = [&](size_t SemaIndex) -> const Symbol * {
+      if (SemaIDs.empty() || !SemaIDs[SemaIndex])
+        return nullptr;
+      auto I = IndexResults.find(*SemaIDs[SemaIndex]);
+      if (I == IndexResults.end())
+        return nullptr;
+      UsedIndexResults.insert(&*I);
+      return &*I;
     };
     // Emit all Sema results, merging them with Index results if possible.
-    for (auto &SemaResult : Recorder->Results)
-      AddToBundles(&SemaResult, CorrespondingIndexResult(SemaResult));
+    for (size_t I = 0; I < SemaResults.size(); ++I)
+      AddToBundles(&SemaResults[I], CorrespondingIndexResult(I));
     // Now emit any Index-only results.
     for (const auto &IndexResult : IndexResults) {
       if (UsedIndexResults.count(&IndexResult))
@@ -1409,7 +1528,8 @@ private:
     }
     // We only keep the best N results at any time, in "native" format.
     TopN<ScoredBundle, ScoredBundleGreater> Top(
-        Opts.Limit == 0 ? std::numeric_limits<size_t>::max() : Opts.Limit);
+        (Opts.Limit == 0 || KeepAll) ? std::numeric_limits<size_t>::max()
+                                     : Opts.Limit);
     for (auto &Bundle : Bundles)
       addCandidate(Top, std::move(Bundle));
     return std::move(Top).items();
@@ -1431,7 +1551,7 @@ private:
     SymbolRelevanceSignals Relevance;
     Relevance.Context = Recorder->CCContext.getKind();
     Relevance.Query = SymbolRelevanceSignals::CodeComplete;
-    Relevance.FileProximityMatch = FileProximity.getPointer();
+    Relevance.FileProximityMatch = FileProximity.get();
     if (ScopeProximity)
       Relevance.ScopeProximityMatch = ScopeProximity.getPointer();
     if (PreferredType)
@@ -1561,13 +1681,81 @@ codeComplete(PathRef FileName, const tooling::CompileCommand &Command,
              const PreambleData *Preamble, llvm::StringRef Contents,
              Position Pos, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
              std::shared_ptr<PCHContainerOperations> PCHs,
-             CodeCompleteOptions Opts, SpeculativeFuzzyFind *SpecFuzzyFind) {
+             CodeCompleteOptions Opts, SpeculativeFuzzyFind *SpecFuzzyFind,
+             llvm::Optional<CompletionCandidatePool> *Pool) {
   return CodeCompleteFlow(FileName,
                           Preamble ? Preamble->Includes : IncludeStructure(),
-                          SpecFuzzyFind, Opts)
+                          SpecFuzzyFind, Pool, Opts)
       .run({FileName, Command, Preamble, Contents, Pos, VFS, PCHs});
 }
 
+llvm::Optional<CodeCompleteResult>
+reuseCompletionCandidates(const CompletionCandidatePool &Pool,
+                          llvm::StringRef Contents, Position Pos,
+                          const CodeCompleteOptions &Opts) {
+  trace::Span Tracer("Reuse completion candidates");
+  auto Offset = positionToOffset(Contents, Pos);
+  if (!Offset) {
+    llvm::consumeError(Offset.takeError());
+    return None;
+  }
+  auto Filter = speculateCompletionFilter(Contents, Pos);
+  if (!Filter) {
+    llvm::consumeError(Filter.takeError());
+    return None;
+  }
+  // Only the end of the identifier being completed may have changed.
+  llvm::StringRef OldContents = Pool.Contents;
+  if (*Offset - Filter->size() != Pool.FilterStart ||
+      !Filter->startswith(
+          OldContents.slice(Pool.FilterStart, Pool.Cursor)) ||
+      Contents.take_front(Pool.FilterStart) !=
+          OldContents.take_front(Pool.FilterStart) ||
+      Contents.drop_front(*Offset) != OldContents.drop_front(Pool.Cursor))
+    return None;
+  // The identifier is ASCII, so its length in bytes is its length in UTF-16.
+  int Typed = *Offset - Pool.Cursor;
+
+  using ScoredCandidate =
+      std::pair<const CompletionCandidatePool::Candidate *,
+                CodeCompletion::Scores>;
+  struct ScoredCandidateGreater {
+    bool operator()(const ScoredCandidate &L, const ScoredCandidate &R) {
+      if (L.second.Total != R.second.Total)
+        return L.second.Total > R.second.Total;
+      return L.first->FilterName < R.first->FilterName;
+    }
+  };
+  CodeCompleteResult Output;
+  TopN<ScoredCandidate, ScoredCandidateGreater> Top(
+      Opts.Limit == 0 ? std::numeric_limits<size_t>::max() : Opts.Limit);
+  FuzzyMatcher Matcher(*Filter);
+  for (const auto &Candidate : Pool.Candidates) {
+    if (Candidate.PrefixMatchOnly &&
+        !llvm::StringRef(Candidate.FilterName).startswith_lower(*Filter))
+      continue;
+    auto NameMatch = Matcher.match(Candidate.FilterName);
+    if (!NameMatch)
+      continue;
+    // NameMatch is a multiplier on the total score, see addCandidate().
+    CodeCompletion::Scores Scores = Candidate.Completion.Score;
+    Scores.Total = Scores.ExcludingName * *NameMatch;
+    if (Candidate.NameMatch)
+      Scores.Relevance *= *NameMatch / Candidate.NameMatch;
+    if (Top.push({&Candidate, Scores}))
+      Output.HasMore = true;
+  }
+  for (auto &C : std::move(Top).items()) {
+    Output.Completions.push_back(C.first->Completion);
+    Output.Completions.back().Score = C.second;
+    Output.Completions.back().CompletionTokenRange.end.character += Typed;
+  }
+  Output.Context = Pool.Context;
+  SPAN_ATTACH(Tracer, "candidates", int64_t(Pool.Candidates.size()));
+  SPAN_ATTACH(Tracer, "returned_results", int64_t(Output.Completions.size()));
+  return Output;
+}
+
 SignatureHelp signatureHelp(PathRef FileName,
                             const tooling::CompileCommand &Command,
                             const PreambleData *Preamble,
@@ -1627,6 +1815,7 @@ CompletionItem CodeCompletion::render(const CodeCompleteOptions &Opts) const {
   if (InsertInclude)
     LSP.detail += "\n" + InsertInclude->Header;
   LSP.documentation = Documentation;
+  LSP.data = DeferredDocumentation;
   LSP.sortText = sortText(Score.Total, Name);
   LSP.filterText = Name;
   LSP.textEdit = {CompletionTokenRange, RequiredQualifier + Name};
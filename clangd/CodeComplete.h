@@ -35,6 +35,7 @@ namespace clang {
 class NamedDecl;
 class PCHContainerOperations;
 namespace clangd {
+class URIDistanceCache;
 
 struct CodeCompleteOptions {
   /// Returns options that can be passed to clang's completion engine.
@@ -56,6 +57,11 @@ struct CodeCompleteOptions {
   /// Add comments to code completion results, if available.
   bool IncludeComments = true;
 
+  /// Leave the comments of index results out of the completion items, and
+  /// record the symbols instead. The client fetches them with a
+  /// completionItem/resolve request when it shows the item.
+  bool DeferIndexComments = false;
+
   /// Include results that are not legal completions in the current context.
   /// For example, private members are usually inaccessible.
   bool IncludeIneligibleResults = false;
@@ -87,6 +93,11 @@ struct CodeCompleteOptions {
   /// this should be effective for a number of code completions.
   bool SpeculativeIndexRequest = false;
 
+  /// If set to true, the candidates of the last code completion in a file are
+  /// kept. When the user then types more of the same identifier, completion
+  /// filters and ranks them again instead of running Sema and the index.
+  bool ReuseCandidates = false;
+
   // Populated internally by clangd, do not set.
   /// If `Index` is set, it is used to augment the code completion
   /// results.
@@ -94,6 +105,10 @@ struct CodeCompleteOptions {
   /// clangd.
   const SymbolIndex *Index = nullptr;
 
+  /// If set, completions with the same file proximity sources share their
+  /// URIDistance through this cache.
+  URIDistanceCache *FileProximityCache = nullptr;
+
   /// Include completions that require small corrections, e.g. change '.' to
   /// '->' on member access etc.
   bool IncludeFixIts = false;
@@ -128,6 +143,9 @@ struct CodeCompletion {
   // Type to be displayed for this completion.
   std::string ReturnType;
   std::string Documentation;
+  // The index symbol whose documentation was left out of this item, see
+  // CodeCompleteOptions::DeferIndexComments.
+  llvm::Optional<SymbolID> DeferredDocumentation;
   CompletionItemKind Kind = CompletionItemKind::Missing;
   // This completion item may represent several symbols that can be inserted in
   // the same way, such as function overloads. In this case BundleSize > 1, and
@@ -213,20 +231,54 @@ struct SpeculativeFuzzyFind {
   std::future<SymbolSlab> Result;
 };
 
+/// All the candidates of a code completion that matched its filter, before
+/// they were truncated to the limit. As long as only the identifier being
+/// completed changes, and only by typing more of it, the candidates for the
+/// new filter are among these.
+struct CompletionCandidatePool {
+  struct Candidate {
+    CodeCompletion Completion;
+    /// The name that is matched against the filter.
+    std::string FilterName;
+    /// The fuzzy match score of FilterName against the old filter.
+    float NameMatch = 0.f;
+    /// Whether the filter must be a prefix of FilterName, e.g. for macros.
+    bool PrefixMatchOnly = false;
+  };
+  std::vector<Candidate> Candidates;
+  CodeCompletionContext::Kind Context = CodeCompletionContext::CCC_Other;
+  /// The file contents the candidates were computed for, and the offsets of
+  /// the filter and of the cursor in them.
+  std::string Contents;
+  size_t FilterStart = 0;
+  size_t Cursor = 0;
+};
+
 /// Get code completions at a specified \p Pos in \p FileName.
 /// If \p SpecFuzzyFind is set, a speculative and asynchronous fuzzy find index
 /// request (based on cached request) will be run before parsing sema. In case
 /// the speculative result is used by code completion (e.g. speculation failed),
 /// the speculative result is not consumed, and `SpecFuzzyFind` is only
 /// destroyed when the async request finishes.
-CodeCompleteResult codeComplete(PathRef FileName,
-                                const tooling::CompileCommand &Command,
-                                const PreambleData *Preamble,
-                                StringRef Contents, Position Pos,
-                                IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
-                                std::shared_ptr<PCHContainerOperations> PCHs,
-                                CodeCompleteOptions Opts,
-                                SpeculativeFuzzyFind *SpecFuzzyFind = nullptr);
+/// If \p Pool is set, it receives the candidates of this completion if they
+/// can be reused by reuseCompletionCandidates(), and is reset otherwise.
+CodeCompleteResult
+codeComplete(PathRef FileName, const tooling::CompileCommand &Command,
+             const PreambleData *Preamble, StringRef Contents, Position Pos,
+             IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
+             std::shared_ptr<PCHContainerOperations> PCHs,
+             CodeCompleteOptions Opts,
+             SpeculativeFuzzyFind *SpecFuzzyFind = nullptr,
+             llvm::Optional<CompletionCandidatePool> *Pool = nullptr);
+
+/// Get code completions at \p Pos from the candidates of an earlier completion.
+/// Returns None if the identifier being completed is not the one of \p Pool,
+/// with more characters typed at its end, or if anything else in \p Contents
+/// changed.
+llvm::Optional<CodeCompleteResult>
+reuseCompletionCandidates(const CompletionCandidatePool &Pool,
+                          StringRef Contents, Position Pos,
+                          const CodeCompleteOptions &Opts);
 
 /// Get signature help at a specified \p Pos in \p FileName.
 SignatureHelp signatureHelp(PathRef FileName,
@@ -38,6 +38,12 @@ public:
 struct ParseOptions {
   tidy::ClangTidyOptions ClangTidyOpts;
   bool SuggestMissingIncludes = false;
+  /// Files at least this large are first reparsed without the bodies of the
+  /// functions that were not edited, and then parsed in full. 0 disables this.
+  std::size_t SkipUnchangedBodiesMinSize = 0;
+  /// If set, bodies of main file functions that don't overlap this range of
+  /// offsets are not parsed.
+  llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn;
 };
 
 /// Information required to run clang, e.g. to parse AST or do code completion.
@@ -47,6 +47,8 @@ struct DiagBase {
   clangd::Range Range;
   DiagnosticsEngine::Level Severity = DiagnosticsEngine::Note;
   std::string Category;
+  // The clang diagnostic ID, e.g. diag::warn_unused_function.
+  unsigned ID = 0;
   // Since File is only descriptive, we store a separate flag to distinguish
   // diags from the main file.
   bool InsideMainFile = false;
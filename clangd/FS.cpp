@@ -9,6 +9,8 @@
 #include "FS.h"
 #include "clang/Basic/LLVM.h"
 #include "llvm/ADT/None.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
 
 namespace clang {
@@ -100,5 +102,287 @@ PreambleFileStatusCache::getConsumingFS(
   return llvm::IntrusiveRefCntPtr<CacheVFS>(new CacheVFS(std::move(FS), *this));
 }
 
+namespace {
+TraceFileSystemOperations::Counts &threadCounts() {
+  static thread_local TraceFileSystemOperations::Counts C;
+  return C;
+}
+
+/// A buffer that keeps the cached contents of a file alive.
+class SharedBuffer : public llvm::MemoryBuffer {
+public:
+  SharedBuffer(std::shared_ptr<const llvm::MemoryBuffer> Data,
+               std::string Name)
+      : Data(std::move(Data)), Name(std::move(Name)) {
+    init(this->Data->getBufferStart(), this->Data->getBufferEnd(),
+         /*RequiresNullTerminator=*/false);
+  }
+
+  llvm::StringRef getBufferIdentifier() const override { return Name; }
+  BufferKind getBufferKind() const override { return MemoryBuffer_Malloc; }
+
+private:
+  std::shared_ptr<const llvm::MemoryBuffer> Data;
+  std::string Name;
+};
+
+class CachedFile : public llvm::vfs::File {
+public:
+  CachedFile(llvm::vfs::Status S,
+             std::shared_ptr<const llvm::MemoryBuffer> Contents)
+      : S(std::move(S)), Contents(std::move(Contents)) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status() override { return S; }
+  llvm::ErrorOr<std::string> getName() override { return S.getName(); }
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+  getBuffer(const llvm::Twine &Name, int64_t FileSize,
+            bool RequiresNullTerminator, bool IsVolatile) override {
+    return llvm::make_unique<SharedBuffer>(Contents, Name.str());
+  }
+  std::error_code close() override { return std::error_code(); }
+
+private:
+  llvm::vfs::Status S;
+  std::shared_ptr<const llvm::MemoryBuffer> Contents;
+};
+
+bool sameFile(const llvm::vfs::Status &L, const llvm::vfs::Status &R) {
+  return L.getUniqueID() == R.getUniqueID() && L.getSize() == R.getSize() &&
+         L.getLastModificationTime() == R.getLastModificationTime();
+}
+} // namespace
+
+class SharedFileCache::CachingFS : public llvm::vfs::ProxyFileSystem {
+public:
+  CachingFS(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS,
+            SharedFileCache &Cache)
+      : ProxyFileSystem(std::move(FS)), Cache(Cache) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &Path) override {
+    llvm::SmallString<128> AbsPath;
+    if (!absolutePath(Path, AbsPath))
+      return countedStatus(Path);
+    if (auto S = Cache.lookupStatus(AbsPath)) {
+      ++threadCounts().CacheHits;
+      if (!*S)
+        return *S;
+      return llvm::vfs::Status::copyWithNewName(**S, Path.str());
+    }
+    auto S = countedStatus(Path);
+    Cache.updateStatus(AbsPath, S);
+    return S;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const llvm::Twine &Path) override {
+    llvm::SmallString<128> AbsPath;
+    if (Cache.MaxBytes == 0 || !absolutePath(Path, AbsPath))
+      return countedOpen(Path);
+    auto S = status(Path);
+    if (S && S->isRegularFile()) {
+      if (auto Contents = Cache.lookupContents(AbsPath, *S)) {
+        ++threadCounts().CacheHits;
+        return llvm::make_unique<CachedFile>(std::move(*S),
+                                             std::move(Contents));
+      }
+    }
+    auto File = countedOpen(Path);
+    if (!File || !S || !S->isRegularFile() || !Cache.hasRoomFor(S->getSize()))
+      return File;
+    // Preambles are written by clangd, and each is only read by a few files.
+    if (llvm::sys::path::parent_path(AbsPath) == Cache.TempDir)
+      return File;
+    // Read the whole file now, as the returned file must not depend on the
+    // underlying one anymore.
+    auto Contents = (*File)->getBuffer(Path, S->getSize(),
+                                       /*RequiresNullTerminator=*/true,
+                                       /*IsVolatile=*/true);
+    if (!Contents)
+      return Contents.getError();
+    std::shared_ptr<const llvm::MemoryBuffer> Shared = std::move(*Contents);
+    Cache.updateContents(AbsPath, *S, Shared);
+    return llvm::make_unique<CachedFile>(std::move(*S), std::move(Shared));
+  }
+
+  llvm::vfs::directory_iterator dir_begin(const llvm::Twine &Dir,
+                                          std::error_code &EC) override {
+    ++threadCounts().DirectoryListings;
+    return ProxyFileSystem::dir_begin(Dir, EC);
+  }
+
+private:
+  bool absolutePath(const llvm::Twine &Path,
+                    llvm::SmallVectorImpl<char> &Result) {
+    Path.toVector(Result);
+    if (makeAbsolute(Result))
+      return false;
+    llvm::sys::path::remove_dots(Result, /*remove_dot_dot=*/false);
+    return true;
+  }
+
+  llvm::ErrorOr<llvm::vfs::Status> countedStatus(const llvm::Twine &Path) {
+    ++threadCounts().Stats;
+    return getUnderlyingFS().status(Path);
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  countedOpen(const llvm::Twine &Path) {
+    ++threadCounts().Opens;
+    return getUnderlyingFS().openFileForRead(Path);
+  }
+
+  SharedFileCache &Cache;
+};
+
+SharedFileCache::SharedFileCache(
+    std::chrono::steady_clock::duration MaxStatusAge, std::size_t MaxBytes)
+    : MaxStatusAge(MaxStatusAge), MaxBytes(MaxBytes) {
+  // Same as the directory of the temporary files created by clang.
+  llvm::SmallString<128> Dir;
+  llvm::sys::path::system_temp_directory(/*ErasedOnReboot=*/true, Dir);
+  llvm::sys::fs::make_absolute(Dir);
+  llvm::sys::path::remove_dots(Dir, /*remove_dot_dot=*/true);
+  TempDir = Dir.str().rtrim("/\\").str();
+}
+
+std::size_t SharedFileCache::entryBytes(llvm::StringRef AbsPath) {
+  return sizeof(llvm::StringMapEntry<Entry>) + AbsPath.size() + 1;
+}
+
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
+SharedFileCache::wrap(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) {
+  return llvm::IntrusiveRefCntPtr<CachingFS>(
+      new CachingFS(std::move(FS), *this));
+}
+
+void SharedFileCache::invalidate(llvm::StringRef AbsPath) {
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = Entries.find(AbsPath);
+  if (It != Entries.end())
+    eraseLocked(It);
+}
+
+bool SharedFileCache::expired(
+    const Entry &E, std::chrono::steady_clock::time_point Now) const {
+  return Now - E.StatTime >= MaxStatusAge;
+}
+
+void SharedFileCache::eraseLocked(llvm::StringMap<Entry>::iterator It) {
+  CachedBytes -= entryBytes(It->getKey());
+  if (It->second.Contents)
+    CachedBytes -= It->second.Contents->getBufferSize();
+  Entries.erase(It);
+}
+
+void SharedFileCache::evictExpiredLocked(
+    std::chrono::steady_clock::time_point Now) {
+  if (Now < NextEviction)
+    return;
+  NextEviction = Now + MaxStatusAge;
+  for (auto It = Entries.begin(); It != Entries.end();) {
+    auto Next = std::next(It);
+    if (!It->second.Contents && expired(It->second, Now))
+      eraseLocked(It);
+    It = Next;
+  }
+}
+
+llvm::Optional<llvm::ErrorOr<llvm::vfs::Status>>
+SharedFileCache::lookupStatus(llvm::StringRef AbsPath) {
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = Entries.find(AbsPath);
+  if (It == Entries.end())
+    return None;
+  if (expired(It->second, std::chrono::steady_clock::now())) {
+    // The caller stats the file again and updates the status, unless the
+    // cache is full.
+    if (!It->second.Contents)
+      eraseLocked(It);
+    return None;
+  }
+  if (It->second.StatError)
+    return llvm::ErrorOr<llvm::vfs::Status>(It->second.StatError);
+  return llvm::ErrorOr<llvm::vfs::Status>(It->second.Stat);
+}
+
+void SharedFileCache::updateStatus(llvm::StringRef AbsPath,
+                                   const llvm::ErrorOr<llvm::vfs::Status> &S) {
+  if (MaxStatusAge == std::chrono::steady_clock::duration::zero() ||
+      MaxBytes == 0)
+    return;
+  auto Now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = Entries.find(AbsPath);
+  if (It == Entries.end()) {
+    if (CachedBytes + entryBytes(AbsPath) > MaxBytes)
+      evictExpiredLocked(Now);
+    if (CachedBytes + entryBytes(AbsPath) > MaxBytes)
+      return;
+    It = Entries.try_emplace(AbsPath).first;
+    CachedBytes += entryBytes(AbsPath);
+  }
+  Entry &E = It->second;
+  E.StatTime = Now;
+  E.StatError = S.getError();
+  if (S)
+    E.Stat = *S;
+}
+
+std::shared_ptr<const llvm::MemoryBuffer>
+SharedFileCache::lookupContents(llvm::StringRef AbsPath,
+                                const llvm::vfs::Status &S) {
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = Entries.find(AbsPath);
+  if (It == Entries.end() || !It->second.Contents ||
+      !sameFile(It->second.ContentsStat, S))
+    return nullptr;
+  return It->second.Contents;
+}
+
+void SharedFileCache::updateContents(
+    llvm::StringRef AbsPath, const llvm::vfs::Status &S,
+    std::shared_ptr<const llvm::MemoryBuffer> Contents) {
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = Entries.find(AbsPath);
+  if (It == Entries.end()) {
+    if (CachedBytes + entryBytes(AbsPath) > MaxBytes)
+      return;
+    It = Entries.try_emplace(AbsPath).first;
+    CachedBytes += entryBytes(AbsPath);
+  }
+  Entry &E = It->second;
+  if (E.Contents)
+    CachedBytes -= E.Contents->getBufferSize();
+  E.Contents = nullptr;
+  // Keep the contents that were cached first rather than evicting them, they
+  // are usually the headers that most files include.
+  if (CachedBytes + Contents->getBufferSize() > MaxBytes)
+    return;
+  CachedBytes += Contents->getBufferSize();
+  E.Contents = std::move(Contents);
+  E.ContentsStat = S;
+}
+
+bool SharedFileCache::hasRoomFor(std::size_t Bytes) {
+  std::lock_guard<std::mutex> Lock(Mu);
+  return CachedBytes + Bytes <= MaxBytes;
+}
+
+TraceFileSystemOperations::TraceFileSystemOperations(trace::Span &Tracer)
+    : Tracer(Tracer), Start(current()) {}
+
+TraceFileSystemOperations::~TraceFileSystemOperations() {
+  Counts End = current();
+  SPAN_ATTACH(Tracer, "fs.stats", End.Stats - Start.Stats);
+  SPAN_ATTACH(Tracer, "fs.opens", End.Opens - Start.Opens);
+  SPAN_ATTACH(Tracer, "fs.dirs",
+              End.DirectoryListings - Start.DirectoryListings);
+  SPAN_ATTACH(Tracer, "fs.cache_hits", End.CacheHits - Start.CacheHits);
+}
+
+TraceFileSystemOperations::Counts TraceFileSystemOperations::current() {
+  return threadCounts();
+}
+
 } // namespace clangd
 } // namespace clang
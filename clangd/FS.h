@@ -9,9 +9,15 @@
 #ifndef LLVM_CLANG_TOOLS_EXTRA_CLANGD_FS_H
 #define LLVM_CLANG_TOOLS_EXTRA_CLANGD_FS_H
 
+#include "Trace.h"
 #include "clang/Basic/LLVM.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/VirtualFileSystem.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
 
 namespace clang {
 namespace clangd {
@@ -65,6 +71,101 @@ private:
   llvm::StringMap<llvm::vfs::Status> StatCache;
 };
 
+/// A thread-safe cache of file statuses and contents, shared by all the file
+/// systems it wraps, e.g. by the AST builds, code completions and background
+/// indexing of the whole process.
+///
+/// Statuses, including the ones of missing files, are reused for at most
+/// \p MaxStatusAge. Contents are reused as long as the status of the file
+/// doesn't change. Statuses and contents are retained up to \p MaxBytes in
+/// total, expired statuses are dropped to make room for new ones.
+/// Files known to have changed, e.g. reported by file watching, should be
+/// passed to invalidate().
+///
+/// The wrapped file systems must all see the same files, e.g. they're all the
+/// real file system.
+class SharedFileCache {
+public:
+  SharedFileCache(std::chrono::steady_clock::duration MaxStatusAge,
+                  std::size_t MaxBytes);
+
+  /// Returns a VFS that serves the status() and openFileForRead() calls on
+  /// \p FS from the cache. The returned VFS must not outlive the cache.
+  IntrusiveRefCntPtr<llvm::vfs::FileSystem>
+  wrap(IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS);
+
+  /// Drops the cached status and contents of \p AbsPath.
+  void invalidate(llvm::StringRef AbsPath);
+
+private:
+  class CachingFS;
+  struct Entry {
+    std::chrono::steady_clock::time_point StatTime;
+    std::error_code StatError;
+    llvm::vfs::Status Stat;
+    /// Null if the contents are not cached.
+    std::shared_ptr<const llvm::MemoryBuffer> Contents;
+    /// The status of the file when the contents were read.
+    llvm::vfs::Status ContentsStat;
+  };
+
+  /// Returns the cached status of \p AbsPath, unless it is too old.
+  llvm::Optional<llvm::ErrorOr<llvm::vfs::Status>>
+  lookupStatus(llvm::StringRef AbsPath);
+  void updateStatus(llvm::StringRef AbsPath,
+                    const llvm::ErrorOr<llvm::vfs::Status> &S);
+  /// Returns the cached contents of \p AbsPath if they were read when the file
+  /// had status \p S.
+  std::shared_ptr<const llvm::MemoryBuffer>
+  lookupContents(llvm::StringRef AbsPath, const llvm::vfs::Status &S);
+  /// Caches \p Contents if they fit.
+  void updateContents(llvm::StringRef AbsPath, const llvm::vfs::Status &S,
+                      std::shared_ptr<const llvm::MemoryBuffer> Contents);
+  bool hasRoomFor(std::size_t Bytes);
+  /// Approximates the memory used by an entry, without the cached contents.
+  static std::size_t entryBytes(llvm::StringRef AbsPath);
+  /// Whether the status of the entry is too old to be reused.
+  bool expired(const Entry &E, std::chrono::steady_clock::time_point Now) const;
+  void eraseLocked(llvm::StringMap<Entry>::iterator It);
+  /// Drops the entries that only hold an expired status.
+  void evictExpiredLocked(std::chrono::steady_clock::time_point Now);
+
+  const std::chrono::steady_clock::duration MaxStatusAge;
+  const std::size_t MaxBytes;
+  /// Where clang writes the preambles, which are not worth caching.
+  std::string TempDir;
+  std::mutex Mu;
+  llvm::StringMap<Entry> Entries; /* GUARDED_BY(Mu) */
+  /// Size of the entries, including the cached contents.
+  std::size_t CachedBytes = 0; /* GUARDED_BY(Mu) */
+  /// Scanning the entries for expired ones is linear, do it at most once per
+  /// MaxStatusAge.
+  std::chrono::steady_clock::time_point NextEviction; /* GUARDED_BY(Mu) */
+};
+
+/// Counts the operations done on the current thread through the file systems
+/// returned by SharedFileCache::wrap(), while this object is alive. The counts
+/// are attached to \p Tracer on destruction, so \p Tracer must outlive it.
+class TraceFileSystemOperations {
+public:
+  TraceFileSystemOperations(trace::Span &Tracer);
+  ~TraceFileSystemOperations();
+
+  /// Operations that reached the underlying file system or hit the cache.
+  struct Counts {
+    unsigned Stats = 0;
+    unsigned Opens = 0;
+    unsigned DirectoryListings = 0;
+    unsigned CacheHits = 0;
+  };
+  /// Returns the counts of the current thread since it started.
+  static Counts current();
+
+private:
+  trace::Span &Tracer;
+  Counts Start;
+};
+
 } // namespace clangd
 } // namespace clang
 
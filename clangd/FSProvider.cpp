@@ -68,17 +68,27 @@ private:
 };
 } // namespace
 
+RealFileSystemProvider::RealFileSystemProvider(
+    std::chrono::steady_clock::duration MaxStatusAge,
+    std::size_t MaxBytes)
+    : Cache(llvm::make_unique<SharedFileCache>(MaxStatusAge, MaxBytes)) {
+}
+
 llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
 clang::clangd::RealFileSystemProvider::getFileSystem() const {
 // Avoid using memory-mapped files on Windows, they cause file locking issues.
 // FIXME: Try to use a similar approach in Sema instead of relying on
 //        propagation of the 'isVolatile' flag through all layers.
 #ifdef _WIN32
-  return new VolatileFileSystem(
-      llvm::vfs::createPhysicalFileSystem().release());
+  return Cache->wrap(new VolatileFileSystem(
+      llvm::vfs::createPhysicalFileSystem().release()));
 #else
-  return llvm::vfs::createPhysicalFileSystem().release();
+  return Cache->wrap(llvm::vfs::createPhysicalFileSystem().release());
 #endif
 }
+
+void RealFileSystemProvider::fileChanged(llvm::StringRef AbsPath) const {
+  Cache->invalidate(AbsPath);
+}
 } // namespace clangd
 } // namespace clang
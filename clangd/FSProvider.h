@@ -9,8 +9,11 @@
 #ifndef LLVM_CLANG_TOOLS_EXTRA_CLANGD_FSPROVIDER_H
 #define LLVM_CLANG_TOOLS_EXTRA_CLANGD_FSPROVIDER_H
 
+#include "FS.h"
 #include "llvm/ADT/IntrusiveRefCntPtr.h"
 #include "llvm/Support/VirtualFileSystem.h"
+#include <chrono>
+#include <memory>
 
 namespace clang {
 namespace clangd {
@@ -26,13 +29,30 @@ public:
   /// Embedders may use this to isolate filesystem accesses.
   virtual llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
   getFileSystem() const = 0;
+  /// Called when \p AbsPath is known to have changed on disk, e.g. when it's
+  /// reported by file watching. Providers that cache file system operations
+  /// should forget about it.
+  virtual void fileChanged(llvm::StringRef AbsPath) const {}
 };
 
 class RealFileSystemProvider : public FileSystemProvider {
 public:
+  /// File statuses and contents are cached across all the returned file
+  /// systems, see SharedFileCache. By default nothing is cached, but the
+  /// operations are still counted in trace spans.
+  RealFileSystemProvider(
+      std::chrono::steady_clock::duration MaxStatusAge =
+          std::chrono::steady_clock::duration::zero(),
+      std::size_t MaxBytes = 0);
+
   // FIXME: returns the single real FS instance, which is not threadsafe.
   llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
   getFileSystem() const override;
+
+  void fileChanged(llvm::StringRef AbsPath) const override;
+
+private:
+  std::unique_ptr<SharedFileCache> Cache;
 };
 
 } // namespace clangd
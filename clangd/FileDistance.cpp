@@ -28,11 +28,15 @@
 // URIDistance creates FileDistance lazily for each URI scheme encountered. In
 // practice this is a small constant factor.
 //
+// URIDistanceCache keys URIDistances on a hash of their sources that doesn't
+// depend on the order of the sources, and evicts the least recently used ones.
+//
 //===-------------------------------------------------------------------------//
 
 #include "FileDistance.h"
 #include "Logger.h"
 #include "llvm/ADT/STLExtras.h"
+#include <algorithm>
 #include <queue>
 
 namespace clang {
@@ -147,6 +151,7 @@ unsigned FileDistance::distance(llvm::StringRef Path) {
 }
 
 unsigned URIDistance::distance(llvm::StringRef URI) {
+  std::lock_guard<std::mutex> Lock(Mu);
   auto R = Cache.try_emplace(llvm::hash_value(URI), FileDistance::Unreachable);
   if (!R.second)
     return R.first->getSecond();
@@ -176,6 +181,33 @@ FileDistance &URIDistance::forScheme(llvm::StringRef Scheme) {
   return *Delegate;
 }
 
+std::shared_ptr<URIDistance>
+URIDistanceCache::get(llvm::StringMap<SourceParams> Sources,
+                      const FileDistanceOptions &Opts) {
+  // The order of StringMap iteration is unspecified, so the hashes of the
+  // sources are combined with a commutative operation.
+  size_t SourcesHash = 0;
+  for (const auto &S : Sources)
+    SourcesHash += llvm::hash_combine(S.getKey(), S.getValue().Cost,
+                                      S.getValue().MaxUpTraversals);
+  llvm::hash_code Key = llvm::hash_combine(
+      SourcesHash, Opts.UpCost, Opts.DownCost, Opts.IncludeCost,
+      Opts.AllowDownTraversalFromRoot);
+
+  std::lock_guard<std::mutex> Lock(Mu);
+  auto It = llvm::find_if(LRU, [&](const Entry &E) { return E.first == Key; });
+  if (It != LRU.end()) {
+    std::rotate(It, It + 1, LRU.end());
+    return LRU.back().second;
+  }
+  if (LRU.size() >= MaxSize && !LRU.empty())
+    LRU.erase(LRU.begin());
+  auto Result = std::make_shared<URIDistance>(std::move(Sources), Opts);
+  if (MaxSize)
+    LRU.emplace_back(Key, Result);
+  return Result;
+}
+
 static std::pair<std::string, int> scopeToPath(llvm::StringRef Scope) {
   llvm::SmallVector<llvm::StringRef, 4> Split;
   Scope.split(Split, "::", /*MaxSplit=*/-1, /*KeepEmpty=*/false);
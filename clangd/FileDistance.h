@@ -29,6 +29,11 @@
 // Therefore we have a lookup structure that accepts URIs, so that intermediate
 // calculations for the same scheme can be reused.
 //
+// Sharing between requests:
+// Successive requests often have the same sources, e.g. completions in a file
+// whose includes didn't change. URIDistanceCache lets them share a URIDistance,
+// along with the distances it has already computed.
+//
 // Caveats:
 // Assuming up and down traversals each have uniform costs is simplistic.
 // Often there are "semantic roots" whose children are almost unrelated.
@@ -48,6 +53,8 @@
 #include "llvm/Support/Path.h"
 #include "llvm/Support/StringSaver.h"
 #include <memory>
+#include <mutex>
+#include <vector>
 
 namespace clang {
 namespace clangd {
@@ -89,6 +96,7 @@ private:
 // Supports lookups like FileDistance, but the lookup keys are URIs.
 // We convert each of the sources to the scheme of the URI and do a FileDistance
 // comparison on the bodies.
+// This class is threadsafe, so that it can be shared by URIDistanceCache.
 class URIDistance {
 public:
   // \p Sources must contain absolute paths, not URIs.
@@ -104,13 +112,35 @@ private:
   // Returns the FileDistance for a URI scheme, creating it if needed.
   FileDistance &forScheme(llvm::StringRef Scheme);
 
+  std::mutex Mu;
   // We cache the results using the original strings so we can skip URI parsing.
-  llvm::DenseMap<llvm::hash_code, unsigned> Cache;
+  llvm::DenseMap<llvm::hash_code, unsigned> Cache; // GUARDED_BY(Mu)
   llvm::StringMap<SourceParams> Sources;
+  // GUARDED_BY(Mu)
   llvm::StringMap<std::unique_ptr<FileDistance>> ByScheme;
   FileDistanceOptions Opts;
 };
 
+// Keeps the URIDistances for the most recently used sets of sources, so that
+// requests with the same sources share one and the distances it memoizes.
+// Like FileDistance, we identify sources by their hash only.
+// This class is threadsafe.
+class URIDistanceCache {
+public:
+  URIDistanceCache(unsigned MaxSize) : MaxSize(MaxSize) {}
+
+  // Returns the URIDistance for these sources, creating it if needed.
+  std::shared_ptr<URIDistance> get(llvm::StringMap<SourceParams> Sources,
+                                   const FileDistanceOptions &Opts = {});
+
+private:
+  using Entry = std::pair<llvm::hash_code, std::shared_ptr<URIDistance>>;
+
+  const unsigned MaxSize;
+  std::mutex Mu;
+  std::vector<Entry> LRU; // GUARDED_BY(Mu), most recently used last.
+};
+
 /// Support lookups like FileDistance, but the lookup keys are symbol scopes.
 /// For example, a scope "na::nb::" is converted to "/na/nb".
 class ScopeDistance {
@@ -92,6 +92,23 @@ FuzzyMatcher::FuzzyMatcher(llvm::StringRef Pattern)
 llvm::Optional<float> FuzzyMatcher::match(llvm::StringRef Word) {
   if (!(WordContainsPattern = init(Word)))
     return llvm::None;
+  return score();
+}
+
+llvm::Optional<float> FuzzyMatcher::match(const SegmentedWord &Word) {
+  if (!(WordContainsPattern = init(Word)))
+    return llvm::None;
+  return score();
+}
+
+void FuzzyMatcher::match(const SegmentedWords &Words,
+                         llvm::MutableArrayRef<llvm::Optional<float>> Scores) {
+  assert(Words.size() == Scores.size());
+  for (size_t I = 0; I < Words.size(); ++I)
+    Scores[I] = match(Words[I]);
+}
+
+llvm::Optional<float> FuzzyMatcher::score() {
   if (!PatN)
     return 1;
   buildGraph();
@@ -187,14 +204,8 @@ bool FuzzyMatcher::init(llvm::StringRef NewWord) {
     return true;
   for (int I = 0; I < WordN; ++I)
     LowWord[I] = lower(Word[I]);
-
-  // Cheap subsequence check.
-  for (int W = 0, P = 0; P != PatN; ++W) {
-    if (W == WordN)
-      return false;
-    if (LowWord[W] == LowPat[P])
-      ++P;
-  }
+  if (!findSubsequence(LowWord))
+    return false;
 
   // FIXME: some words are hard to tokenize algorithmically.
   // e.g. vsprintf is V S Print F, and should match [pri] but not [int].
@@ -204,6 +215,59 @@ bool FuzzyMatcher::init(llvm::StringRef NewWord) {
   return true;
 }
 
+bool FuzzyMatcher::init(const SegmentedWord &NewWord) {
+  // The segmentation of the truncated word may differ at its end.
+  if (NewWord.Word.size() > static_cast<size_t>(MaxWord))
+    return init(NewWord.Word);
+  WordN = NewWord.Word.size();
+  if (PatN > WordN)
+    return false;
+  std::copy(NewWord.Word.begin(), NewWord.Word.end(), Word);
+  // Most words don't match, check before copying anything else.
+  if (PatN != 0 && !findSubsequence(NewWord.LowWord))
+    return false;
+  std::copy(NewWord.LowWord, NewWord.LowWord + WordN, LowWord);
+  std::copy(NewWord.Roles, NewWord.Roles + WordN, WordRole);
+  WordTypeSet = NewWord.TypeSet;
+  return true;
+}
+
+bool FuzzyMatcher::findSubsequence(const char *Text) {
+  // Cheap subsequence check. Matching greedily also finds the earliest index
+  // at which each pattern character can be matched.
+  for (int W = 0, P = 0; P != PatN; ++W) {
+    if (W == WordN)
+      return false;
+    if (Text[W] == LowPat[P])
+      FirstMatch[P++] = W;
+  }
+  return true;
+}
+
+void SegmentedWords::push_back(llvm::StringRef Word) {
+  size_t Begin = Chars.size();
+  Chars.append(Word.begin(), Word.end());
+  for (char C : Word)
+    LowChars.push_back(lower(C));
+  Roles.resize(Chars.size());
+  TypeSets.push_back(calculateRoles(
+      Word, llvm::makeMutableArrayRef(Roles.data() + Begin, Word.size())));
+  Ends.push_back(Chars.size());
+}
+
+SegmentedWord SegmentedWords::operator[](size_t I) const {
+  size_t Begin = I ? Ends[I - 1] : 0;
+  return {llvm::StringRef(Chars.data() + Begin, Ends[I] - Begin),
+          LowChars.data() + Begin, Roles.data() + Begin, TypeSets[I]};
+}
+
+size_t SegmentedWords::bytes() const {
+  return Chars.capacity() + LowChars.capacity() +
+         Roles.capacity() * sizeof(CharRole) +
+         Ends.capacity() * sizeof(uint32_t) +
+         TypeSets.capacity() * sizeof(CharTypeSet);
+}
+
 // The forwards pass finds the mappings of Pattern onto Word.
 // Score = best score achieved matching Word[..W] against Pat[..P].
 // Unlike other tables, indices range from 0 to N *inclusive*
@@ -213,14 +277,23 @@ bool FuzzyMatcher::init(llvm::StringRef NewWord) {
 // and 3 being a great one. So we treat the score range as [0, 3 * PatN].
 // This range is not strict: we can apply larger bonuses/penalties, or penalize
 // non-matched characters.
+//
+// Only the cells that can be on a path from A to B are computed. Pat[P] can't
+// match before Word[FirstMatch[P]], and it must leave enough characters for
+// the rest of the pattern, so it can't match after Word[WordN - PatN + P].
+// The other cells are never read, except for the one left of each row's range
+// which is marked unreachable.
 void FuzzyMatcher::buildGraph() {
-  for (int W = 0; W < WordN; ++W) {
+  const int Slack = WordN - PatN;
+  for (int W = 0; W < Slack; ++W) {
     Scores[0][W + 1][Miss] = {Scores[0][W][Miss].Score - skipPenalty(W, Miss),
                               Miss};
     Scores[0][W + 1][Match] = {AwfulScore, Miss};
   }
   for (int P = 0; P < PatN; ++P) {
-    for (int W = P; W < WordN; ++W) {
+    for (Action A : {Miss, Match})
+      Scores[P + 1][FirstMatch[P]][A] = {AwfulScore, Miss};
+    for (int W = FirstMatch[P]; W <= Slack + P; ++W) {
       auto &Score = Scores[P + 1][W + 1], &PreMiss = Scores[P + 1][W];
 
       auto MatchMissScore = PreMiss[Match].Score;
@@ -373,11 +446,15 @@ llvm::SmallString<256> FuzzyMatcher::dumpLast(llvm::raw_ostream &OS) const {
     OS << "  " << C << " ";
   OS << "\n";
   OS << "-+----" << std::string(WordN * 4, '-') << "\n";
+  // Cells outside of the range computed by buildGraph() are stale.
+  auto Computed = [&](int I, int J) {
+    return J <= WordN - PatN + I && (I == 0 || J > FirstMatch[I - 1]);
+  };
   for (int I = 0; I <= PatN; ++I) {
     for (Action A : {Miss, Match}) {
       OS << ((I && A == Miss) ? Pat[I - 1] : ' ') << "|";
       for (int J = 0; J <= WordN; ++J) {
-        if (!isAwful(Scores[I][J][A].Score))
+        if (Computed(I, J) && !isAwful(Scores[I][J][A].Score))
           OS << llvm::format("%3d%c", Scores[I][J][A].Score,
                              Scores[I][J][A].Prev == Match ? '*' : ' ');
         else
@@ -20,6 +20,8 @@
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/raw_ostream.h"
+#include <string>
+#include <vector>
 
 namespace clang {
 namespace clangd {
@@ -66,6 +68,34 @@ enum CharRole : unsigned char {
 CharTypeSet calculateRoles(llvm::StringRef Text,
                            llvm::MutableArrayRef<CharRole> Roles);
 
+// A word with the data that FuzzyMatcher would otherwise compute each time
+// it's matched: its lowercase form and its segmentation.
+struct SegmentedWord {
+  llvm::StringRef Word;
+  const char *LowWord;   // Word in lowercase, Word.size() chars.
+  const CharRole *Roles; // Word.size() roles, computed by calculateRoles().
+  CharTypeSet TypeSet;   // Returned by calculateRoles().
+};
+
+// Segments words ahead of time and packs them in a few contiguous arrays.
+// Useful for words matched against many patterns, e.g. the names of symbols.
+class SegmentedWords {
+public:
+  // Appends Word, it can then be accessed as the last element.
+  void push_back(llvm::StringRef Word);
+
+  size_t size() const { return Ends.size(); }
+  SegmentedWord operator[](size_t I) const;
+  // Estimates the memory used, in bytes.
+  size_t bytes() const;
+
+private:
+  std::string Chars, LowChars; // Words, concatenated.
+  std::vector<CharRole> Roles; // Roles of Chars.
+  std::vector<uint32_t> Ends;  // End of each word in Chars.
+  std::vector<CharTypeSet> TypeSets;
+};
+
 // A matcher capable of matching and scoring strings against a single pattern.
 // It's optimized for matching against many strings - match() does not allocate.
 class FuzzyMatcher {
@@ -78,6 +108,11 @@ public:
   // "Super" scores in (1,2] are possible if the pattern is the full word.
   // Characters beyond MaxWord are ignored.
   llvm::Optional<float> match(llvm::StringRef Word);
+  // Like above, but doesn't repeat the work done to segment Word.
+  llvm::Optional<float> match(const SegmentedWord &Word);
+  // Matches all of Words. Scores[I] is set to the result for Words[I].
+  void match(const SegmentedWords &Words,
+             llvm::MutableArrayRef<llvm::Optional<float>> Scores);
 
   llvm::StringRef pattern() const { return llvm::StringRef(Pat, PatN); }
   bool empty() const { return PatN == 0; }
@@ -99,6 +134,11 @@ private:
   constexpr static Action Match = true; // Matched against a pattern character.
 
   bool init(llvm::StringRef Word);
+  bool init(const SegmentedWord &Word);
+  // Checks that LowPat is a subsequence of Text (WordN chars), and fills in
+  // FirstMatch.
+  bool findSubsequence(const char *Text);
+  llvm::Optional<float> score();
   void buildGraph();
   bool allowMatch(int P, int W, Action Last) const;
   int skipPenalty(int W, Action Last) const;
@@ -119,6 +159,7 @@ private:
   CharRole WordRole[MaxWord]; // Word segmentation info
   CharTypeSet WordTypeSet;    // Bitmask of 1<<CharType for all Word characters
   bool WordContainsPattern;   // Simple substring check
+  int FirstMatch[MaxPat];     // Earliest Word index each Pat char can match
 
   // Cumulative best-match score table.
   // Boundary conditions are filled in by the constructor.
@@ -45,14 +45,18 @@ public:
       Inc.FileKind = FileKind;
     }
     if (File) {
-      auto *IncludingFileEntry = SM.getFileEntryForID(SM.getFileID(HashLoc));
-      if (!IncludingFileEntry) {
-        assert(SM.getBufferName(HashLoc).startswith("<") &&
-               "Expected #include location to be a file or <built-in>");
-        // Treat as if included from the main file.
-        IncludingFileEntry = SM.getFileEntryForID(SM.getMainFileID());
+      // Includes from the main file are recorded under an empty name, and so
+      // are the ones from <built-in>.
+      llvm::StringRef IncludingName;
+      if (!SM.isWrittenInMainFile(HashLoc)) {
+        if (auto *IncludingFileEntry =
+                SM.getFileEntryForID(SM.getFileID(HashLoc)))
+          IncludingName = IncludingFileEntry->getName();
+        else
+          assert(SM.getBufferName(HashLoc).startswith("<") &&
+                 "Expected #include location to be a file or <built-in>");
       }
-      Out->recordInclude(IncludingFileEntry->getName(), File->getName(),
+      Out->recordInclude(IncludingName, File->getName(),
                          File->tryGetRealPathName());
     }
   }
@@ -139,6 +143,8 @@ IncludeStructure::includeDepth(llvm::StringRef Root) const {
   std::vector<unsigned> CurrentLevel;
   llvm::DenseSet<unsigned> Seen;
   auto It = NameToIndex.find(Root);
+  if (It == NameToIndex.end())
+    It = NameToIndex.find("");
   if (It != NameToIndex.end()) {
     CurrentLevel.push_back(It->second);
     Seen.insert(It->second);
@@ -183,20 +189,42 @@ bool IncludeInserter::shouldInsertInclude(
   return !Included(DeclaringHeader.File) && !Included(InsertedHeader.File);
 }
 
+std::string IncludePathCache::get(llvm::StringRef BuildDir,
+                                  llvm::StringRef Header,
+                                  llvm::function_ref<std::string()> Compute) {
+  std::string Key = (BuildDir + llvm::StringRef("\0", 1) + Header).str();
+  {
+    std::lock_guard<std::mutex> Lock(Mu);
+    auto It = Paths.find(Key);
+    if (It != Paths.end())
+      return It->second;
+  }
+  // Don't block other lookups while we walk the header search paths.
+  std::string Path = Compute();
+  std::lock_guard<std::mutex> Lock(Mu);
+  Paths.try_emplace(Key, Path);
+  return Path;
+}
+
 std::string
 IncludeInserter::calculateIncludePath(const HeaderFile &DeclaringHeader,
                                       const HeaderFile &InsertedHeader) const {
   assert(DeclaringHeader.valid() && InsertedHeader.valid());
   if (InsertedHeader.Verbatim)
     return InsertedHeader.File;
-  bool IsSystem = false;
-  std::string Suggested = HeaderSearchInfo.suggestPathToFileForDiagnostics(
-      InsertedHeader.File, BuildDir, &IsSystem);
-  if (IsSystem)
-    Suggested = "<" + Suggested + ">";
-  else
-    Suggested = "\"" + Suggested + "\"";
-  return Suggested;
+  auto Compute = [&] {
+    bool IsSystem = false;
+    std::string Suggested = HeaderSearchInfo.suggestPathToFileForDiagnostics(
+        InsertedHeader.File, BuildDir, &IsSystem);
+    if (IsSystem)
+      Suggested = "<" + Suggested + ">";
+    else
+      Suggested = "\"" + Suggested + "\"";
+    return Suggested;
+  };
+  if (!PathCache)
+    return Compute();
+  return PathCache->get(BuildDir, InsertedHeader.File, Compute);
 }
 
 llvm::Optional<TextEdit>
@@ -18,10 +18,13 @@
 #include "clang/Lex/PPCallbacks.h"
 #include "clang/Tooling/Inclusions/HeaderIncludes.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/VirtualFileSystem.h"
+#include <mutex>
 
 namespace clang {
 namespace clangd {
@@ -92,9 +95,13 @@ public:
   // Root --> 0, #included file --> 1, etc.
   // Root is clang's name for a file, which may not be absolute.
   // Usually it should be SM.getFileEntryForID(SM.getMainFileID())->getName().
+  // A root that isn't known to the structure is treated as the main file.
   llvm::StringMap<unsigned> includeDepth(llvm::StringRef Root) const;
 
   // This updates IncludeDepth(), but not MainFileIncludes.
+  // An empty IncludingName stands for the main file, so that the structure
+  // doesn't depend on its name and can be shared between files with the same
+  // includes.
   void recordInclude(llvm::StringRef IncludingName,
                      llvm::StringRef IncludedName,
                      llvm::StringRef IncludedRealName);
@@ -116,14 +123,31 @@ private:
 std::unique_ptr<PPCallbacks>
 collectIncludeStructureCallback(const SourceManager &SM, IncludeStructure *Out);
 
+// Memoizes the include paths calculated for headers. They only depend on the
+// header search paths and the build directory, so the cache can be kept with
+// a preamble and shared by all the files built with it. Threadsafe.
+class IncludePathCache {
+public:
+  // Returns the cached include path of \p Header, or calls \p Compute and
+  // caches the result.
+  std::string get(llvm::StringRef BuildDir, llvm::StringRef Header,
+                  llvm::function_ref<std::string()> Compute);
+
+private:
+  std::mutex Mu;
+  llvm::StringMap<std::string> Paths; // Keyed by BuildDir and Header.
+};
+
 // Calculates insertion edit for including a new header in a file.
 class IncludeInserter {
 public:
+  // If \p PathCache is set, it must belong to the same \p HeaderSearchInfo.
   IncludeInserter(StringRef FileName, StringRef Code,
                   const format::FormatStyle &Style, StringRef BuildDir,
-                  HeaderSearch &HeaderSearchInfo)
+                  HeaderSearch &HeaderSearchInfo,
+                  IncludePathCache *PathCache = nullptr)
       : FileName(FileName), Code(Code), BuildDir(BuildDir),
-        HeaderSearchInfo(HeaderSearchInfo),
+        HeaderSearchInfo(HeaderSearchInfo), PathCache(PathCache),
         Inserter(FileName, Code, Style.IncludeStyle) {}
 
   void addExisting(const Inclusion &Inc);
@@ -163,6 +187,7 @@ private:
   StringRef Code;
   StringRef BuildDir;
   HeaderSearch &HeaderSearchInfo;
+  IncludePathCache *PathCache; // Can be nullptr.
   llvm::StringSet<> IncludedHeaders; // Both written and resolved.
   tooling::HeaderIncludes Inserter;  // Computers insertion replacement.
 };
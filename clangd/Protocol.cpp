@@ -693,9 +693,37 @@ llvm::json::Value toJSON(const CompletionItem &CI) {
     Result["additionalTextEdits"] = llvm::json::Array(CI.additionalTextEdits);
   if (CI.deprecated)
     Result["deprecated"] = CI.deprecated;
+  if (CI.data)
+    Result["data"] = CI.data->str();
   return std::move(Result);
 }
 
+bool fromJSON(const llvm::json::Value &Params, CompletionItem &R) {
+  llvm::json::ObjectMapper O(Params);
+  if (!O || !O.map("label", R.label))
+    return false;
+  O.map("kind", R.kind);
+  O.map("detail", R.detail);
+  O.map("documentation", R.documentation);
+  O.map("sortText", R.sortText);
+  O.map("filterText", R.filterText);
+  O.map("insertText", R.insertText);
+  int Format = 0;
+  if (O.map("insertTextFormat", Format))
+    R.insertTextFormat = static_cast<InsertTextFormat>(Format);
+  O.map("textEdit", R.textEdit);
+  O.map("additionalTextEdits", R.additionalTextEdits);
+  O.map("deprecated", R.deprecated);
+  // Items that don't come from clangd are returned unresolved.
+  if (auto Data = Params.getAsObject()->getString("data")) {
+    if (auto ID = SymbolID::fromStr(*Data))
+      R.data = *ID;
+    else
+      llvm::consumeError(ID.takeError());
+  }
+  return true;
+}
+
 llvm::raw_ostream &operator<<(llvm::raw_ostream &O, const CompletionItem &I) {
   O << I.label << " - " << toJSON(I);
   return O;
@@ -770,6 +798,13 @@ llvm::json::Value toJSON(const FileStatus &FStatus) {
   };
 }
 
+llvm::json::Value toJSON(const FileMemoryUsage &Usage) {
+  return llvm::json::Object{
+      {"uri", Usage.uri},
+      {"bytes", Usage.bytes},
+  };
+}
+
 llvm::raw_ostream &operator<<(llvm::raw_ostream &O,
                               const DocumentHighlight &V) {
   O << V.range;
@@ -904,13 +904,13 @@ struct CompletionItem {
   /// Indicates if this item is deprecated.
   bool deprecated = false;
 
-  // TODO(krasimir): The following optional fields defined by the language
-  // server protocol are unsupported:
-  //
-  // data?: any - A data entry field that is preserved on a completion item
-  //              between a completion and a completion resolve request.
+  /// A data entry field that is preserved on a completion item between a
+  /// completion and a completion resolve request. clangd sets it to the symbol
+  /// whose documentation was left out of the item.
+  llvm::Optional<SymbolID> data;
 };
 llvm::json::Value toJSON(const CompletionItem &);
+bool fromJSON(const llvm::json::Value &, CompletionItem &);
 llvm::raw_ostream &operator<<(llvm::raw_ostream &, const CompletionItem &);
 
 bool operator<(const CompletionItem &, const CompletionItem &);
@@ -1031,6 +1031,16 @@ struct FileStatus {
 };
 llvm::json::Value toJSON(const FileStatus &FStatus);
 
+/// Clangd extension: memory used for one of the open files, returned by the
+/// `$/memoryUsage` request.
+struct FileMemoryUsage {
+  /// The text document's URI.
+  URIForFile uri;
+  /// Estimated size of the AST and the preamble of the file, in bytes.
+  std::size_t bytes = 0;
+};
+llvm::json::Value toJSON(const FileMemoryUsage &);
+
 } // namespace clangd
 } // namespace clang
 
@@ -19,6 +19,7 @@
 #include "clang/Basic/SourceManager.h"
 #include "clang/Sema/CodeCompleteConsumer.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringExtras.h"
@@ -28,6 +29,7 @@
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
+#include <array>
 #include <cmath>
 
 namespace clang {
@@ -197,12 +199,23 @@ void SymbolQualitySignals::merge(const Symbol &IndexResult) {
   ReservedName = ReservedName || isReserved(IndexResult.Name);
 }
 
-float SymbolQualitySignals::evaluate() const {
-  float Score = 1;
+// Precomputes F(0), ..., F(N - 1). Scoring functions of small integers use
+// this to avoid computing pow() or exp() for each candidate. The values are
+// the same as those of F, bit for bit.
+template <unsigned N, typename Func>
+static std::array<float, N> tabulate(Func F) {
+  std::array<float, N> Table;
+  for (unsigned I = 0; I < N; ++I)
+    Table[I] = F(I);
+  return Table;
+}
 
+static float referencesBoost(unsigned References) {
   // This avoids a sharp gradient for tail symbols, and also neatly avoids the
   // question of whether 0 references means a bad symbol or missing data.
-  if (References >= 10) {
+  auto Boost = [](unsigned References) -> float {
+    if (References < 10)
+      return 1;
     // Use a sigmoid style boosting function, which flats out nicely for large
     // numbers (e.g. 2.58 for 1M refererences).
     // The following boosting function is equivalent to:
@@ -212,38 +225,38 @@ float SymbolQualitySignals::evaluate() const {
     // Sample data points: (10, 1.00), (100, 1.41), (1000, 1.82),
     //                     (10K, 2.21), (100K, 2.58), (1M, 2.94)
     float S = std::pow(References, -0.06);
-    Score *= 6.0 * (1 - S) / (1 + S) + 0.59;
-  }
-
-  if (Deprecated)
-    Score *= 0.1f;
-  if (ReservedName)
-    Score *= 0.1f;
-  if (ImplementationDetail)
-    Score *= 0.2f;
-
-  switch (Category) {
-  case Keyword: // Often relevant, but misses most signals.
-    Score *= 4; // FIXME: important keywords should have specific boosts.
-    break;
-  case Type:
-  case Function:
-  case Variable:
-    Score *= 1.1f;
-    break;
-  case Namespace:
-    Score *= 0.8f;
-    break;
-  case Macro:
-  case Destructor:
-  case Operator:
-    Score *= 0.5f;
-    break;
-  case Constructor: // No boost constructors so they are after class types.
-  case Unknown:
-    break;
-  }
+    return 6.0 * (1 - S) / (1 + S) + 0.59;
+  };
+  static const auto Table = tabulate<1024>(Boost);
+  return References < Table.size() ? Table[References] : Boost(References);
+}
 
+float SymbolQualitySignals::evaluate() const {
+  // Multipliers for each SymbolCategory.
+  static constexpr float CategoryBoost[] = {
+      /*Unknown=*/1,
+      /*Variable=*/1.1f,
+      /*Macro=*/0.5f,
+      /*Type=*/1.1f,
+      /*Function=*/1.1f,
+      // No boost constructors so they are after class types.
+      /*Constructor=*/1,
+      /*Destructor=*/0.5f,
+      /*Namespace=*/0.8f,
+      // Often relevant, but misses most signals.
+      // FIXME: important keywords should have specific boosts.
+      /*Keyword=*/4,
+      /*Operator=*/0.5f,
+  };
+  static_assert(llvm::array_lengthof(CategoryBoost) == Operator + 1,
+                "missing SymbolCategory");
+
+  // Multiplying by 1 doesn't change the score, so we avoid branches.
+  float Score = referencesBoost(References);
+  Score *= Deprecated ? 0.1f : 1;
+  Score *= ReservedName ? 0.1f : 1;
+  Score *= ImplementationDetail ? 0.2f : 1;
+  Score *= CategoryBoost[Category];
   return Score;
 }
 
@@ -322,7 +335,12 @@ static std::pair<float, unsigned> uriProximity(llvm::StringRef SymbolURI,
     return {0.f, 0u};
   unsigned Distance = D->distance(SymbolURI);
   // Assume approximately default options are used for sensible scoring.
-  return {std::exp(Distance * -0.4f / FileDistanceOptions().UpCost), Distance};
+  auto Proximity = [](unsigned Distance) -> float {
+    return std::exp(Distance * -0.4f / FileDistanceOptions().UpCost);
+  };
+  static const auto Table = tabulate<64>(Proximity);
+  return {Distance < Table.size() ? Table[Distance] : Proximity(Distance),
+          Distance};
 }
 
 static float scopeBoost(ScopeDistance &Distance,
@@ -332,7 +350,11 @@ static float scopeBoost(ScopeDistance &Distance,
   auto D = Distance.distance(*SymbolScope);
   if (D == FileDistance::Unreachable)
     return 0.6f;
-  return std::max(0.65, 2.0 * std::pow(0.6, D / 2.0));
+  auto Boost = [](unsigned D) -> float {
+    return std::max(0.65, 2.0 * std::pow(0.6, D / 2.0));
+  };
+  static const auto Table = tabulate<64>(Boost);
+  return D < Table.size() ? Table[D] : Boost(D);
 }
 
 float SymbolRelevanceSignals::evaluate() const {
@@ -358,53 +380,32 @@ float SymbolRelevanceSignals::evaluate() const {
 
   // Symbols like local variables may only be referenced within their scope.
   // Conversely if we're in that scope, it's likely we'll reference them.
-  if (Query == CodeComplete) {
-    // The narrower the scope where a symbol is visible, the more likely it is
-    // to be relevant when it is available.
-    switch (Scope) {
-    case GlobalScope:
-      break;
-    case FileScope:
-      Score *= 1.5f;
-      break;
-    case ClassScope:
-      Score *= 2;
-      break;
-    case FunctionScope:
-      Score *= 4;
-      break;
-    }
-  } else {
-    // For non-completion queries, the wider the scope where a symbol is
-    // visible, the more likely it is to be relevant.
-    switch (Scope) {
-    case GlobalScope:
-      break;
-    case FileScope:
-      Score *= 0.5f;
-      break;
-    default:
+  // Multipliers for each QueryType and AccessibleScope.
+  static constexpr float ScopeBoost[][4] = {
+      // CodeComplete: the narrower the scope where a symbol is visible, the
+      // more likely it is to be relevant when it is available.
+      {/*FunctionScope=*/4, /*ClassScope=*/2, /*FileScope=*/1.5f,
+       /*GlobalScope=*/1},
+      // Generic: for non-completion queries, the wider the scope where a
+      // symbol is visible, the more likely it is to be relevant.
       // TODO: Handle other scopes as we start to use them for index results.
-      break;
-    }
-  }
+      {/*FunctionScope=*/1, /*ClassScope=*/1, /*FileScope=*/0.5f,
+       /*GlobalScope=*/1},
+  };
+  Score *= ScopeBoost[Query][Scope];
 
-  if (TypeMatchesPreferred)
-    Score *= 5.0;
+  // Multiplying by 1 doesn't change the score, so we avoid branches.
+  Score *= TypeMatchesPreferred ? 5.0f : 1;
 
   // Penalize non-instance members when they are accessed via a class instance.
-  if (!IsInstanceMember &&
-      (Context == CodeCompletionContext::CCC_DotMemberAccess ||
-       Context == CodeCompletionContext::CCC_ArrowMemberAccess)) {
-    Score *= 0.2f;
-  }
+  bool MemberAccess = Context == CodeCompletionContext::CCC_DotMemberAccess ||
+                      Context == CodeCompletionContext::CCC_ArrowMemberAccess;
+  Score *= (!IsInstanceMember && MemberAccess) ? 0.2f : 1;
 
-  if (InBaseClass)
-    Score *= 0.5f;
+  Score *= InBaseClass ? 0.5f : 1;
 
   // Penalize for FixIts.
-  if (NeedsFixIts)
-    Score *= 0.5f;
+  Score *= NeedsFixIts ? 0.5f : 1;
 
   return Score;
 }
@@ -7,7 +7,8 @@
 //===----------------------------------------------------------------------===//
 // For each file, managed by TUScheduler, we create a single ASTWorker that
 // manages an AST for that file. All operations that modify or read the AST are
-// run on a separate dedicated thread asynchronously in FIFO order.
+// run asynchronously in FIFO order. The workers of all files share a fixed pool
+// of threads, each worker runs at most one of its requests at a time.
 //
 // We start processing each update immediately after we receive it. If two or
 // more updates come subsequently without reads in-between, we attempt to drop
@@ -16,6 +17,11 @@
 // The processing thread of the ASTWorker is also responsible for building the
 // preamble. However, unlike AST, the same preamble can be read concurrently, so
 // we run each of async preamble reads on its own thread.
+// When only the headers included by the preamble have changed, the preamble is
+// optionally rebuilt on a separate thread instead. Meanwhile, ASTs are built on
+// top of the stale preamble, which is still valid for the main file since its
+// preamble region is the same. Once the new preamble is ready, it replaces the
+// old one and the AST is rebuilt.
 //
 // To limit the concurrent load that clangd produces we maintain a semaphore
 // that keeps more than a fixed number of threads from running concurrently.
@@ -32,6 +38,8 @@
 //   callback
 // - When adding an update, we cancel the last update in the queue if it didn't
 //   have any reads.
+// - If that update is already being built, the AST build stops at the next
+//   top-level declaration.
 // There is probably a optimal ways to do that. One approach we might take is
 // the following:
 // - For each update we remember the pending inputs, but delay rebuild of the
@@ -44,13 +52,18 @@
 #include "TUScheduler.h"
 #include "Cancellation.h"
 #include "Logger.h"
+#include "SourceCode.h"
 #include "Trace.h"
 #include "index/CanonicalIncludes.h"
+#include "clang/Basic/DiagnosticSema.h"
 #include "clang/Frontend/CompilerInvocation.h"
 #include "clang/Frontend/PCHContainerOperations.h"
 #include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
 #include <algorithm>
 #include <memory>
 #include <queue>
@@ -65,6 +78,9 @@ class ASTWorker;
 } // namespace
 
 static clang::clangd::Key<std::string> kFileBeingProcessed;
+// Maximum number of reads of a file that run back to back after a first one,
+// before other files get a chance to run.
+static constexpr unsigned MaxBatchedReads = 8;
 
 llvm::Optional<llvm::StringRef> TUScheduler::getFileBeingProcessedInContext() {
   if (auto *File = Context::current().get(kFileBeingProcessed))
@@ -72,41 +88,72 @@ llvm::Optional<llvm::StringRef> TUScheduler::getFileBeingProcessedInContext() {
   return None;
 }
 
-/// An LRU cache of idle ASTs.
-/// Because we want to limit the overall number of these we retain, the cache
-/// owns ASTs (and may evict them) while their workers are idle.
+/// A cache of idle ASTs.
+/// Because we want to limit the overall number and size of ASTs we retain, the
+/// cache owns ASTs (and may evict them) while their workers are idle.
 /// Workers borrow ASTs when active, and return them when done.
+/// When there are too many ASTs, the least recently used one is evicted. When
+/// the ASTs are too large or the process uses too much memory, the ASTs that
+/// are cheap to rebuild for their size are evicted first, unless they haven't
+/// been used for a long time (this is the GreedyDual-Size policy).
 class TUScheduler::ASTCache {
 public:
   using Key = const ASTWorker *;
 
-  ASTCache(unsigned MaxRetainedASTs) : MaxRetainedASTs(MaxRetainedASTs) {}
+  ASTCache(const ASTRetentionPolicy &Policy) : Policy(Policy) {}
 
   /// Returns result of getUsedBytes() for the AST cached by \p K.
   /// If no AST is cached, 0 is returned.
   std::size_t getUsedBytes(Key K) {
     std::lock_guard<std::mutex> Lock(Mut);
     auto It = findByKey(K);
-    if (It == LRU.end() || !It->second)
+    if (It == LRU.end() || !It->AST)
       return 0;
-    return It->second->getUsedBytes();
+    return It->Bytes;
   }
 
-  /// Store the value in the pool, possibly removing the last used AST.
+  /// Store the value in the pool, possibly removing other ASTs to stay within
+  /// the limits of the retention policy. \p BuildTime is the time it took to
+  /// build \p V.
   /// The value should not be in the pool when this function is called.
-  void put(Key K, std::unique_ptr<ParsedAST> V) {
+  void put(Key K, std::unique_ptr<ParsedAST> V,
+           steady_clock::duration BuildTime) {
+    std::size_t Bytes = V ? V->getUsedBytes() : 0;
+    std::size_t MemoryUsage =
+        Policy.MaxProcessMemoryBytes ? llvm::sys::Process::GetMallocUsage() : 0;
+    std::vector<std::unique_ptr<ParsedAST>> ForCleanup;
     std::unique_lock<std::mutex> Lock(Mut);
     assert(findByKey(K) == LRU.end());
 
-    LRU.insert(LRU.begin(), {K, std::move(V)});
-    if (LRU.size() <= MaxRetainedASTs)
-      return;
-    // We're past the limit, remove the last element.
-    std::unique_ptr<ParsedAST> ForCleanup = std::move(LRU.back().second);
-    LRU.pop_back();
-    // Run the expensive destructor outside the lock.
+    double Cost = std::max<double>(
+        1, std::chrono::duration_cast<std::chrono::microseconds>(BuildTime)
+               .count());
+    double Priority = Inflation + Cost / std::max<double>(1, Bytes);
+    LRU.insert(LRU.begin(), Entry{K, std::move(V), Bytes, Priority});
+    TotalBytes += Bytes;
+    // We're past the count limit, remove the last element.
+    if (LRU.size() > Policy.MaxRetainedASTs)
+      ForCleanup.push_back(evictLocked(std::prev(LRU.end())));
+    // The most recent AST is never evicted by the size limits.
+    std::size_t ExcessMemory = MemoryUsage > Policy.MaxProcessMemoryBytes
+                                   ? MemoryUsage - Policy.MaxProcessMemoryBytes
+                                   : 0;
+    while (LRU.size() > 1 &&
+           ((Policy.MaxRetainedASTBytes &&
+             TotalBytes > Policy.MaxRetainedASTBytes) ||
+            ExcessMemory > 0)) {
+      auto Victim = std::min_element(
+          std::next(LRU.begin()), LRU.end(),
+          [](const Entry &L, const Entry &R) {
+            return L.Priority < R.Priority;
+          });
+      Inflation = Victim->Priority;
+      ExcessMemory -= std::min(ExcessMemory, Victim->Bytes);
+      ForCleanup.push_back(evictLocked(Victim));
+    }
+    // Run the expensive destructors outside the lock.
     Lock.unlock();
-    ForCleanup.reset();
+    ForCleanup.clear();
   }
 
   /// Returns the cached value for \p K, or llvm::None if the value is not in
@@ -117,8 +164,7 @@ public:
     auto Existing = findByKey(K);
     if (Existing == LRU.end())
       return None;
-    std::unique_ptr<ParsedAST> V = std::move(Existing->second);
-    LRU.erase(Existing);
+    std::unique_ptr<ParsedAST> V = evictLocked(Existing);
     // GCC 4.8 fails to compile `return V;`, as it tries to call the copy
     // constructor of unique_ptr, so we call the move ctor explicitly to avoid
     // this miscompile.
@@ -126,50 +172,351 @@ public:
   }
 
 private:
-  using KVPair = std::pair<Key, std::unique_ptr<ParsedAST>>;
+  struct Entry {
+    Key K;
+    std::unique_ptr<ParsedAST> AST;
+    std::size_t Bytes;
+    /// Entries with the lowest priority are evicted first by the size limits.
+    double Priority;
+  };
 
-  std::vector<KVPair>::iterator findByKey(Key K) {
-    return llvm::find_if(LRU, [K](const KVPair &P) { return P.first == K; });
+  std::vector<Entry>::iterator findByKey(Key K) {
+    return llvm::find_if(LRU, [K](const Entry &E) { return E.K == K; });
+  }
+
+  std::unique_ptr<ParsedAST> evictLocked(std::vector<Entry>::iterator It) {
+    std::unique_ptr<ParsedAST> V = std::move(It->AST);
+    TotalBytes -= It->Bytes;
+    LRU.erase(It);
+    return V;
   }
 
   std::mutex Mut;
-  unsigned MaxRetainedASTs;
+  const ASTRetentionPolicy Policy;
   /// Items sorted in LRU order, i.e. first item is the most recently accessed
   /// one.
-  std::vector<KVPair> LRU; /* GUARDED_BY(Mut) */
+  std::vector<Entry> LRU; /* GUARDED_BY(Mut) */
+  /// Sum of the sizes of ASTs in LRU.
+  std::size_t TotalBytes = 0; /* GUARDED_BY(Mut) */
+  /// Priority of the last AST evicted by the size limits. Added to the
+  /// priority of new entries, so that old entries are eventually evicted even
+  /// if they are expensive to rebuild.
+  double Inflation = 0; /* GUARDED_BY(Mut) */
+};
+
+/// Maps the keys computed by preambleKey() to the preambles built for them.
+/// Preambles are dropped once no file uses them anymore, except for the most
+/// recently used ones that fit into MaxRetainedBytes. Those are kept alive so
+/// that closing and reopening a file doesn't rebuild its preamble.
+class TUScheduler::PreambleCache {
+public:
+  PreambleCache(std::size_t MaxRetainedBytes)
+      : MaxRetainedBytes(MaxRetainedBytes) {}
+
+  /// Returns a preamble stored for \p K, or null if there's no such preamble.
+  std::shared_ptr<const PreambleData> get(llvm::StringRef K) {
+    std::lock_guard<std::mutex> Lock(Mut);
+    auto It = Preambles.find(K);
+    if (It == Preambles.end())
+      return nullptr;
+    std::shared_ptr<const PreambleData> Result = It->second.lock();
+    if (Result)
+      touchLocked(Result);
+    return Result;
+  }
+
+  void put(llvm::StringRef K, std::shared_ptr<const PreambleData> Preamble) {
+    std::vector<std::shared_ptr<const PreambleData>> ForCleanup;
+    std::lock_guard<std::mutex> Lock(Mut);
+    if (MaxRetainedBytes != 0 && !touchLocked(Preamble)) {
+      LRU.insert(LRU.begin(), Preamble);
+      RetainedBytes += Preamble->Preamble.getSize();
+      while (RetainedBytes > MaxRetainedBytes) {
+        RetainedBytes -= LRU.back()->Preamble.getSize();
+        ForCleanup.push_back(std::move(LRU.back()));
+        LRU.pop_back();
+      }
+    }
+    Preambles[K] = std::move(Preamble);
+    // Remove the entries for the preambles that were already destroyed.
+    for (auto It = Preambles.begin(), E = Preambles.end(); It != E;) {
+      auto Next = std::next(It);
+      if (It->second.expired())
+        Preambles.erase(It);
+      It = Next;
+    }
+    // The evicted preambles are destroyed after the lock is released.
+  }
+
+  /// Records that the last onPreambleAST call for \p File was made for
+  /// \p Preamble. Null means that a call for another preamble is in progress.
+  void setIndexed(PathRef File, std::shared_ptr<const PreambleData> Preamble) {
+    std::lock_guard<std::mutex> Lock(Mut);
+    if (Preamble)
+      Indexed[File] = std::move(Preamble);
+    else
+      Indexed.erase(File);
+    for (auto It = Indexed.begin(), E = Indexed.end(); It != E;) {
+      auto Next = std::next(It);
+      if (It->second.expired())
+        Indexed.erase(It);
+      It = Next;
+    }
+  }
+
+  /// Lets \p File use \p Preamble. Unless \p File was last indexed with it,
+  /// \p Share is called with a file that was, before its index data can be
+  /// replaced. Returns false if there's no such file.
+  bool shareIndexed(PathRef File,
+                    const std::shared_ptr<const PreambleData> &Preamble,
+                    llvm::function_ref<void(PathRef BuiltFor)> Share) {
+    std::lock_guard<std::mutex> Lock(Mut);
+    auto Own = Indexed.find(File);
+    if (Own != Indexed.end() && Own->second.lock() == Preamble)
+      return true;
+    for (const auto &Entry : Indexed) {
+      if (Entry.second.lock() != Preamble)
+        continue;
+      Share(Entry.first());
+      Indexed[File] = Preamble;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  /// Moves \p P to the front of the LRU. Returns false if it isn't retained.
+  bool touchLocked(const std::shared_ptr<const PreambleData> &P) {
+    auto It = llvm::find(LRU, P);
+    if (It == LRU.end())
+      return false;
+    std::rotate(LRU.begin(), It, It + 1);
+    return true;
+  }
+
+  std::mutex Mut;
+  const std::size_t MaxRetainedBytes;
+  /* GUARDED_BY(Mut) */
+  llvm::StringMap<std::weak_ptr<const PreambleData>> Preambles;
+  /// Retained preambles, the first item is the most recently used one.
+  std::vector<std::shared_ptr<const PreambleData>> LRU; /* GUARDED_BY(Mut) */
+  std::size_t RetainedBytes = 0;                         /* GUARDED_BY(Mut) */
+  /// The preambles whose symbols the last onPreambleAST or onPreambleReused
+  /// call for each file reported.
+  /* GUARDED_BY(Mut) */
+  llvm::StringMap<std::weak_ptr<const PreambleData>> Indexed;
 };
 
 namespace {
 class ASTWorkerHandle;
 
+/// Returns true if \p Preamble only consists of #include and #import
+/// directives, comments and whitespace.
+bool onlyHasIncludes(llvm::StringRef Preamble) {
+  llvm::SmallVector<llvm::StringRef, 32> Lines;
+  Preamble.split(Lines, '\n');
+  bool InBlockComment = false;
+  for (llvm::StringRef Line : Lines) {
+    Line = Line.trim();
+    if (InBlockComment) {
+      size_t End = Line.find("*/");
+      if (End == llvm::StringRef::npos)
+        continue;
+      InBlockComment = false;
+      Line = Line.drop_front(End + 2).trim();
+    }
+    if (Line.startswith("/*")) {
+      size_t End = Line.find("*/", 2);
+      if (End == llvm::StringRef::npos) {
+        InBlockComment = true;
+        continue;
+      }
+      Line = Line.drop_front(End + 2).trim();
+    }
+    if (Line.empty() || Line.startswith("//"))
+      continue;
+    if (!Line.consume_front("#"))
+      return false;
+    Line = Line.ltrim();
+    if (!Line.startswith("include") && !Line.startswith("import"))
+      return false;
+  }
+  return true;
+}
+
+/// Computes the key of the preamble of \p File in the PreambleCache, or returns
+/// an empty string if the file has no preamble.
+/// Preambles record the file they were built for as the location of macros
+/// and other entities declared in the preamble region, so only the preambles
+/// consisting of includes are shared with other files in the same directory.
+/// The includes are resolved relative to the file and the compile flags, so
+/// those are part of the key too, except for the name of the file itself and
+/// the output files.
+std::string preambleKey(PathRef File, const ParseInputs &Inputs,
+                        const CompilerInvocation &CI) {
+  auto Buffer = llvm::MemoryBuffer::getMemBuffer(Inputs.Contents);
+  auto Bounds = ComputePreambleBounds(*CI.getLangOpts(), Buffer.get(), 0);
+  llvm::StringRef Preamble =
+      llvm::StringRef(Inputs.Contents).take_front(Bounds.Size);
+  if (Preamble.trim().empty())
+    return "";
+
+  std::string Key;
+  llvm::raw_string_ostream OS(Key);
+  OS << (onlyHasIncludes(Preamble) ? llvm::sys::path::parent_path(File) : File)
+     << '\0' << Inputs.CompileCommand.Directory << '\0';
+  const std::vector<std::string> &Args = Inputs.CompileCommand.CommandLine;
+  for (size_t I = 0; I < Args.size(); ++I) {
+    llvm::StringRef Arg = Args[I];
+    if (Arg == File || Arg == Inputs.CompileCommand.Filename) {
+      OS << "<file>" << '\0';
+      continue;
+    }
+    if (Arg == "-o" || Arg == "-MF" || Arg == "-MT" || Arg == "-MQ") {
+      ++I; // Skip the value too.
+      continue;
+    }
+    OS << Arg << '\0';
+  }
+  OS << Preamble;
+  return llvm::toHex(digest(OS.str()));
+}
+
+/// The part of a file that differs between two versions. Begin is the same
+/// in both versions.
+struct EditedRegion {
+  unsigned Begin;
+  unsigned OldEnd;
+  unsigned NewEnd;
+};
+
+EditedRegion findEditedRegion(llvm::StringRef Old, llvm::StringRef New) {
+  unsigned Prefix = 0, MaxCommon = std::min(Old.size(), New.size());
+  while (Prefix < MaxCommon && Old[Prefix] == New[Prefix])
+    ++Prefix;
+  unsigned Suffix = 0;
+  while (Suffix < MaxCommon - Prefix &&
+         Old[Old.size() - 1 - Suffix] == New[New.size() - 1 - Suffix])
+    ++Suffix;
+  return {Prefix, static_cast<unsigned>(Old.size() - Suffix),
+          static_cast<unsigned>(New.size() - Suffix)};
+}
+
+/// Returns true for the warnings about unused declarations that Sema emits at
+/// the end of the file. They are wrong for the declarations that are only used
+/// in skipped function bodies.
+bool isUnusedDeclWarning(unsigned ID) {
+  switch (ID) {
+  case diag::warn_unused_function:
+  case diag::warn_unused_member_function:
+  case diag::warn_unneeded_internal_decl:
+  case diag::warn_unneeded_static_internal_decl:
+  case diag::warn_unneeded_member_function:
+  case diag::warn_unused_variable:
+  case diag::warn_unused_const_variable:
+  case diag::warn_unused_private_field:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// Moves the main file diagnostics of \p OldCode that are inside
+/// \p SkippedBodies of \p NewCode into \p Diags. Only diagnostics that don't
+/// touch the edited lines are moved, their lines are shifted to match the
+/// new code.
+/// The warnings about unused declarations outside the edited lines are taken
+/// from \p OldDiags as well, instead of \p Diags.
+void carryOverDiags(llvm::StringRef OldCode, llvm::StringRef NewCode,
+                    const std::vector<Diag> &OldDiags,
+                    llvm::ArrayRef<Range> SkippedBodies,
+                    std::vector<Diag> &Diags) {
+  EditedRegion Edit = findEditedRegion(OldCode, NewCode);
+  int FirstLine = offsetToPosition(OldCode, Edit.Begin).line;
+  int OldLastLine = offsetToPosition(OldCode, Edit.OldEnd).line;
+  int NewLastLine = offsetToPosition(NewCode, Edit.NewEnd).line;
+  int LineDelta = NewLastLine - OldLastLine;
+  llvm::erase_if(Diags, [&](const Diag &D) {
+    return D.InsideMainFile && isUnusedDeclWarning(D.ID) &&
+           (D.Range.end.line < FirstLine || D.Range.start.line > NewLastLine);
+  });
+  auto MapRange = [&](Range &R) {
+    if (R.end.line < FirstLine)
+      return true;
+    if (R.start.line <= OldLastLine)
+      return false;
+    R.start.line += LineDelta;
+    R.end.line += LineDelta;
+    return true;
+  };
+
+  for (Diag D : OldDiags) {
+    if (!D.InsideMainFile || !MapRange(D.Range) ||
+        (!isUnusedDeclWarning(D.ID) &&
+         llvm::none_of(SkippedBodies, [&](const Range &Body) {
+           return Body.contains(D.Range);
+         })))
+      continue;
+    bool NotesMapped = llvm::all_of(D.Notes, [&](Note &N) {
+      return !N.InsideMainFile || MapRange(N.Range);
+    });
+    if (!NotesMapped)
+      continue;
+    llvm::erase_if(D.Fixes, [&](Fix &F) {
+      return !llvm::all_of(F.Edits,
+                           [&](TextEdit &E) { return MapRange(E.range); });
+    });
+    Diags.push_back(std::move(D));
+  }
+}
+
+/// Adds \p Sample to the exponential moving average \p Avg, so that the
+/// average follows recent changes to the file and to the typing speed.
+void addToAverage(llvm::Optional<steady_clock::duration> &Avg,
+                  steady_clock::duration Sample) {
+  if (!Avg)
+    Avg = Sample;
+  else
+    *Avg += (Sample - *Avg) / 4;
+}
+
 /// Owns one instance of the AST, schedules updates and reads of it.
 /// Also responsible for building and providing access to the preamble.
-/// Each ASTWorker processes the async requests sent to it on a separate
-/// dedicated thread.
-/// The ASTWorker that manages the AST is shared by both the processing thread
-/// and the TUScheduler. The TUScheduler should discard an ASTWorker when
+/// Each ASTWorker processes the async requests sent to it one at a time, on
+/// one of the threads of a shared WorkerPool.
+/// The ASTWorker that manages the AST is shared by both the WorkerPool and the
+/// TUScheduler. The TUScheduler should discard an ASTWorker when
 /// remove() is called, but its thread may be busy and we don't want to block.
 /// So the workers are accessed via an ASTWorkerHandle. Destroying the handle
-/// signals the worker to exit its run loop and gives up shared ownership of the
-/// worker.
-class ASTWorker {
+/// signals the worker to finish its pending requests and gives up shared
+/// ownership of the worker.
+class ASTWorker : public WorkerPool::Queue,
+                  public std::enable_shared_from_this<ASTWorker> {
   friend class ASTWorkerHandle;
   ASTWorker(PathRef FileName, TUScheduler::ASTCache &LRUCache,
-            Semaphore &Barrier, bool RunSync,
-            steady_clock::duration UpdateDebounce,
+            TUScheduler::PreambleCache &SharedPreambles,
+            Semaphore &Barrier, WorkerPool *Pool,
+            AsyncTaskRunner *PreambleTasks,
+            DebouncePolicy UpdateDebounce,
             std::shared_ptr<PCHContainerOperations> PCHs,
             bool StorePreamblesInMemory, ParsingCallbacks &Callbacks);
 
 public:
   /// Create a new ASTWorker and return a handle to it.
-  /// The processing thread is spawned using \p Tasks. However, when \p Tasks
-  /// is null, all requests will be processed on the calling thread
+  /// The requests are processed by the threads of \p Pool. However, when
+  /// \p Pool is null, all requests will be processed on the calling thread
   /// synchronously instead. \p Barrier is acquired when processing each
   /// request, it is used to limit the number of actively running threads.
+  /// If \p PreambleTasks is not null, preambles invalidated by changes to the
+  /// included headers are rebuilt asynchronously using \p PreambleTasks.
+  /// Preambles are looked up in and added to \p SharedPreambles.
   static ASTWorkerHandle create(PathRef FileName,
                                 TUScheduler::ASTCache &IdleASTs,
-                                AsyncTaskRunner *Tasks, Semaphore &Barrier,
-                                steady_clock::duration UpdateDebounce,
+                                TUScheduler::PreambleCache &SharedPreambles,
+                                WorkerPool *Pool,
+                                AsyncTaskRunner *PreambleTasks,
+                                Semaphore &Barrier,
+                                DebouncePolicy UpdateDebounce,
                                 std::shared_ptr<PCHContainerOperations> PCHs,
                                 bool StorePreamblesInMemory,
                                 ParsingCallbacks &Callbacks);
@@ -196,18 +543,33 @@ public:
   bool isASTCached() const;
 
 private:
-  // Must be called exactly once on processing thread. Will return after
-  // stop() is called on a separate thread and all pending requests are
-  // processed.
-  void run();
-  /// Signal that run() should finish processing pending requests and exit.
+  /// Runs the next request if it's ready, called by the threads of the pool.
+  /// Returns None after stop() is called on a separate thread and all pending
+  /// requests are processed.
+  llvm::Optional<Deadline> runNext() override;
+  /// Signal that the worker should finish processing pending requests.
   void stop();
+  /// Lets the pool know that the request queue has changed.
+  void wake();
+  /// Rebuilds the preamble and the AST for \p Inputs. Only called in the worker
+  /// thread. If \p AllowSkippingBodies is true and the file is large enough,
+  /// the first AST skips the unchanged function bodies, see
+  /// ParseOptions::SkipUnchangedBodiesMinSize.
+  void applyUpdate(ParseInputs Inputs, WantDiagnostics WantDiags,
+                   bool AllowSkippingBodies = true);
+  /// Starts building a preamble for \p Inputs on a separate thread, unless a
+  /// build is already running. Once done, the new preamble replaces
+  /// \p OldPreamble and the AST is rebuilt.
+  void buildPreambleAsync(ParseInputs Inputs,
+                          std::shared_ptr<const PreambleData> OldPreamble);
   /// Adds a new task to the end of the request queue.
   void startTask(llvm::StringRef Name, llvm::unique_function<void()> Task,
                  llvm::Optional<WantDiagnostics> UpdateType);
   /// Updates the TUStatus and emits it. Only called in the worker thread.
   void emitTUStatus(TUAction FAction,
                     const TUStatus::BuildDetails *Detail = nullptr);
+  /// Adds ASTBuildTime to the average used to compute the debounce.
+  void recordBuildTime();
 
   /// Determines the next action to perform.
   /// All actions that should never run are discarded.
@@ -227,9 +589,17 @@ private:
 
   /// Handles retention of ASTs.
   TUScheduler::ASTCache &IdleASTs;
+  /// Preambles that can be reused by other files.
+  TUScheduler::PreambleCache &SharedPreambles;
+  /// Runs the requests. Null if they are run synchronously.
+  WorkerPool *const Pool;
   const bool RunSync;
-  /// Time to wait after an update to see whether another update obsoletes it.
-  const steady_clock::duration UpdateDebounce;
+  /// Used to rebuild stale preambles asynchronously. Null if preambles are only
+  /// built by the worker thread.
+  AsyncTaskRunner *const PreambleTasks;
+  /// Decides how long to wait after an update to see whether another update
+  /// obsoletes it.
+  const DebouncePolicy UpdateDebounce;
   /// File that ASTWorker is responsible for.
   const Path FileName;
   /// Whether to keep the built preambles in memory or on disk.
@@ -247,15 +617,36 @@ private:
   /// Whether the diagnostics for the current FileInputs were reported to the
   /// users before.
   bool DiagsWereReported = false;
+  /// Cancels the AST build of the update that is running, if any.
+  Canceler CancelBuild; /* GUARDED_BY(Mutex) */
+  /// How long it took to build the last AST. Only accessed by the worker
+  /// thread.
+  steady_clock::duration ASTBuildTime = steady_clock::duration::zero();
+  struct FullBuild {
+    std::string Contents;
+    std::vector<Diag> Diags;
+  };
+  /// The last AST built with all function bodies. Only accessed by the worker
+  /// thread.
+  llvm::Optional<FullBuild> LastFullBuild;
   /// Size of the last AST
   /// Guards members used by both TUScheduler and the worker thread.
   mutable std::mutex Mutex;
   std::shared_ptr<const PreambleData> LastBuiltPreamble; /* GUARDED_BY(Mutex) */
   /// Becomes ready when the first preamble build finishes.
   Notification PreambleWasBuilt;
-  /// Set to true to signal run() to finish processing.
+  /// Whether a preamble is being built by buildPreambleAsync().
+  bool PreambleBuildInFlight = false; /* GUARDED_BY(Mutex) */
+  /// Set to true to signal runNext() to finish processing.
   bool Done;                    /* GUARDED_BY(Mutex) */
   std::deque<Request> Requests; /* GUARDED_BY(Mutex) */
+  /// Moving averages of the AST build times and of the intervals between the
+  /// updates, used to compute the debounce. None until measured.
+  /* GUARDED_BY(Mutex) */
+  llvm::Optional<steady_clock::duration> AvgBuildTime, AvgUpdateInterval;
+  /// When the last update was received.
+  /* GUARDED_BY(Mutex) */
+  llvm::Optional<steady_clock::time_point> LastUpdateTime;
   mutable std::condition_variable RequestsCV;
   // FIXME: rename it to better fix the current usage, we also use it to guard
   // emitting TUStatus.
@@ -312,27 +703,31 @@ private:
 
 ASTWorkerHandle ASTWorker::create(PathRef FileName,
                                   TUScheduler::ASTCache &IdleASTs,
-                                  AsyncTaskRunner *Tasks, Semaphore &Barrier,
-                                  steady_clock::duration UpdateDebounce,
+                                  TUScheduler::PreambleCache &SharedPreambles,
+                                  WorkerPool *Pool,
+                                  AsyncTaskRunner *PreambleTasks,
+                                  Semaphore &Barrier,
+                                  DebouncePolicy UpdateDebounce,
                                   std::shared_ptr<PCHContainerOperations> PCHs,
                                   bool StorePreamblesInMemory,
                                   ParsingCallbacks &Callbacks) {
   std::shared_ptr<ASTWorker> Worker(new ASTWorker(
-      FileName, IdleASTs, Barrier, /*RunSync=*/!Tasks, UpdateDebounce,
-      std::move(PCHs), StorePreamblesInMemory, Callbacks));
-  if (Tasks)
-    Tasks->runAsync("worker:" + llvm::sys::path::filename(FileName),
-                    [Worker]() { Worker->run(); });
-
+      FileName, IdleASTs, SharedPreambles, Barrier, Pool, PreambleTasks,
+      UpdateDebounce, std::move(PCHs), StorePreamblesInMemory, Callbacks));
   return ASTWorkerHandle(std::move(Worker));
 }
 
 ASTWorker::ASTWorker(PathRef FileName, TUScheduler::ASTCache &LRUCache,
-                     Semaphore &Barrier, bool RunSync,
-                     steady_clock::duration UpdateDebounce,
+                     TUScheduler::PreambleCache &SharedPreambles,
+                     Semaphore &Barrier, WorkerPool *Pool,
+                     AsyncTaskRunner *PreambleTasks,
+                     DebouncePolicy UpdateDebounce,
                      std::shared_ptr<PCHContainerOperations> PCHs,
                      bool StorePreamblesInMemory, ParsingCallbacks &Callbacks)
-    : IdleASTs(LRUCache), RunSync(RunSync), UpdateDebounce(UpdateDebounce),
+    : IdleASTs(LRUCache), SharedPreambles(SharedPreambles), Pool(Pool),
+      RunSync(!Pool),
+      PreambleTasks(PreambleTasks),
+      UpdateDebounce(UpdateDebounce),
       FileName(FileName), StorePreambleInMemory(StorePreamblesInMemory),
       Callbacks(Callbacks),
       PCHs(std::move(PCHs)), Status{TUAction(TUAction::Idle, ""),
@@ -350,128 +745,301 @@ ASTWorker::~ASTWorker() {
 }
 
 void ASTWorker::update(ParseInputs Inputs, WantDiagnostics WantDiags) {
+  auto Task = [=]() mutable { applyUpdate(std::move(Inputs), WantDiags); };
+  startTask("Update", std::move(Task), WantDiags);
+}
+
+void ASTWorker::applyUpdate(ParseInputs Inputs, WantDiagnostics WantDiags,
+                            bool AllowSkippingBodies) {
   llvm::StringRef TaskName = "Update";
-  auto Task = [=]() mutable {
-    // Will be used to check if we can avoid rebuilding the AST.
-    bool InputsAreTheSame =
-        std::tie(FileInputs.CompileCommand, FileInputs.Contents) ==
-        std::tie(Inputs.CompileCommand, Inputs.Contents);
-
-    tooling::CompileCommand OldCommand = std::move(FileInputs.CompileCommand);
-    bool PrevDiagsWereReported = DiagsWereReported;
-    FileInputs = Inputs;
-    DiagsWereReported = false;
-    emitTUStatus({TUAction::BuildingPreamble, TaskName});
-    log("Updating file {0} with command [{1}] {2}", FileName,
-        Inputs.CompileCommand.Directory,
-        llvm::join(Inputs.CompileCommand.CommandLine, " "));
-    // Rebuild the preamble and the AST.
-    std::unique_ptr<CompilerInvocation> Invocation =
-        buildCompilerInvocation(Inputs);
-    if (!Invocation) {
-      elog("Could not build CompilerInvocation for file {0}", FileName);
-      // Remove the old AST if it's still in cache.
-      IdleASTs.take(this);
+  // Will be used to check if we can avoid rebuilding the AST.
+  bool InputsAreTheSame =
+      std::tie(FileInputs.CompileCommand, FileInputs.Contents) ==
+      std::tie(Inputs.CompileCommand, Inputs.Contents);
+
+  tooling::CompileCommand OldCommand = std::move(FileInputs.CompileCommand);
+  bool PrevDiagsWereReported = DiagsWereReported;
+  FileInputs = Inputs;
+  DiagsWereReported = false;
+  emitTUStatus({TUAction::BuildingPreamble, TaskName});
+  log("Updating file {0} with command [{1}] {2}", FileName,
+      Inputs.CompileCommand.Directory,
+      llvm::join(Inputs.CompileCommand.CommandLine, " "));
+  // Rebuild the preamble and the AST.
+  std::unique_ptr<CompilerInvocation> Invocation =
+      buildCompilerInvocation(Inputs);
+  if (!Invocation) {
+    elog("Could not build CompilerInvocation for file {0}", FileName);
+    // Remove the old AST if it's still in cache.
+    IdleASTs.take(this);
+    TUStatus::BuildDetails Details;
+    Details.BuildFailed = true;
+    emitTUStatus({TUAction::BuildingPreamble, TaskName}, &Details);
+    // Make sure anyone waiting for the preamble gets notified it could not
+    // be built.
+    PreambleWasBuilt.notify();
+    return;
+  }
+
+  std::shared_ptr<const PreambleData> OldPreamble = getPossiblyStalePreamble();
+  std::shared_ptr<const PreambleData> NewPreamble;
+  if (PreambleTasks && OldPreamble &&
+      isPreambleCompatible(*OldPreamble, Inputs, *Invocation)) {
+    // The preamble region did not change, so we can build the AST right away
+    // and rebuild the preamble in the background if its headers changed.
+    if (!isPreambleUpToDate(*OldPreamble, Inputs, *Invocation))
+      buildPreambleAsync(Inputs, OldPreamble);
+    NewPreamble = OldPreamble;
+  } else if (PreambleTasks && OldPreamble &&
+             canPatchPreamble(*OldPreamble, Inputs, *Invocation)) {
+    // Directives were appended to the preamble region, e.g. a new #include.
+    // Until the new preamble is built in the background, parse them as part
+    // of the main file.
+    vlog("Patching the preamble of {0} until it is rebuilt", FileName);
+    buildPreambleAsync(Inputs, OldPreamble);
+    NewPreamble = OldPreamble;
+  } else {
+    // Another file with the same includes may have built our preamble, or we
+    // may have built it before the file was closed. It can only be reused
+    // while some file's symbols in the index still come from it.
+    std::string CacheKey = preambleKey(FileName, Inputs, *Invocation);
+    if (!CacheKey.empty()) {
+      auto Cached = SharedPreambles.get(CacheKey);
+      auto ShareSymbols = [this](PathRef BuiltFor) {
+        Callbacks.onPreambleReused(FileName, BuiltFor);
+      };
+      if (Cached && isPreambleUpToDate(*Cached, Inputs, *Invocation) &&
+          SharedPreambles.shareIndexed(FileName, Cached, ShareSymbols)) {
+        if (Cached != OldPreamble)
+          vlog("Reusing a cached preamble for {0}", FileName);
+        NewPreamble = std::move(Cached);
+      }
+    }
+    if (!NewPreamble) {
+      NewPreamble = buildPreamble(
+          FileName, *Invocation, OldPreamble, OldCommand, Inputs, PCHs,
+          StorePreambleInMemory,
+          [this](ASTContext &Ctx, std::shared_ptr<clang::Preprocessor> PP,
+                 const CanonicalIncludes &CanonIncludes) {
+            SharedPreambles.setIndexed(FileName, nullptr);
+            Callbacks.onPreambleAST(FileName, Ctx, std::move(PP),
+                                    CanonIncludes);
+          });
+      if (NewPreamble) {
+        SharedPreambles.setIndexed(FileName, NewPreamble);
+        if (!CacheKey.empty())
+          SharedPreambles.put(CacheKey, NewPreamble);
+      }
+    }
+  }
+
+  bool CanReuseAST = InputsAreTheSame && (OldPreamble == NewPreamble);
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    LastBuiltPreamble = NewPreamble;
+  }
+  // Before doing the expensive AST reparse, we want to release our reference
+  // to the old preamble, so it can be freed if there are no other references
+  // to it.
+  OldPreamble.reset();
+  PreambleWasBuilt.notify();
+  emitTUStatus({TUAction::BuildingFile, TaskName});
+  if (!CanReuseAST) {
+    IdleASTs.take(this); // Remove the old AST if it's still in cache.
+  } else {
+    // Since we don't need to rebuild the AST, we might've already reported
+    // the diagnostics for it.
+    if (PrevDiagsWereReported) {
+      DiagsWereReported = true;
+      // Take a shortcut and don't report the diagnostics, since they should
+      // not changed. All the clients should handle the lack of OnUpdated()
+      // call anyway to handle empty result from buildAST.
+      // FIXME(ibiryukov): the AST could actually change if non-preamble
+      // includes changed, but we choose to ignore it.
+      // FIXME(ibiryukov): should we refresh the cache in IdleASTs for the
+      // current file at this point?
+      log("Skipping rebuild of the AST for {0}, inputs are the same.",
+          FileName);
       TUStatus::BuildDetails Details;
-      Details.BuildFailed = true;
-      emitTUStatus({TUAction::BuildingPreamble, TaskName}, &Details);
-      // Make sure anyone waiting for the preamble gets notified it could not
-      // be built.
-      PreambleWasBuilt.notify();
+      Details.ReuseAST = true;
+      emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
       return;
     }
+  }
 
-    std::shared_ptr<const PreambleData> OldPreamble =
-        getPossiblyStalePreamble();
-    std::shared_ptr<const PreambleData> NewPreamble = buildPreamble(
-        FileName, *Invocation, OldPreamble, OldCommand, Inputs, PCHs,
-        StorePreambleInMemory,
-        [this](ASTContext &Ctx, std::shared_ptr<clang::Preprocessor> PP,
-               const CanonicalIncludes &CanonIncludes) {
-          Callbacks.onPreambleAST(FileName, Ctx, std::move(PP), CanonIncludes);
-        });
+  // We only need to build the AST if diagnostics were requested.
+  if (WantDiags == WantDiagnostics::No)
+    return;
 
-    bool CanReuseAST = InputsAreTheSame && (OldPreamble == NewPreamble);
+  {
+    std::lock_guard<std::mutex> Lock(DiagsMu);
+    // No need to rebuild the AST if we won't send the diagnotics. However,
+    // note that we don't prevent preamble rebuilds.
+    if (!ReportDiagnostics)
+      return;
+  }
+
+  // Get the AST for diagnostics.
+  llvm::Optional<std::unique_ptr<ParsedAST>> AST = IdleASTs.take(this);
+  // Don't report the diagnostics of an AST with skipped bodies twice.
+  if (AST && *AST && !(*AST)->getSkippedFunctionBodies().empty())
+    AST = None;
+  bool IsLargeFile =
+      Inputs.Opts.SkipUnchangedBodiesMinSize != 0 &&
+      Inputs.Contents.size() >= Inputs.Opts.SkipUnchangedBodiesMinSize;
+  if (!AST) {
+    // For large files, first parse only the function bodies that changed
+    // since the last full build to report the diagnostics faster.
+    if (AllowSkippingBodies && IsLargeFile && !RunSync && LastFullBuild) {
+      EditedRegion Edit =
+          findEditedRegion(LastFullBuild->Contents, Inputs.Contents);
+      Inputs.Opts.ParseBodiesIn = std::make_pair(Edit.Begin, Edit.NewEnd);
+    }
+    // The build is cancelled if newer updates make it obsolete meanwhile, see
+    // startTask().
+    auto Task = cancelableTask();
     {
       std::lock_guard<std::mutex> Lock(Mutex);
-      LastBuiltPreamble = NewPreamble;
+      CancelBuild = std::move(Task.second);
     }
-    // Before doing the expensive AST reparse, we want to release our reference
-    // to the old preamble, so it can be freed if there are no other references
-    // to it.
-    OldPreamble.reset();
-    PreambleWasBuilt.notify();
-    emitTUStatus({TUAction::BuildingFile, TaskName});
-    if (!CanReuseAST) {
-      IdleASTs.take(this); // Remove the old AST if it's still in cache.
-    } else {
-      // Since we don't need to rebuild the AST, we might've already reported
-      // the diagnostics for it.
-      if (PrevDiagsWereReported) {
-        DiagsWereReported = true;
-        // Take a shortcut and don't report the diagnostics, since they should
-        // not changed. All the clients should handle the lack of OnUpdated()
-        // call anyway to handle empty result from buildAST.
-        // FIXME(ibiryukov): the AST could actually change if non-preamble
-        // includes changed, but we choose to ignore it.
-        // FIXME(ibiryukov): should we refresh the cache in IdleASTs for the
-        // current file at this point?
-        log("Skipping rebuild of the AST for {0}, inputs are the same.",
-            FileName);
-        TUStatus::BuildDetails Details;
-        Details.ReuseAST = true;
-        emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
-        return;
-      }
+    auto BuildStart = steady_clock::now();
+    llvm::Optional<ParsedAST> NewAST;
+    bool Cancelled;
+    {
+      WithContext Guard(std::move(Task.first));
+      NewAST =
+          buildAST(FileName, std::move(Invocation), Inputs, NewPreamble, PCHs);
+      Cancelled = isCancelled();
     }
-
-    // We only need to build the AST if diagnostics were requested.
-    if (WantDiags == WantDiagnostics::No)
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      CancelBuild = nullptr;
+    }
+    if (Cancelled) {
+      // The next update rebuilds the AST and reports the diagnostics.
+      vlog("Cancelled the build of an obsolete AST for {0}", FileName);
       return;
-
+    }
+    ASTBuildTime = steady_clock::now() - BuildStart;
+    recordBuildTime();
+    AST = NewAST ? llvm::make_unique<ParsedAST>(std::move(*NewAST)) : nullptr;
+    if (!(*AST)) { // buildAST fails.
+      TUStatus::BuildDetails Details;
+      Details.BuildFailed = true;
+      emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
+    }
+  } else {
+    // We are reusing the AST.
+    TUStatus::BuildDetails Details;
+    Details.ReuseAST = true;
+    emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
+  }
+  // We want to report the diagnostics even if this update was cancelled.
+  // It seems more useful than making the clients wait indefinitely if they
+  // spam us with updates.
+  // Note *AST can still be null if buildAST fails.
+  if (*AST) {
+    llvm::ArrayRef<Range> SkippedBodies = (*AST)->getSkippedFunctionBodies();
+    std::vector<Diag> Diags = (*AST)->getDiagnostics();
+    if (SkippedBodies.empty()) {
+      if (IsLargeFile)
+        LastFullBuild = FullBuild{Inputs.Contents, Diags};
+    } else {
+      // The diagnostics in the skipped bodies are the ones of the last full
+      // build. A full build follows unless newer updates make it obsolete.
+      carryOverDiags(LastFullBuild->Contents, Inputs.Contents,
+                     LastFullBuild->Diags, SkippedBodies, Diags);
+      vlog("Skipped {0} function bodies when building {1}",
+           SkippedBodies.size(), FileName);
+      auto Rebuild = [this]() {
+        DiagsWereReported = false;
+        applyUpdate(FileInputs, WantDiagnostics::Auto,
+                    /*AllowSkippingBodies=*/false);
+      };
+      std::lock_guard<std::mutex> Lock(Mutex);
+      if (!Done)
+        Requests.push_back({std::move(Rebuild), "FullRebuild",
+                            steady_clock::now(), Context::current().clone(),
+                            WantDiagnostics::Auto});
+    }
     {
       std::lock_guard<std::mutex> Lock(DiagsMu);
-      // No need to rebuild the AST if we won't send the diagnotics. However,
-      // note that we don't prevent preamble rebuilds.
-      if (!ReportDiagnostics)
-        return;
+      if (ReportDiagnostics)
+        Callbacks.onDiagnostics(FileName, std::move(Diags));
+    }
+    // The index would lose the references in the skipped bodies.
+    if (SkippedBodies.empty()) {
+      trace::Span Span("Running main AST callback");
+      Callbacks.onMainAST(FileName, **AST);
     }
+    DiagsWereReported = true;
+  }
+  // Stash the AST in the cache for further use.
+  IdleASTs.put(this, std::move(*AST), ASTBuildTime);
+}
 
-    // Get the AST for diagnostics.
-    llvm::Optional<std::unique_ptr<ParsedAST>> AST = IdleASTs.take(this);
-    if (!AST) {
-      llvm::Optional<ParsedAST> NewAST =
-          buildAST(FileName, std::move(Invocation), Inputs, NewPreamble, PCHs);
-      AST = NewAST ? llvm::make_unique<ParsedAST>(std::move(*NewAST)) : nullptr;
-      if (!(*AST)) { // buildAST fails.
-        TUStatus::BuildDetails Details;
-        Details.BuildFailed = true;
-        emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
+void ASTWorker::buildPreambleAsync(
+    ParseInputs Inputs, std::shared_ptr<const PreambleData> OldPreamble) {
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    // The AST rebuild that follows the running build will check the preamble
+    // again and start another build if needed.
+    if (PreambleBuildInFlight)
+      return;
+    PreambleBuildInFlight = true;
+  }
+  auto Task = [](std::shared_ptr<ASTWorker> Self, ParseInputs Inputs,
+                 std::shared_ptr<const PreambleData> OldPreamble, Context Ctx) {
+    WithContext Guard(std::move(Ctx));
+    std::shared_ptr<const PreambleData> NewPreamble;
+    {
+      std::lock_guard<Semaphore> BarrierLock(Self->Barrier);
+      if (auto Invocation = buildCompilerInvocation(Inputs)) {
+        NewPreamble = buildPreamble(
+            Self->FileName, *Invocation, /*OldPreamble=*/nullptr,
+            Inputs.CompileCommand, Inputs, Self->PCHs,
+            Self->StorePreambleInMemory,
+            [&Self](ASTContext &Ctx, std::shared_ptr<clang::Preprocessor> PP,
+                    const CanonicalIncludes &CanonIncludes) {
+              Self->SharedPreambles.setIndexed(Self->FileName, nullptr);
+              Self->Callbacks.onPreambleAST(Self->FileName, Ctx, std::move(PP),
+                                            CanonIncludes);
+            });
+        std::string CacheKey = preambleKey(Self->FileName, Inputs, *Invocation);
+        if (NewPreamble) {
+          Self->SharedPreambles.setIndexed(Self->FileName, NewPreamble);
+          if (!CacheKey.empty())
+            Self->SharedPreambles.put(CacheKey, NewPreamble);
+        }
       }
-    } else {
-      // We are reusing the AST.
-      TUStatus::BuildDetails Details;
-      Details.ReuseAST = true;
-      emitTUStatus({TUAction::BuildingFile, TaskName}, &Details);
     }
-    // We want to report the diagnostics even if this update was cancelled.
-    // It seems more useful than making the clients wait indefinitely if they
-    // spam us with updates.
-    // Note *AST can still be null if buildAST fails.
-    if (*AST) {
-      {
-        std::lock_guard<std::mutex> Lock(DiagsMu);
-        if (ReportDiagnostics)
-          Callbacks.onDiagnostics(FileName, (*AST)->getDiagnostics());
+
+    std::lock_guard<std::mutex> Lock(Self->Mutex);
+    Self->PreambleBuildInFlight = false;
+    // Keep the preamble if the worker thread had to build a new one in the
+    // meantime, it reflects more recent inputs.
+    if (NewPreamble && Self->LastBuiltPreamble == OldPreamble) {
+      Self->LastBuiltPreamble = std::move(NewPreamble);
+      if (!Self->Done) {
+        // The cached AST and reported diagnostics reflect the stale preamble.
+        ASTWorker *Worker = Self.get();
+        auto Rebuild = [Worker]() {
+          Worker->IdleASTs.take(Worker);
+          Worker->DiagsWereReported = false;
+          Worker->applyUpdate(Worker->FileInputs, WantDiagnostics::Auto);
+        };
+        Self->Requests.push_back(
+            {std::move(Rebuild), "RebuildAfterPreamble", steady_clock::now(),
+             Context::current().derive(kFileBeingProcessed, Self->FileName),
+             WantDiagnostics::Auto});
       }
-      trace::Span Span("Running main AST callback");
-      Callbacks.onMainAST(FileName, **AST);
-      DiagsWereReported = true;
     }
-    // Stash the AST in the cache for further use.
-    IdleASTs.put(this, std::move(*AST));
+    Self->wake();
   };
-  startTask(TaskName, std::move(Task), WantDiags);
+  PreambleTasks->runAsync("preamble:" + llvm::sys::path::filename(FileName),
+                          Bind(Task, shared_from_this(), std::move(Inputs),
+                               std::move(OldPreamble),
+                               Context::current().clone()));
 }
 
 void ASTWorker::runWithAST(
@@ -481,7 +1049,11 @@ void ASTWorker::runWithAST(
     if (isCancelled())
       return Action(llvm::make_error<CancelledError>());
     llvm::Optional<std::unique_ptr<ParsedAST>> AST = IdleASTs.take(this);
+    // Features may need the skipped function bodies.
+    if (AST && *AST && !(*AST)->getSkippedFunctionBodies().empty())
+      AST = None;
     if (!AST) {
+      auto BuildStart = steady_clock::now();
       std::unique_ptr<CompilerInvocation> Invocation =
           buildCompilerInvocation(FileInputs);
       // Try rebuilding the AST.
@@ -491,11 +1063,18 @@ void ASTWorker::runWithAST(
                          llvm::make_unique<CompilerInvocation>(*Invocation),
                          FileInputs, getPossiblyStalePreamble(), PCHs)
               : None;
+      // The build stops early if the read is cancelled meanwhile, don't cache
+      // the incomplete result.
+      if (isCancelled())
+        return Action(llvm::make_error<CancelledError>());
       AST = NewAST ? llvm::make_unique<ParsedAST>(std::move(*NewAST)) : nullptr;
+      ASTBuildTime = steady_clock::now() - BuildStart;
+      recordBuildTime();
     }
     // Make sure we put the AST back into the LRU cache.
-    auto _ = llvm::make_scope_exit(
-        [&AST, this]() { IdleASTs.put(this, std::move(*AST)); });
+    auto _ = llvm::make_scope_exit([&AST, this]() {
+      IdleASTs.put(this, std::move(*AST), ASTBuildTime);
+    });
     // Run the user-provided action.
     if (!*AST)
       return Action(llvm::make_error<llvm::StringError>(
@@ -537,11 +1116,16 @@ void ASTWorker::getCurrentPreamble(
                           Context::current().clone(),
                           /*UpdateType=*/None});
   Lock.unlock();
-  RequestsCV.notify_all();
+  wake();
 }
 
 void ASTWorker::waitForFirstPreamble() const { PreambleWasBuilt.wait(); }
 
+void ASTWorker::recordBuildTime() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  addToAverage(AvgBuildTime, ASTBuildTime);
+}
+
 std::size_t ASTWorker::getUsedBytes() const {
   // Note that we don't report the size of ASTs currently used for processing
   // the in-flight requests. We used this information for debugging purposes
@@ -564,7 +1148,13 @@ void ASTWorker::stop() {
     assert(!Done && "stop() called twice");
     Done = true;
   }
+  wake();
+}
+
+void ASTWorker::wake() {
   RequestsCV.notify_all();
+  if (Pool)
+    Pool->wake(shared_from_this());
 }
 
 void ASTWorker::startTask(llvm::StringRef Name,
@@ -574,17 +1164,36 @@ void ASTWorker::startTask(llvm::StringRef Name,
     assert(!Done && "running a task after stop()");
     trace::Span Tracer(Name + ":" + llvm::sys::path::filename(FileName));
     Task();
+    // Nothing else is queued, runNext() would report this.
+    emitTUStatus({TUAction::Idle, /*Name*/ ""});
     return;
   }
 
   {
     std::lock_guard<std::mutex> Lock(Mutex);
     assert(!Done && "running a task after stop()");
+    auto Now = steady_clock::now();
+    if (UpdateType) {
+      // Long pauses are all the same to the debounce, don't let them dominate
+      // the average.
+      if (LastUpdateTime)
+        addToAverage(AvgUpdateInterval,
+                     std::min<steady_clock::duration>(Now - *LastUpdateTime,
+                                                      UpdateDebounce.Max));
+      LastUpdateTime = Now;
+    }
     Requests.push_back(
-        {std::move(Task), Name, steady_clock::now(),
+        {std::move(Task), Name, Now,
          Context::current().derive(kFileBeingProcessed, FileName), UpdateType});
+    // The request at the front is running. If it's an update that we would
+    // skip now, there's no point in finishing its AST.
+    if (CancelBuild && UpdateType && shouldSkipHeadLocked()) {
+      trace::Span Tracer("CancelBuild");
+      SPAN_ATTACH(Tracer, "file", FileName);
+      CancelBuild();
+    }
   }
-  RequestsCV.notify_all();
+  wake();
 }
 
 void ASTWorker::emitTUStatus(TUAction Action,
@@ -599,64 +1208,70 @@ void ASTWorker::emitTUStatus(TUAction Action,
   }
 }
 
-void ASTWorker::run() {
-  while (true) {
-    Request Req;
-    {
-      std::unique_lock<std::mutex> Lock(Mutex);
-      for (auto Wait = scheduleLocked(); !Wait.expired();
-           Wait = scheduleLocked()) {
-        if (Done) {
-          if (Requests.empty())
-            return;
-          else     // Even though Done is set, finish pending requests.
-            break; // However, skip delays to shutdown fast.
-        }
-
-        // Tracing: we have a next request, attribute this sleep to it.
-        llvm::Optional<WithContext> Ctx;
-        llvm::Optional<trace::Span> Tracer;
-        if (!Requests.empty()) {
-          Ctx.emplace(Requests.front().Ctx.clone());
-          Tracer.emplace("Debounce");
-          SPAN_ATTACH(*Tracer, "next_request", Requests.front().Name);
-          if (!(Wait == Deadline::infinity())) {
-            emitTUStatus({TUAction::Queued, Req.Name});
-            SPAN_ATTACH(*Tracer, "sleep_ms",
-                        std::chrono::duration_cast<std::chrono::milliseconds>(
-                            Wait.time() - steady_clock::now())
-                            .count());
-          }
-        }
+llvm::Optional<Deadline> ASTWorker::runNext() {
+  Request Req;
+  // Reads that may run back to back with Req, see below.
+  unsigned BatchedReads = 0;
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Deadline Wait = scheduleLocked();
+    if (Done) {
+      if (Requests.empty())
+        return None;
+      // Even though Done is set, finish pending requests. However, skip delays
+      // to shutdown fast.
+    } else if (!Wait.expired()) {
+      // The next request is debounced, the pool runs us again at the deadline
+      // or when new requests arrive.
+      if (!Requests.empty())
+        emitTUStatus({TUAction::Queued, Requests.front().Name});
+      return Wait;
+    }
+    Req = std::move(Requests.front());
+    // Leave it on the queue for now, so waiters don't see an empty queue.
+    // Only the reads that are already queued join the batch, so that a steady
+    // stream of reads can't hold the barrier forever.
+    if (!Req.UpdateType)
+      for (auto I = std::next(Requests.begin()), E = Requests.end();
+           I != E && !I->UpdateType && BatchedReads < MaxBatchedReads; ++I)
+        ++BatchedReads;
+  } // unlock Mutex
 
-        wait(Lock, RequestsCV, Wait);
+  {
+    std::unique_lock<Semaphore> Lock(Barrier, std::try_to_lock);
+    if (!Lock.owns_lock()) {
+      emitTUStatus({TUAction::Queued, Req.Name});
+      Lock.lock();
+    }
+    while (true) {
+      {
+        WithContext Guard(std::move(Req.Ctx));
+        trace::Span Tracer(Req.Name);
+        emitTUStatus({TUAction::RunningAction, Req.Name});
+        Req.Action();
       }
+      std::lock_guard<std::mutex> QueueLock(Mutex);
+      Requests.pop_front();
+      // Reads queued together, e.g. the hover and highlights requested for the
+      // same cursor position, run back to back. They reuse the AST we just put
+      // back into the cache, without giving up our slot to other files first.
+      if (BatchedReads == 0 || Requests.empty() || Requests.front().UpdateType)
+        break;
+      --BatchedReads;
       Req = std::move(Requests.front());
-      // Leave it on the queue for now, so waiters don't see an empty queue.
-    } // unlock Mutex
-
-    {
-      std::unique_lock<Semaphore> Lock(Barrier, std::try_to_lock);
-      if (!Lock.owns_lock()) {
-        emitTUStatus({TUAction::Queued, Req.Name});
-        Lock.lock();
-      }
-      WithContext Guard(std::move(Req.Ctx));
-      trace::Span Tracer(Req.Name);
-      emitTUStatus({TUAction::RunningAction, Req.Name});
-      Req.Action();
     }
+  }
 
-    bool IsEmpty = false;
-    {
-      std::lock_guard<std::mutex> Lock(Mutex);
-      Requests.pop_front();
-      IsEmpty = Requests.empty();
-    }
-    if (IsEmpty)
-      emitTUStatus({TUAction::Idle, /*Name*/ ""});
-    RequestsCV.notify_all();
+  bool IsEmpty = false;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    IsEmpty = Requests.empty();
   }
+  if (IsEmpty)
+    emitTUStatus({TUAction::Idle, /*Name*/ ""});
+  RequestsCV.notify_all();
+  // Let other files run before our next request.
+  return IsEmpty ? Deadline::infinity() : Deadline::zero();
 }
 
 Deadline ASTWorker::scheduleLocked() {
@@ -682,18 +1297,30 @@ Deadline ASTWorker::scheduleLocked() {
       I->UpdateType = WantDiagnostics::Auto;
   }
 
-  while (shouldSkipHeadLocked())
+  while (shouldSkipHeadLocked()) {
+    trace::Span Tracer("SkipUpdate");
+    SPAN_ATTACH(Tracer, "file", FileName);
     Requests.pop_front();
+  }
   assert(!Requests.empty() && "skipped the whole queue");
   // Some updates aren't dead yet, but never end up being used.
   // e.g. the first keystroke is live until obsoleted by the second.
-  // We debounce "maybe-unused" writes, sleeping 500ms in case they become dead.
+  // We debounce "maybe-unused" writes, sleeping in case they become dead.
   // But don't delay reads (including updates where diagnostics are needed).
   for (const auto &R : Requests)
     if (R.UpdateType == None || R.UpdateType == WantDiagnostics::Yes)
       return Deadline::zero();
   // Front request needs to be debounced, so determine when we're ready.
-  Deadline D(Requests.front().AddTime + UpdateDebounce);
+  steady_clock::duration Delay =
+      UpdateDebounce.compute(AvgBuildTime, AvgUpdateInterval);
+  Deadline D(Requests.front().AddTime + Delay);
+  if (!D.expired()) {
+    trace::Span Tracer("Debounce");
+    SPAN_ATTACH(Tracer, "file", FileName);
+    SPAN_ATTACH(Tracer, "ms",
+                std::chrono::duration_cast<std::chrono::milliseconds>(Delay)
+                    .count());
+  }
   return D;
 }
 
@@ -728,7 +1355,8 @@ bool ASTWorker::shouldSkipHeadLocked() const {
 
 bool ASTWorker::blockUntilIdle(Deadline Timeout) const {
   std::unique_lock<std::mutex> Lock(Mutex);
-  return wait(Lock, RequestsCV, Timeout, [&] { return Requests.empty(); });
+  return wait(Lock, RequestsCV, Timeout,
+              [&] { return Requests.empty() && !PreambleBuildInFlight; });
 }
 
 // Render a TUAction to a user-facing string representation.
@@ -760,6 +1388,31 @@ std::string renderTUAction(const TUAction &Action) {
 
 } // namespace
 
+DebouncePolicy::clock::duration
+DebouncePolicy::compute(llvm::Optional<clock::duration> AvgBuildTime,
+                        llvm::Optional<clock::duration> AvgInterval) const {
+  using FloatDuration = std::chrono::duration<float, clock::period>;
+  // Without any measurements, wait as long as we may.
+  clock::duration Target = Max;
+  // Waiting for about as long as a build takes adds little latency, and saves
+  // the whole build if the user types again in the meantime.
+  if (AvgBuildTime)
+    Target = std::chrono::duration_cast<clock::duration>(
+        FloatDuration(*AvgBuildTime) * RebuildRatio);
+  // After a pause well beyond the usual interval between the updates, the user
+  // has likely stopped typing. Waiting longer only delays the diagnostics.
+  if (AvgInterval)
+    Target = std::min(Target, std::chrono::duration_cast<clock::duration>(
+                                  FloatDuration(*AvgInterval) * PauseRatio));
+  return std::max(Min, std::min(Target, Max));
+}
+
+DebouncePolicy DebouncePolicy::fixed(clock::duration T) {
+  DebouncePolicy P;
+  P.Min = P.Max = T;
+  return P;
+}
+
 unsigned getDefaultAsyncThreadsCount() {
   unsigned HardwareConcurrency = std::thread::hardware_concurrency();
   // C++ standard says that hardware_concurrency()
@@ -787,18 +1440,21 @@ struct TUScheduler::FileData {
 TUScheduler::TUScheduler(unsigned AsyncThreadsCount,
                          bool StorePreamblesInMemory,
                          std::unique_ptr<ParsingCallbacks> Callbacks,
-                         std::chrono::steady_clock::duration UpdateDebounce,
-                         ASTRetentionPolicy RetentionPolicy)
+                         DebouncePolicy UpdateDebounce,
+                         ASTRetentionPolicy RetentionPolicy,
+                         bool AsyncPreambleBuilds)
     : StorePreamblesInMemory(StorePreamblesInMemory),
       PCHOps(std::make_shared<PCHContainerOperations>()),
       Callbacks(Callbacks ? move(Callbacks)
                           : llvm::make_unique<ParsingCallbacks>()),
       Barrier(AsyncThreadsCount),
-      IdleASTs(llvm::make_unique<ASTCache>(RetentionPolicy.MaxRetainedASTs)),
-      UpdateDebounce(UpdateDebounce) {
+      IdleASTs(llvm::make_unique<ASTCache>(RetentionPolicy)),
+      SharedPreambles(llvm::make_unique<PreambleCache>(
+          RetentionPolicy.MaxRetainedPreambleBytes)),
+      UpdateDebounce(UpdateDebounce), AsyncPreambleBuilds(AsyncPreambleBuilds) {
   if (0 < AsyncThreadsCount) {
     PreambleTasks.emplace();
-    WorkerThreads.emplace();
+    Workers.emplace(AsyncThreadsCount);
   }
 }
 
@@ -809,8 +1465,8 @@ TUScheduler::~TUScheduler() {
   // Wait for all in-flight tasks to finish.
   if (PreambleTasks)
     PreambleTasks->wait();
-  if (WorkerThreads)
-    WorkerThreads->wait();
+  // Wait for the workers to process their remaining requests.
+  Workers.reset();
 }
 
 bool TUScheduler::blockUntilIdle(Deadline D) const {
@@ -829,7 +1485,10 @@ void TUScheduler::update(PathRef File, ParseInputs Inputs,
   if (!FD) {
     // Create a new worker to process the AST-related tasks.
     ASTWorkerHandle Worker = ASTWorker::create(
-        File, *IdleASTs, WorkerThreads ? WorkerThreads.getPointer() : nullptr,
+        File, *IdleASTs, *SharedPreambles,
+        Workers ? Workers.getPointer() : nullptr,
+        AsyncPreambleBuilds && PreambleTasks ? PreambleTasks.getPointer()
+                                             : nullptr,
         Barrier, UpdateDebounce, PCHOps, StorePreamblesInMemory, *Callbacks);
     FD = std::unique_ptr<FileData>(new FileData{
         Inputs.Contents, Inputs.CompileCommand, std::move(Worker)});
@@ -842,9 +1501,12 @@ void TUScheduler::update(PathRef File, ParseInputs Inputs,
 
 void TUScheduler::remove(PathRef File) {
   bool Removed = Files.erase(File);
-  if (!Removed)
+  if (!Removed) {
     elog("Trying to remove file from TUScheduler that is not tracked: {0}",
          File);
+    return;
+  }
+  Callbacks->onFileRemoved(File);
 }
 
 void TUScheduler::run(llvm::StringRef Name,
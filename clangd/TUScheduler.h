@@ -50,6 +50,40 @@ struct ASTRetentionPolicy {
   /// Maximum number of ASTs to be retained in memory when there are no pending
   /// requests for them.
   unsigned MaxRetainedASTs = 3;
+  /// Maximum total size of the retained ASTs, as reported by
+  /// ParsedAST::getUsedBytes(). 0 means no limit.
+  std::size_t MaxRetainedASTBytes = 0;
+  /// Retained ASTs are evicted while the heap of the process is larger than
+  /// this. 0 means no limit.
+  std::size_t MaxProcessMemoryBytes = 0;
+  /// Maximum total size of the recently used preambles that are retained even
+  /// if their files are closed, so that reopening the files doesn't rebuild
+  /// them. Preambles stored on disk are counted too. 0 disables retention.
+  std::size_t MaxRetainedPreambleBytes = 0;
+};
+
+/// Clangd may wait after an update to see if another one comes along.
+/// This is so we rebuild once the user stops typing, not when they start.
+/// The delay is chosen separately for each file, based on the moving averages
+/// of its AST build times and of the intervals between its updates.
+struct DebouncePolicy {
+  using clock = std::chrono::steady_clock;
+
+  /// The minimum time that we always debounce for.
+  clock::duration Min = std::chrono::milliseconds(50);
+  /// The maximum time we may debounce for.
+  clock::duration Max = std::chrono::milliseconds(500);
+  /// Target debounce, as a fraction of the expected build time.
+  float RebuildRatio = 1;
+  /// The user is assumed to have stopped typing after a pause this many times
+  /// longer than the usual interval between their updates.
+  float PauseRatio = 2;
+
+  /// Computes the debounce from the averages. None means no data yet.
+  clock::duration compute(llvm::Optional<clock::duration> AvgBuildTime,
+                          llvm::Optional<clock::duration> AvgInterval) const;
+  /// A policy that always returns the same duration, useful for tests.
+  static DebouncePolicy fixed(clock::duration);
 };
 
 struct TUAction {
@@ -94,6 +128,10 @@ public:
   virtual void onPreambleAST(PathRef Path, ASTContext &Ctx,
                              std::shared_ptr<clang::Preprocessor> PP,
                              const CanonicalIncludes &) {}
+  /// Called instead of onPreambleAST when \p Path reuses the preamble built
+  /// for another file. \p BuiltFor is a file whose last onPreambleAST call
+  /// was made for that preamble.
+  virtual void onPreambleReused(PathRef Path, PathRef BuiltFor) {}
   /// Called on the AST built for the file itself. Note that preamble AST nodes
   /// are not deserialized and should be processed in the onPreambleAST call
   /// instead.
@@ -111,6 +149,10 @@ public:
 
   /// Called whenever the TU status is updated.
   virtual void onFileUpdated(PathRef File, const TUStatus &Status) {}
+
+  /// Called when \p File is removed from the scheduler. No more TU statuses
+  /// are emitted for it, even if it still had pending requests.
+  virtual void onFileRemoved(PathRef File) {}
 };
 
 /// Handles running tasks for ClangdServer and managing the resources (e.g.,
@@ -119,13 +161,17 @@ public:
 /// and scheduling tasks.
 /// Callbacks are run on a threadpool and it's appropriate to do slow work in
 /// them. Each task has a name, used for tracing (should be UpperCamelCase).
+/// If \p AsyncPreambleBuilds is true, preambles invalidated only by changes to
+/// the headers they include are rebuilt on a separate thread. Until the new
+/// preamble is ready, ASTs and reads are served using the stale one.
 /// FIXME(sammccall): pull out a scheduler options struct.
 class TUScheduler {
 public:
   TUScheduler(unsigned AsyncThreadsCount, bool StorePreamblesInMemory,
               std::unique_ptr<ParsingCallbacks> ASTCallbacks,
-              std::chrono::steady_clock::duration UpdateDebounce,
-              ASTRetentionPolicy RetentionPolicy);
+              DebouncePolicy UpdateDebounce,
+              ASTRetentionPolicy RetentionPolicy,
+              bool AsyncPreambleBuilds = false);
   ~TUScheduler();
 
   /// Returns estimated memory usage for each of the currently open files.
@@ -201,6 +247,9 @@ public:
   /// Responsible for retaining and rebuilding idle ASTs. An implementation is
   /// an LRU cache.
   class ASTCache;
+  /// Allows files with the same includes and compile flags to share their
+  /// preambles, and retains the recently used preambles of closed files.
+  class PreambleCache;
 
   // The file being built/processed in the current thread. This is a hack in
   // order to get the file name into the index implementations. Do not depend on
@@ -216,11 +265,13 @@ private:
   Semaphore Barrier;
   llvm::StringMap<std::unique_ptr<FileData>> Files;
   std::unique_ptr<ASTCache> IdleASTs;
+  std::unique_ptr<PreambleCache> SharedPreambles;
   // None when running tasks synchronously and non-None when running tasks
   // asynchronously.
   llvm::Optional<AsyncTaskRunner> PreambleTasks;
-  llvm::Optional<AsyncTaskRunner> WorkerThreads;
-  std::chrono::steady_clock::duration UpdateDebounce;
+  llvm::Optional<WorkerPool> Workers;
+  DebouncePolicy UpdateDebounce;
+  const bool AsyncPreambleBuilds;
 };
 
 /// Runs \p Action asynchronously with a new std::thread. The context will be
@@ -92,6 +92,100 @@ void AsyncTaskRunner::runAsync(const llvm::Twine &Name,
       .detach();
 }
 
+WorkerPool::WorkerPool(unsigned ThreadCount) {
+  assert(ThreadCount > 0 && "pool must have at least one thread");
+  for (unsigned I = 0; I < ThreadCount; ++I)
+    Threads.runAsync("worker:" + llvm::Twine(I), [this] { run(); });
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> Lock(Mu);
+    ShuttingDown = true;
+  }
+  CV.notify_all();
+  Threads.wait();
+}
+
+void WorkerPool::wake(std::shared_ptr<Queue> Q) {
+  {
+    std::lock_guard<std::mutex> Lock(Mu);
+    QueueState &State = Queues[Q.get()];
+    if (!State.Q)
+      State.Q = Q;
+    if (State.Scheduled)
+      return;
+    State.Scheduled = true;
+    // The running thread will reschedule the queue once it's done.
+    if (State.Running)
+      return;
+    Ready.push_back(Q.get());
+  }
+  CV.notify_one();
+}
+
+void WorkerPool::run() {
+  std::unique_lock<std::mutex> Lock(Mu);
+  while (true) {
+    // Queues whose deadline has passed are ready to run again.
+    Deadline NextWakeUp = Deadline::infinity();
+    for (auto &Entry : Queues) {
+      QueueState &State = Entry.second;
+      if (State.Scheduled || State.Running ||
+          State.WakeAt == Deadline::infinity())
+        continue;
+      if (State.WakeAt.expired()) {
+        State.Scheduled = true;
+        Ready.push_back(Entry.first);
+      } else if (NextWakeUp == Deadline::infinity() ||
+                 State.WakeAt.time() < NextWakeUp.time()) {
+        NextWakeUp = State.WakeAt;
+      }
+    }
+    if (Ready.empty()) {
+      if (ShuttingDown && Queues.empty())
+        return;
+      wait(Lock, CV, NextWakeUp);
+      continue;
+    }
+
+    Queue *Key = Ready.front();
+    Ready.pop_front();
+    std::shared_ptr<Queue> Q;
+    {
+      QueueState &State = Queues[Key];
+      State.Scheduled = false;
+      State.Running = true;
+      State.WakeAt = Deadline::infinity();
+      Q = State.Q;
+    }
+    Lock.unlock();
+    llvm::Optional<Deadline> Next = Q->runNext();
+    Lock.lock();
+
+    auto It = Queues.find(Key);
+    assert(It != Queues.end());
+    QueueState &State = It->second;
+    State.Running = false;
+    if (!Next) {
+      Queues.erase(It);
+      // Let the other threads exit if we're shutting down.
+      if (Queues.empty())
+        CV.notify_all();
+      continue;
+    }
+    if (State.Scheduled || Next->expired()) {
+      State.Scheduled = true;
+      Ready.push_back(Key);
+    } else {
+      State.WakeAt = *Next;
+      // Idle threads may be waiting for a later deadline.
+      if (!(*Next == Deadline::infinity()))
+        CV.notify_all();
+    }
+  }
+}
+
 Deadline timeoutSeconds(llvm::Optional<double> Seconds) {
   using namespace std::chrono;
   if (!Seconds)
@@ -11,9 +11,12 @@
 
 #include "Context.h"
 #include "Function.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/Twine.h"
 #include <cassert>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
@@ -117,6 +120,49 @@ private:
   std::size_t InFlightTasks = 0;
 };
 
+/// Runs sequential task queues on a fixed number of threads. Tasks of the same
+/// queue never run concurrently, while idle threads pick up whichever queue is
+/// ready next. This lets many mostly idle queues share a few threads.
+class WorkerPool {
+public:
+  /// A sequence of tasks run one at a time by the pool.
+  class Queue {
+  public:
+    virtual ~Queue() = default;
+    /// Runs the next task if one is ready. Returns the deadline at which the
+    /// queue should be run again, or None once the queue has finished and can
+    /// be dropped from the pool. Never called concurrently for the same queue.
+    virtual llvm::Optional<Deadline> runNext() = 0;
+  };
+
+  WorkerPool(unsigned ThreadCount);
+  /// Waits for all queues in the pool to finish.
+  ~WorkerPool();
+
+  /// Runs \p Q as soon as a thread is available, e.g. because new tasks were
+  /// added to it. The pool keeps \p Q alive until it finishes.
+  void wake(std::shared_ptr<Queue> Q);
+
+private:
+  void run();
+
+  struct QueueState {
+    std::shared_ptr<Queue> Q;
+    /// Whether Q is in the Ready list, or was woken while running.
+    bool Scheduled = false;
+    bool Running = false;
+    /// When Q should run next if it is not woken before.
+    Deadline WakeAt = Deadline::infinity();
+  };
+
+  std::mutex Mu;
+  std::condition_variable CV;
+  llvm::DenseMap<Queue *, QueueState> Queues; /* GUARDED_BY(Mu) */
+  std::deque<Queue *> Ready;                  /* GUARDED_BY(Mu) */
+  bool ShuttingDown = false;                  /* GUARDED_BY(Mu) */
+  AsyncTaskRunner Threads;
+};
+
 enum class ThreadPriority {
   Low = 0,
   Normal = 1,
@@ -0,0 +1,83 @@
+//===--- CodeCompleteBenchmark.cpp - Clangd completion benchmarks ---------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "../CodeComplete.h"
+#include "../SourceCode.h"
+#include "benchmark/benchmark.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <string>
+
+namespace clang {
+namespace clangd {
+namespace {
+
+// A function body that is not trivial to parse.
+std::string body(unsigned I) {
+  return llvm::formatv(R"cpp({{
+    int Sum = 0;
+    for (int J = 0; J < X; ++J)
+      Sum += (J % 3 == 0) ? J * {0} : static_cast<int>(J / 2.0);
+    return Sum;
+  })cpp",
+                       I);
+}
+
+// Runs code completion at the end of Code, which must end with "X.".
+void complete(benchmark::State &State, llvm::StringRef Code) {
+  const std::string File = "/clangd-bench/main.cpp";
+  tooling::CompileCommand Command;
+  Command.Directory = "/clangd-bench";
+  Command.Filename = File;
+  Command.CommandLine = {"clang", "-fsyntax-only", File};
+  auto PCHs = std::make_shared<PCHContainerOperations>();
+  Position Pos = offsetToPosition(Code, Code.size());
+  for (auto _ : State) {
+    auto Result = codeComplete(File, Command, /*Preamble=*/nullptr, Code, Pos,
+                               new llvm::vfs::InMemoryFileSystem(), PCHs,
+                               CodeCompleteOptions());
+    benchmark::DoNotOptimize(Result);
+  }
+}
+
+// Completes after State.range(0) function definitions. Sema completion skips
+// the bodies of all the functions but the one containing the cursor.
+static void CompleteAfterFunctions(benchmark::State &State) {
+  std::string Code = "struct S { int Member; };\n";
+  for (unsigned I = 0; I < State.range(0); ++I)
+    Code += llvm::formatv("int function{0}(int X) {1}\n", I, body(I));
+  Code += "void f(S X) { X.";
+  complete(State, Code);
+}
+BENCHMARK(CompleteAfterFunctions)
+    ->Arg(0)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Unit(benchmark::kMillisecond);
+
+// Completes after the same code as CompleteAfterFunctions, as lambdas in the
+// function containing the cursor, so that all of it is parsed.
+static void CompleteAfterLambdas(benchmark::State &State) {
+  std::string Code = "struct S { int Member; };\nvoid f(S X) {\n";
+  for (unsigned I = 0; I < State.range(0); ++I)
+    Code += llvm::formatv("auto lambda{0} = [](int X) {1};\n", I, body(I));
+  Code += "X.";
+  complete(State, Code);
+}
+BENCHMARK(CompleteAfterLambdas)
+    ->Arg(0)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace
+} // namespace clangd
+} // namespace clang
+
+BENCHMARK_MAIN();
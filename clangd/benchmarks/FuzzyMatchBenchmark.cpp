@@ -0,0 +1,111 @@
+//===--- FuzzyMatchBenchmark.cpp - Clangd matcher benchmarks ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "../FuzzyMatch.h"
+#include "benchmark/benchmark.h"
+#include <cctype>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace clangd {
+namespace {
+
+// Builds identifiers in the styles found in C++ codebases, e.g. getFooBar,
+// foo_bar_baz, FOO_BAR and FooBarBaz, out of common words.
+std::vector<std::string> identifierCorpus(unsigned Size) {
+  const char *Words[] = {
+      "get",    "set",     "is",     "has",    "make",   "create", "find",
+      "insert", "erase",   "push",   "back",   "front",  "begin",  "end",
+      "size",   "empty",   "value",  "type",   "name",   "decl",   "expr",
+      "stmt",   "context", "source", "loc",    "range",  "token",  "lexer",
+      "parse",  "buffer",  "file",   "path",   "index",  "symbol", "ref",
+      "count",  "result",  "error",  "handle", "node",   "visit",  "map",
+      "vector", "string",  "ptr",    "unique", "shared", "http",   "xml"};
+  const unsigned NumWords = sizeof(Words) / sizeof(Words[0]);
+  std::mt19937 Rand(0);
+  std::vector<std::string> Corpus;
+  for (unsigned I = 0; I < Size; ++I) {
+    unsigned Style = Rand() % 4, Parts = 1 + Rand() % 4;
+    std::string Ident;
+    for (unsigned P = 0; P < Parts; ++P) {
+      std::string Word = Words[Rand() % NumWords];
+      switch (Style) {
+      case 0: // camelCase
+        if (P)
+          Word[0] = toupper(Word[0]);
+        break;
+      case 1: // snake_case
+        if (P)
+          Ident += '_';
+        break;
+      case 2: // UPPER_CASE
+        if (P)
+          Ident += '_';
+        for (char &C : Word)
+          C = toupper(C);
+        break;
+      case 3: // PascalCase
+        Word[0] = toupper(Word[0]);
+        break;
+      }
+      Ident += Word;
+    }
+    Corpus.push_back(std::move(Ident));
+  }
+  return Corpus;
+}
+
+// Matches the corpus against the first State.range(0) characters of a few
+// identifiers, as if they were being typed.
+static void MatchCorpus(benchmark::State &State) {
+  static const std::vector<std::string> Corpus = identifierCorpus(100000);
+  const std::string Patterns[] = {"getSymbolName", "find_index_ref",
+                                  "ParseSourceRange", "HTTP_ERROR_COUNT"};
+  unsigned Matches = 0;
+  for (auto _ : State) {
+    for (const auto &Pattern : Patterns) {
+      FuzzyMatcher Matcher(llvm::StringRef(Pattern).take_front(State.range(0)));
+      for (const auto &Ident : Corpus)
+        if (Matcher.match(Ident))
+          ++Matches;
+    }
+  }
+  benchmark::DoNotOptimize(Matches);
+  State.SetItemsProcessed(State.iterations() * Corpus.size() * 4);
+}
+BENCHMARK(MatchCorpus)->Arg(1)->Arg(2)->Arg(3)->Arg(5)->Arg(8);
+
+// Like MatchCorpus, but the corpus is segmented ahead of time.
+static void MatchSegmentedCorpus(benchmark::State &State) {
+  static const SegmentedWords Corpus = [] {
+    SegmentedWords Result;
+    for (const auto &Ident : identifierCorpus(100000))
+      Result.push_back(Ident);
+    return Result;
+  }();
+  const std::string Patterns[] = {"getSymbolName", "find_index_ref",
+                                  "ParseSourceRange", "HTTP_ERROR_COUNT"};
+  std::vector<llvm::Optional<float>> Scores(Corpus.size());
+  for (auto _ : State) {
+    for (const auto &Pattern : Patterns) {
+      FuzzyMatcher Matcher(llvm::StringRef(Pattern).take_front(State.range(0)));
+      Matcher.match(Corpus, Scores);
+      benchmark::DoNotOptimize(Scores.data());
+    }
+  }
+  State.SetItemsProcessed(State.iterations() * Corpus.size() * 4);
+}
+BENCHMARK(MatchSegmentedCorpus)->Arg(1)->Arg(2)->Arg(3)->Arg(5)->Arg(8);
+
+} // namespace
+} // namespace clangd
+} // namespace clang
+
+BENCHMARK_MAIN();
@@ -0,0 +1,71 @@
+//===--- QualityBenchmark.cpp - Clangd ranking benchmarks -------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "../Quality.h"
+#include "benchmark/benchmark.h"
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace clangd {
+namespace {
+
+const unsigned NumCandidates = 10000;
+
+// Signals like those of code completion candidates, with reference counts
+// following a power law.
+std::vector<std::pair<SymbolQualitySignals, SymbolRelevanceSignals>>
+candidates(ScopeDistance &Scopes, const std::vector<std::string> &ScopeNames) {
+  std::mt19937 Rand(0);
+  std::vector<std::pair<SymbolQualitySignals, SymbolRelevanceSignals>> Result(
+      NumCandidates);
+  for (auto &C : Result) {
+    SymbolQualitySignals &Quality = C.first;
+    Quality.References = std::pow(10, (Rand() % 600) / 100.0);
+    Quality.Category = static_cast<SymbolQualitySignals::SymbolCategory>(
+        Rand() % (SymbolQualitySignals::Operator + 1));
+    Quality.Deprecated = Rand() % 50 == 0;
+    Quality.ReservedName = Rand() % 20 == 0;
+
+    SymbolRelevanceSignals &Relevance = C.second;
+    Relevance.Query = SymbolRelevanceSignals::CodeComplete;
+    Relevance.NameMatch = (Rand() % 100) / 100.0;
+    Relevance.Scope =
+        static_cast<SymbolRelevanceSignals::AccessibleScope>(Rand() % 4);
+    Relevance.ScopeProximityMatch = &Scopes;
+    Relevance.SymbolScope = ScopeNames[Rand() % ScopeNames.size()];
+    Relevance.SemaFileProximityScore = (Rand() % 2) ? 1.0 : 0.6;
+    Relevance.TypeMatchesPreferred = Rand() % 10 == 0;
+  }
+  return Result;
+}
+
+// Scores the candidates, as completion does to rank them.
+static void EvaluateCandidates(benchmark::State &State) {
+  std::vector<std::string> ScopeNames = {"",        "ns::",      "ns::a::",
+                                         "ns::b::", "ns::a::c::", "other::"};
+  ScopeDistance Scopes({"ns::a::", "ns::", ""});
+  auto Candidates = candidates(Scopes, ScopeNames);
+  for (auto _ : State) {
+    float Sum = 0;
+    for (const auto &C : Candidates)
+      Sum += evaluateSymbolAndRelevance(C.first.evaluate(),
+                                        C.second.evaluate());
+    benchmark::DoNotOptimize(Sum);
+  }
+  State.SetItemsProcessed(State.iterations() * Candidates.size());
+}
+BENCHMARK(EvaluateCandidates);
+
+} // namespace
+} // namespace clangd
+} // namespace clang
+
+BENCHMARK_MAIN();
@@ -0,0 +1,224 @@
+//===--- TUSchedulerBenchmark.cpp - Clangd scheduler benchmarks -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "../Logger.h"
+#include "../TUScheduler.h"
+#include "benchmark/benchmark.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace clang {
+namespace clangd {
+namespace {
+
+// Keeps the logs of the scheduler from dominating the output.
+class NullLogger : public Logger {
+  void log(Level, const llvm::formatv_object_base &) override {}
+};
+
+std::string filePath(unsigned I) {
+  return llvm::formatv("/clangd-bench/file{0}.cpp", I);
+}
+
+ParseInputs getInputs(llvm::StringRef File) {
+  ParseInputs Inputs;
+  Inputs.CompileCommand.Directory = "/clangd-bench";
+  Inputs.CompileCommand.Filename = File.str();
+  Inputs.CompileCommand.CommandLine = {"clang", "-fsyntax-only", File.str()};
+  Inputs.FS = new llvm::vfs::InMemoryFileSystem();
+  Inputs.Contents = R"cpp(
+    #define SQUARE(X) ((X) * (X))
+    template <typename T> struct Box { T Value; };
+    int compute(Box<int> B) { return SQUARE(B.Value) + 1; }
+  )cpp";
+  return Inputs;
+}
+
+std::unique_ptr<TUScheduler> createScheduler() {
+  return llvm::make_unique<TUScheduler>(
+      getDefaultAsyncThreadsCount(), /*StorePreamblesInMemory=*/true,
+      /*ASTCallbacks=*/nullptr,
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy());
+}
+
+// Opens State.range(0) files at once and waits for all of them to be built.
+static void OpenManyFiles(benchmark::State &State) {
+  const unsigned NumFiles = State.range(0);
+  for (auto _ : State) {
+    auto S = createScheduler();
+    for (unsigned I = 0; I < NumFiles; ++I)
+      S->update(filePath(I), getInputs(filePath(I)), WantDiagnostics::Yes);
+    S->blockUntilIdle(Deadline::infinity());
+  }
+}
+BENCHMARK(OpenManyFiles)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(300)
+    ->Unit(benchmark::kMillisecond);
+
+// Measures the latency of an AST read on a single file, while State.range(0)
+// other open files are being rebuilt.
+static void ReadUnderLoad(benchmark::State &State) {
+  auto S = createScheduler();
+  const unsigned NumFiles = State.range(0);
+  for (unsigned I = 0; I <= NumFiles; ++I)
+    S->update(filePath(I), getInputs(filePath(I)), WantDiagnostics::Yes);
+  S->blockUntilIdle(Deadline::infinity());
+
+  for (auto _ : State) {
+    State.PauseTiming();
+    for (unsigned I = 1; I <= NumFiles; ++I) {
+      ParseInputs Inputs = getInputs(filePath(I));
+      Inputs.Contents += "int changed;";
+      S->update(filePath(I), std::move(Inputs), WantDiagnostics::Yes);
+    }
+    State.ResumeTiming();
+
+    Notification Done;
+    S->runWithAST("Read", filePath(0),
+                  [&Done](llvm::Expected<InputsAndAST> AST) {
+                    llvm::consumeError(AST.takeError());
+                    Done.notify();
+                  });
+    Done.wait();
+
+    State.PauseTiming();
+    S->blockUntilIdle(Deadline::infinity());
+    // Go back to the original contents for the next iteration.
+    for (unsigned I = 1; I <= NumFiles; ++I)
+      S->update(filePath(I), getInputs(filePath(I)), WantDiagnostics::No);
+    S->blockUntilIdle(Deadline::infinity());
+    State.ResumeTiming();
+  }
+}
+BENCHMARK(ReadUnderLoad)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(300)
+    ->Unit(benchmark::kMillisecond);
+
+// Measures the latency of a burst of State.range(0) AST reads on a single file,
+// e.g. the hover, highlights and code actions for one cursor position, while
+// the 10 other open files each have a read queued. The P95Ms counter is the
+// 95th percentile of the time from queueing the burst to finishing each read.
+static void ReadBurst(benchmark::State &State) {
+  auto S = createScheduler();
+  const unsigned NumFiles = 10;
+  for (unsigned I = 0; I <= NumFiles; ++I)
+    S->update(filePath(I), getInputs(filePath(I)), WantDiagnostics::Yes);
+  S->blockUntilIdle(Deadline::infinity());
+
+  auto Ignore = [](llvm::Expected<InputsAndAST> AST) {
+    llvm::consumeError(AST.takeError());
+  };
+  std::mutex LatenciesMu;
+  std::vector<double> LatenciesMs;
+  for (auto _ : State) {
+    std::atomic<unsigned> Remaining(State.range(0));
+    Notification Done;
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned I = 1; I <= NumFiles; ++I)
+      S->runWithAST("Other", filePath(I), Ignore);
+    for (unsigned I = 0; I < State.range(0); ++I)
+      S->runWithAST("Read", filePath(0),
+                    [&](llvm::Expected<InputsAndAST> AST) {
+                      llvm::consumeError(AST.takeError());
+                      std::chrono::duration<double, std::milli> Latency =
+                          std::chrono::steady_clock::now() - Start;
+                      {
+                        std::lock_guard<std::mutex> Lock(LatenciesMu);
+                        LatenciesMs.push_back(Latency.count());
+                      }
+                      if (--Remaining == 0)
+                        Done.notify();
+                    });
+    Done.wait();
+
+    State.PauseTiming();
+    S->blockUntilIdle(Deadline::infinity());
+    State.ResumeTiming();
+  }
+  if (!LatenciesMs.empty()) {
+    auto P95 = LatenciesMs.begin() + LatenciesMs.size() * 95 / 100;
+    std::nth_element(LatenciesMs.begin(), P95, LatenciesMs.end());
+    State.counters["P95Ms"] = *P95;
+  }
+}
+BENCHMARK(ReadBurst)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(8)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Counts the ASTs built for diagnostics.
+class CountDiagnostics : public ParsingCallbacks {
+public:
+  CountDiagnostics(std::atomic<unsigned> &Count) : Count(Count) {}
+  void onDiagnostics(PathRef, std::vector<Diag>) override { ++Count; }
+
+private:
+  std::atomic<unsigned> &Count;
+};
+
+// Replays a stream of edits to a file, typed State.range(0) milliseconds apart,
+// and waits for the diagnostics of the last one. Reports the fraction of the
+// edits that were built instead of being debounced.
+static void ReplayEdits(benchmark::State &State) {
+  const unsigned NumEdits = 20;
+  const std::chrono::milliseconds Interval(State.range(0));
+  std::atomic<unsigned> Builds(0);
+  TUScheduler S(getDefaultAsyncThreadsCount(), /*StorePreamblesInMemory=*/true,
+                llvm::make_unique<CountDiagnostics>(Builds), DebouncePolicy(),
+                ASTRetentionPolicy());
+  auto File = filePath(0);
+  S.update(File, getInputs(File), WantDiagnostics::Yes);
+  S.blockUntilIdle(Deadline::infinity());
+  Builds = 0;
+
+  for (auto _ : State) {
+    ParseInputs Inputs = getInputs(File);
+    Inputs.Contents += "// ";
+    for (unsigned I = 0; I < NumEdits; ++I) {
+      Inputs.Contents += 'x';
+      S.update(File, Inputs, WantDiagnostics::Auto);
+      std::this_thread::sleep_for(Interval);
+    }
+    S.blockUntilIdle(Deadline::infinity());
+  }
+  State.counters["BuildsPerEdit"] =
+      static_cast<double>(Builds) / (NumEdits * State.iterations());
+}
+BENCHMARK(ReplayEdits)
+    ->Arg(0)
+    ->Arg(30)
+    ->Arg(100)
+    ->Arg(300)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+} // namespace
+} // namespace clangd
+} // namespace clang
+
+int main(int argc, char *argv[]) {
+  clang::clangd::NullLogger Logger;
+  clang::clangd::LoggingSession Session(Logger);
+  ::benchmark::Initialize(&argc, argv);
+  ::benchmark::RunSpecifiedBenchmarks();
+}
@@ -9,6 +9,8 @@
 #include "index/Background.h"
 #include "ClangdUnit.h"
 #include "Compiler.h"
+#include "FS.h"
+#include "FileDistance.h"
 #include "Logger.h"
 #include "SourceCode.h"
 #include "Threading.h"
@@ -18,8 +20,11 @@
 #include "index/MemIndex.h"
 #include "index/Serialization.h"
 #include "index/SymbolCollector.h"
+#include "clang/AST/ASTContext.h"
 #include "clang/Basic/SourceLocation.h"
 #include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/ScopeExit.h"
 #include "llvm/ADT/StringMap.h"
@@ -33,6 +38,7 @@
 #include <random>
 #include <string>
 #include <thread>
+#include <tuple>
 
 namespace clang {
 namespace clangd {
@@ -88,18 +94,31 @@ IncludeGraph getSubGraph(const URI &U, const IncludeGraph &FullGraph) {
   return IG;
 }
 
+// Whether a TU that was only picked to refresh \p OnlyFiles must leave the
+// shard of \p Path alone. Files that were never indexed are refreshed too, e.g.
+// a new header that a stale header started to include.
+bool keepsShard(llvm::StringRef Path, const llvm::StringSet<> &OnlyFiles,
+                const llvm::StringMap<FileDigest> &FileDigests) {
+  return !OnlyFiles.empty() && !OnlyFiles.count(Path) &&
+         FileDigests.count(Path);
+}
+
 // Creates a filter to not collect index results from files with unchanged
 // digests.
 // \p FileDigests contains file digests for the current indexed files.
+// If \p OnlyFiles is non-empty, other indexed files are skipped too.
 decltype(SymbolCollector::Options::FileFilter)
-createFileFilter(const llvm::StringMap<FileDigest> &FileDigests) {
-  return [&FileDigests](const SourceManager &SM, FileID FID) {
+createFileFilter(const llvm::StringMap<FileDigest> &FileDigests,
+                 const llvm::StringSet<> &OnlyFiles) {
+  return [&FileDigests, &OnlyFiles](const SourceManager &SM, FileID FID) {
     const auto *F = SM.getFileEntryForID(FID);
     if (!F)
       return false; // Skip invalid files.
     auto AbsPath = getCanonicalPath(F, SM);
     if (!AbsPath)
       return false; // Skip files without absolute path.
+    if (keepsShard(*AbsPath, OnlyFiles, FileDigests))
+      return false; // Skip files this TU wasn't picked to refresh.
     auto Digest = digestFile(SM, FID);
     if (!Digest)
       return false;
@@ -123,24 +142,80 @@ llvm::SmallString<128> getAbsolutePath(const tooling::CompileCommand &Cmd) {
   }
   return AbsolutePath;
 }
+
+// Approximates the memory held by a TU while it is being indexed.
+size_t estimateMemoryUsage(const CompilerInstance &Clang) {
+  size_t Total = 0;
+  if (Clang.hasASTContext()) {
+    const ASTContext &AST = Clang.getASTContext();
+    Total += AST.getASTAllocatedMemory();
+    Total += AST.getSideTableAllocatedMemory();
+  }
+  if (Clang.hasSourceManager()) {
+    const SourceManager &SM = Clang.getSourceManager();
+    Total += SM.getContentCacheSize();
+    Total += SM.getDataStructureSizes();
+    Total += SM.getMemoryBufferSizes().malloc_bytes;
+  }
+  if (Clang.hasPreprocessor())
+    Total += Clang.getPreprocessor().getTotalMemory();
+  return Total;
+}
+
+// Computes the distances of TUs to \p RecentFiles, most recent first. Only
+// usable on one thread, FileDistance caches the distances of directories.
+class RecentFilesDistance {
+public:
+  RecentFilesDistance(const std::vector<std::string> &RecentFiles,
+                      unsigned RecencyCost) {
+    if (RecentFiles.empty())
+      return;
+    // Files edited more recently are closer.
+    llvm::StringMap<SourceParams> Sources;
+    for (unsigned I = 0; I < RecentFiles.size(); ++I)
+      Sources[RecentFiles[I]].Cost = I * RecencyCost;
+    Distances.emplace(std::move(Sources));
+  }
+
+  unsigned distance(llvm::ArrayRef<llvm::StringRef> Files) {
+    if (!Distances || Files.empty())
+      return FileDistance::Unreachable;
+    unsigned Distance = Distances->distance(Files.front());
+    // TUs that include a recently edited header are close to it too.
+    for (const auto &Include : Files.drop_front()) {
+      unsigned IncludeDistance = Distances->distance(Include);
+      if (IncludeDistance != FileDistance::Unreachable)
+        Distance = std::min(
+            Distance, IncludeDistance + FileDistanceOptions().IncludeCost);
+    }
+    return Distance;
+  }
+
+private:
+  llvm::Optional<FileDistance> Distances;
+};
+
 } // namespace
 
 BackgroundIndex::BackgroundIndex(
     Context BackgroundContext, const FileSystemProvider &FSProvider,
     const GlobalCompilationDatabase &CDB,
     BackgroundIndexStorage::Factory IndexStorageFactory,
-    size_t BuildIndexPeriodMs, size_t ThreadPoolSize)
+    size_t BuildIndexPeriodMs, size_t ThreadPoolSize,
+    BackgroundIndexLimits Limits)
     : SwapIndex(llvm::make_unique<MemIndex>()), FSProvider(FSProvider),
       CDB(CDB), BackgroundContext(std::move(BackgroundContext)),
       BuildIndexPeriodMs(BuildIndexPeriodMs),
       SymbolsUpdatedSinceLastIndex(false),
-      IndexStorageFactory(std::move(IndexStorageFactory)),
+      IndexStorageFactory(std::move(IndexStorageFactory)), Limits(Limits),
       CommandsChanged(
           CDB.watch([&](const std::vector<std::string> &ChangedFiles) {
             enqueue(ChangedFiles);
           })) {
   assert(ThreadPoolSize > 0 && "Thread pool size can't be zero.");
   assert(this->IndexStorageFactory && "Storage factory can not be null!");
+  assert(Limits.CPUShare > 0 && Limits.CPUShare <= 1 &&
+         "CPU share must be in (0, 1]");
   while (ThreadPoolSize--)
     ThreadPool.emplace_back([this] { run(); });
   if (BuildIndexPeriodMs > 0) {
@@ -169,34 +244,219 @@ void BackgroundIndex::stop() {
 void BackgroundIndex::run() {
   WithContext Background(BackgroundContext.clone());
   while (true) {
-    llvm::Optional<Task> Task;
-    ThreadPriority Priority;
+    llvm::Optional<QueuedTask> Task;
     {
       std::unique_lock<std::mutex> Lock(QueueMu);
-      QueueCV.wait(Lock, [&] { return ShouldStop || !Queue.empty(); });
+      while (true) {
+        QueueCV.wait(Lock, [&] { return ShouldStop || canRunFrontLocked(); });
+        if (ShouldStop || !DistancesOutdated || UpdatingDistances)
+          break;
+        // The front may change once the distances are up to date.
+        updateDistances(Lock);
+      }
       if (ShouldStop) {
         Queue.clear();
         QueueCV.notify_all();
         return;
       }
       ++NumActiveTasks;
-      std::tie(Task, Priority) = std::move(Queue.front());
+      Task = std::move(Queue.front());
       Queue.pop_front();
+      if (Task->Priority == ThreadPriority::Low) {
+        ++NumActiveLowPriorityTasks;
+        BytesInFlight += Task->EstimatedBytes;
+      }
     }
 
+    ThreadPriority Priority = Task->Priority;
+    auto StartTime = std::chrono::steady_clock::now();
     if (Priority != ThreadPriority::Normal)
       setCurrentThreadPriority(Priority);
-    (*Task)();
+    Task->Run();
     if (Priority != ThreadPriority::Normal)
       setCurrentThreadPriority(ThreadPriority::Normal);
+    auto EndTime = std::chrono::steady_clock::now();
+    auto BusyTime = EndTime - StartTime;
 
     {
       std::unique_lock<std::mutex> Lock(QueueMu);
       assert(NumActiveTasks > 0 && "before decrementing");
       --NumActiveTasks;
+      if (Priority == ThreadPriority::Low) {
+        assert(NumActiveLowPriorityTasks > 0 && "before decrementing");
+        --NumActiveLowPriorityTasks;
+        BytesInFlight -= Task->EstimatedBytes;
+      }
+      // The first TU indexed that is, or includes, the last boosted file is
+      // the first useful result for the user.
+      if (WaitingForRelatedResult && Task->Files &&
+          llvm::is_contained(Task->Files->paths(), BoostedFile)) {
+        WaitingForRelatedResult = false;
+        TimeToRelatedResult = EndTime - BoostedAt;
+        log("BackgroundIndex: indexed {0} for {1} after {2} ms.",
+            Task->Files->paths().front(), BoostedFile,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                TimeToRelatedResult)
+                .count());
+      }
     }
     QueueCV.notify_all();
+
+    // Stay within the CPU share by idling in proportion to the time spent
+    // indexing. Other tasks are cheap and don't count.
+    if (Priority == ThreadPriority::Low && Limits.CPUShare < 1.0) {
+      auto IdleTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+          BusyTime * (1 / Limits.CPUShare - 1));
+      std::unique_lock<std::mutex> Lock(QueueMu);
+      QueueCV.wait_for(Lock, IdleTime, [&] { return ShouldStop; });
+    }
+  }
+}
+
+bool BackgroundIndex::canRunFrontLocked() const {
+  if (Queue.empty())
+    return false;
+  const QueuedTask &Front = Queue.front();
+  // Only indexing of TUs is throttled, the other tasks are cheap.
+  if (Front.Priority != ThreadPriority::Low)
+    return true;
+  if (PauseCount > 0)
+    return false;
+  if (Limits.MaxConcurrentTUs > 0 &&
+      NumActiveLowPriorityTasks >= Limits.MaxConcurrentTUs)
+    return false;
+  // Always let a single TU through, no matter how large it is.
+  if (Limits.MaxMemoryBytes > 0 && NumActiveLowPriorityTasks > 0 &&
+      BytesInFlight + Front.EstimatedBytes > Limits.MaxMemoryBytes)
+    return false;
+  return true;
+}
+
+size_t BackgroundIndex::estimateBytesLocked(llvm::StringRef MainFile) const {
+  auto It = BytesPerTU.find(MainFile);
+  if (It != BytesPerTU.end())
+    return It->second;
+  // Assume TUs we haven't indexed yet are as large as an average one.
+  return BytesPerTU.empty() ? 0 : TotalRecordedBytes / BytesPerTU.size();
+}
+
+void BackgroundIndex::recordBytes(llvm::StringRef MainFile, size_t Bytes) {
+  std::lock_guard<std::mutex> Lock(QueueMu);
+  size_t &Recorded = BytesPerTU[MainFile];
+  TotalRecordedBytes = TotalRecordedBytes - Recorded + Bytes;
+  Recorded = Bytes;
+}
+
+void BackgroundIndex::pause() {
+  std::lock_guard<std::mutex> Lock(QueueMu);
+  if (PauseCount++ > 0)
+    return;
+  ++TimesPaused;
+  PausedSince = std::chrono::steady_clock::now();
+  vlog("BackgroundIndex: paused with {0} tasks in the queue.", Queue.size());
+}
+
+void BackgroundIndex::resume() {
+  {
+    std::lock_guard<std::mutex> Lock(QueueMu);
+    assert(PauseCount > 0 && "resume() without pause()");
+    if (--PauseCount > 0)
+      return;
+    TimePaused += std::chrono::steady_clock::now() - PausedSince;
   }
+  QueueCV.notify_all();
+}
+
+BackgroundIndex::Stats BackgroundIndex::stats() const {
+  std::lock_guard<std::mutex> Lock(QueueMu);
+  Stats S;
+  S.QueueDepth = Queue.size();
+  S.ActiveTasks = NumActiveTasks;
+  S.EstimatedBytesInFlight = BytesInFlight;
+  S.Paused = PauseCount > 0;
+  S.TimesPaused = TimesPaused;
+  S.TimePaused = TimePaused;
+  if (S.Paused)
+    S.TimePaused += std::chrono::steady_clock::now() - PausedSince;
+  S.TimeToRelatedResult = TimeToRelatedResult;
+  return S;
+}
+
+void BackgroundIndex::boostRelated(PathRef File) {
+  std::lock_guard<std::mutex> Lock(QueueMu);
+  // Nothing changes while the user keeps editing the same file.
+  if (!RecentFiles.empty() && RecentFiles.front() == File)
+    return;
+  RecentFiles.erase(std::remove(RecentFiles.begin(), RecentFiles.end(), File),
+                    RecentFiles.end());
+  RecentFiles.insert(RecentFiles.begin(), File.str());
+  if (RecentFiles.size() > MaxRecentFiles)
+    RecentFiles.pop_back();
+  BoostedFile = File;
+  BoostedAt = std::chrono::steady_clock::now();
+  WaitingForRelatedResult = true;
+  ++RecentFilesVersion;
+  DistancesOutdated = true;
+}
+
+void BackgroundIndex::updateDistances(std::unique_lock<std::mutex> &Lock) {
+  DistancesOutdated = false;
+  UpdatingDistances = true;
+  unsigned Version = RecentFilesVersion;
+  std::vector<std::string> Recent = RecentFiles;
+  // Keeping the lists alive also keeps their addresses unique.
+  std::vector<std::shared_ptr<const DependencyList>> Outdated;
+  for (const auto &Task : Queue)
+    if (Task.Files && Task.DistanceVersion != Version)
+      Outdated.push_back(Task.Files);
+  Lock.unlock();
+
+  RecentFilesDistance Distances(Recent, RecencyCost);
+  llvm::DenseMap<const DependencyList *, unsigned> NewDistances;
+  for (const auto &Files : Outdated)
+    NewDistances[Files.get()] = Distances.distance(Files->paths());
+
+  Lock.lock();
+  UpdatingDistances = false;
+  for (auto &Task : Queue) {
+    if (!Task.Files)
+      continue;
+    auto It = NewDistances.find(Task.Files.get());
+    if (It == NewDistances.end())
+      continue;
+    Task.Distance = It->second;
+    Task.DistanceVersion = Version;
+  }
+  std::stable_sort(Queue.begin(), Queue.end(), runsBefore);
+  QueueCV.notify_all();
+}
+
+BackgroundIndex::DependencyList::DependencyList(
+    BackgroundIndex &Owner, const std::vector<Source> &Dependencies)
+    : Owner(Owner) {
+  Paths.reserve(Dependencies.size());
+  std::lock_guard<std::mutex> Lock(Owner.DependencyPathsMu);
+  for (const auto &Dependency : Dependencies) {
+    auto It = Owner.DependencyPaths.try_emplace(Dependency.Path, 0).first;
+    ++It->second;
+    Paths.push_back(It->getKey());
+  }
+}
+
+BackgroundIndex::DependencyList::~DependencyList() {
+  std::lock_guard<std::mutex> Lock(Owner.DependencyPathsMu);
+  for (llvm::StringRef Path : Paths) {
+    auto It = Owner.DependencyPaths.find(Path);
+    if (--It->second == 0)
+      Owner.DependencyPaths.erase(It);
+  }
+}
+
+bool BackgroundIndex::runsBefore(const QueuedTask &L, const QueuedTask &R) {
+  // Tasks with Normal priority come first, then indexing of TUs close to the
+  // recently edited files.
+  return std::make_tuple(L.Priority == ThreadPriority::Low, L.Distance) <
+         std::make_tuple(R.Priority == ThreadPriority::Low, R.Distance);
 }
 
 bool BackgroundIndex::blockUntilIdleForTest(
@@ -213,46 +473,70 @@ void BackgroundIndex::enqueue(const std::vector<std::string> &ChangedFiles) {
         // We're doing this asynchronously, because we'll read shards here too.
         log("Enqueueing {0} commands for indexing", ChangedFiles.size());
         SPAN_ATTACH(Tracer, "files", int64_t(ChangedFiles.size()));
+        SPAN_ATTACH(Tracer, "queue_depth", int64_t(stats().QueueDepth));
 
         auto NeedsReIndexing = loadShards(std::move(ChangedFiles));
         // Run indexing for files that need to be updated.
         std::shuffle(NeedsReIndexing.begin(), NeedsReIndexing.end(),
                      std::mt19937(std::random_device{}()));
         for (auto &Elem : NeedsReIndexing)
-          enqueue(std::move(Elem.first), Elem.second);
+          enqueue(std::move(Elem));
       },
       ThreadPriority::Normal);
 }
 
-void BackgroundIndex::enqueue(tooling::CompileCommand Cmd,
-                              BackgroundIndexStorage *Storage) {
+void BackgroundIndex::enqueue(ReindexRequest Request) {
+  size_t EstimatedBytes;
+  {
+    std::lock_guard<std::mutex> Lock(QueueMu);
+    EstimatedBytes = estimateBytesLocked(getAbsolutePath(Request.Cmd));
+  }
+  std::shared_ptr<const DependencyList> Files = std::move(Request.Dependencies);
   enqueueTask(Bind(
-                  [this, Storage](tooling::CompileCommand Cmd) {
+                  [this](ReindexRequest Request) {
                     // We can't use llvm::StringRef here since we are going to
                     // move from Cmd during the call below.
-                    const std::string FileName = Cmd.Filename;
-                    if (auto Error = index(std::move(Cmd), Storage))
+                    const std::string FileName = Request.Cmd.Filename;
+                    llvm::StringSet<> OnlyFiles;
+                    for (const auto &Header : Request.StaleHeaders)
+                      OnlyFiles.insert(Header);
+                    if (auto Error = index(std::move(Request.Cmd),
+                                           Request.Storage, OnlyFiles))
                       elog("Indexing {0} failed: {1}", FileName,
                            std::move(Error));
                   },
-                  std::move(Cmd)),
-              ThreadPriority::Low);
+                  std::move(Request)),
+              ThreadPriority::Low, EstimatedBytes, std::move(Files));
 }
 
-void BackgroundIndex::enqueueTask(Task T, ThreadPriority Priority) {
+void BackgroundIndex::enqueueTask(
+    Task T, ThreadPriority Priority, size_t EstimatedBytes,
+    std::shared_ptr<const DependencyList> Files) {
+  unsigned Distance = 0, Version = 0;
+  if (Priority == ThreadPriority::Low) {
+    std::vector<std::string> Recent;
+    {
+      std::lock_guard<std::mutex> Lock(QueueMu);
+      Recent = RecentFiles;
+      Version = RecentFilesVersion;
+    }
+    Distance = FileDistance::Unreachable;
+    if (Files)
+      Distance =
+          RecentFilesDistance(Recent, RecencyCost).distance(Files->paths());
+  }
   {
     std::lock_guard<std::mutex> Lock(QueueMu);
-    auto I = Queue.end();
-    // We first store the tasks with Normal priority in the front of the queue.
-    // Then we store low priority tasks. Normal priority tasks are pretty rare,
-    // they should not grow beyond single-digit numbers, so it is OK to do
-    // linear search and insert after that.
-    if (Priority == ThreadPriority::Normal) {
-      I = llvm::find_if(Queue, [](const std::pair<Task, ThreadPriority> &Elem) {
-        return Elem.second == ThreadPriority::Low;
-      });
-    }
-    Queue.insert(I, {std::move(T), Priority});
+    // The recent files may have changed while we computed the distance.
+    if (Files && Version != RecentFilesVersion)
+      DistancesOutdated = true;
+    QueuedTask Elem{std::move(T), Priority, EstimatedBytes, std::move(Files),
+                    Distance, Version};
+    // The queue is kept sorted: tasks with Normal priority in the front, then
+    // low priority tasks by their distance to the recently edited files. Ties
+    // are broken in FIFO order.
+    auto I = std::upper_bound(Queue.begin(), Queue.end(), Elem, runsBefore);
+    Queue.insert(I, std::move(Elem));
   }
   QueueCV.notify_all();
 }
@@ -262,6 +546,7 @@ void BackgroundIndex::enqueueTask(Task T, ThreadPriority Priority) {
 /// information on IndexStorage.
 void BackgroundIndex::update(llvm::StringRef MainFile, IndexFileIn Index,
                              const llvm::StringMap<FileDigest> &DigestsSnapshot,
+                             const llvm::StringSet<> &OnlyFiles,
                              BackgroundIndexStorage *IndexStorage) {
   // Partition symbols/references into files.
   struct File {
@@ -274,6 +559,9 @@ void BackgroundIndex::update(llvm::StringRef MainFile, IndexFileIn Index,
   for (const auto &IndexIt : *Index.Sources) {
     const auto &IGN = IndexIt.getValue();
     const auto AbsPath = URICache.resolve(IGN.URI);
+    // Symbols of other files weren't collected, keep their shards as they are.
+    if (keepsShard(AbsPath, OnlyFiles, DigestsSnapshot))
+      continue;
     const auto DigestIt = DigestsSnapshot.find(AbsPath);
     // File has different contents.
     if (DigestIt == DigestsSnapshot.end() || DigestIt->getValue() != IGN.Digest)
@@ -377,9 +665,12 @@ void BackgroundIndex::buildIndex() {
 }
 
 llvm::Error BackgroundIndex::index(tooling::CompileCommand Cmd,
-                                   BackgroundIndexStorage *IndexStorage) {
+                                   BackgroundIndexStorage *IndexStorage,
+                                   const llvm::StringSet<> &OnlyFiles) {
   trace::Span Tracer("BackgroundIndex");
   SPAN_ATTACH(Tracer, "file", Cmd.Filename);
+  SPAN_ATTACH(Tracer, "header_only", !OnlyFiles.empty());
+  TraceFileSystemOperations FSOps(Tracer);
   auto AbsolutePath = getAbsolutePath(Cmd);
 
   auto FS = FSProvider.getFileSystem();
@@ -413,7 +704,7 @@ llvm::Error BackgroundIndex::index(tooling::CompileCommand Cmd,
                                    "Couldn't build compiler instance");
 
   SymbolCollector::Options IndexOpts;
-  IndexOpts.FileFilter = createFileFilter(DigestsSnapshot);
+  IndexOpts.FileFilter = createFileFilter(DigestsSnapshot, OnlyFiles);
   IndexFileIn Index;
   auto Action = createStaticIndexingAction(
       IndexOpts, [&](SymbolSlab S) { Index.Symbols = std::move(S); },
@@ -432,6 +723,8 @@ llvm::Error BackgroundIndex::index(tooling::CompileCommand Cmd,
   if (!Action->Execute())
     return llvm::createStringError(llvm::inconvertibleErrorCode(),
                                    "Execute() failed");
+  // Remember how much memory this TU needed, to throttle the next runs.
+  recordBytes(AbsolutePath, estimateMemoryUsage(*Clang));
   Action->EndSourceFile();
   if (Clang->hasDiagnostics() &&
       Clang->getDiagnostics().hasUncompilableErrorOccurred()) {
@@ -450,7 +743,8 @@ llvm::Error BackgroundIndex::index(tooling::CompileCommand Cmd,
   SPAN_ATTACH(Tracer, "refs", int(Index.Refs->numRefs()));
   SPAN_ATTACH(Tracer, "sources", int(Index.Sources->size()));
 
-  update(AbsolutePath, std::move(Index), DigestsSnapshot, IndexStorage);
+  update(AbsolutePath, std::move(Index), DigestsSnapshot, OnlyFiles,
+         IndexStorage);
 
   if (BuildIndexPeriodMs > 0)
     SymbolsUpdatedSinceLastIndex = true;
@@ -462,9 +756,9 @@ llvm::Error BackgroundIndex::index(tooling::CompileCommand Cmd,
 }
 
 std::vector<BackgroundIndex::Source>
-BackgroundIndex::loadShard(const tooling::CompileCommand &Cmd,
-                           BackgroundIndexStorage *IndexStorage,
-                           llvm::StringSet<> &LoadedShards) {
+BackgroundIndex::loadShard(
+    const tooling::CompileCommand &Cmd, BackgroundIndexStorage *IndexStorage,
+    llvm::StringMap<std::vector<std::string>> &LoadedShards) {
   struct ShardInfo {
     std::string AbsolutePath;
     std::unique_ptr<IndexFileIn> Shard;
@@ -494,10 +788,16 @@ BackgroundIndex::loadShard(const tooling::CompileCommand &Cmd,
     // If we have already seen this shard before(either loaded or failed) don't
     // re-try again. Since the information in the shard won't change from one TU
     // to another.
-    if (!LoadedShards.try_emplace(CurDependency.Path).second) {
+    auto Loaded = LoadedShards.try_emplace(CurDependency.Path);
+    std::vector<std::string> &Includes = Loaded.first->second;
+    if (!Loaded.second) {
       // If the dependency needs to be re-indexed, first occurence would already
       // have detected that, so we don't need to issue it again.
       CurDependency.NeedsReIndexing = false;
+      // The TU still depends on everything the shard includes.
+      for (const auto &Include : Includes)
+        if (InQueue.try_emplace(Include).second)
+          ToVisit.emplace(Include, true);
       continue;
     }
 
@@ -520,8 +820,10 @@ BackgroundIndex::loadShard(const tooling::CompileCommand &Cmd,
         ToVisit.emplace(*AbsolutePath, true);
       // The node contains symbol information only for current file, the rest is
       // just edges.
-      if (*AbsolutePath != CurDependency.Path)
+      if (*AbsolutePath != CurDependency.Path) {
+        Includes.push_back(*AbsolutePath);
         continue;
+      }
 
       // We found source file info for current dependency.
       assert(I.getValue().Digest != FileDigest{{0}} && "Digest is empty?");
@@ -566,17 +868,21 @@ BackgroundIndex::loadShard(const tooling::CompileCommand &Cmd,
 }
 
 // Goes over each changed file and loads them from index. Returns the list of
-// TUs that had out-of-date/no shards.
-std::vector<std::pair<tooling::CompileCommand, BackgroundIndexStorage *>>
+// TUs that had out-of-date/no shards, or include headers that do.
+std::vector<BackgroundIndex::ReindexRequest>
 BackgroundIndex::loadShards(std::vector<std::string> ChangedFiles) {
-  std::vector<std::pair<tooling::CompileCommand, BackgroundIndexStorage *>>
-      NeedsReIndexing;
-  // Keeps track of the files that will be reindexed, to make sure we won't
-  // re-index same dependencies more than once. Keys are AbsolutePaths.
-  llvm::StringSet<> FilesToIndex;
+  struct LoadedTU {
+    tooling::CompileCommand Cmd;
+    BackgroundIndexStorage *Storage;
+    // The TU itself always comes first.
+    std::vector<Source> Dependencies;
+  };
+  std::vector<LoadedTU> TUs;
+  // Files with out-of-date/no shards. Keys are absolute paths.
+  llvm::StringSet<> StaleFiles;
   // Keeps track of the loaded shards to make sure we don't perform redundant
   // disk IO. Keys are absolute paths.
-  llvm::StringSet<> LoadedShards;
+  llvm::StringMap<std::vector<std::string>> LoadedShards;
   for (const auto &File : ChangedFiles) {
     ProjectInfo PI;
     auto Cmd = CDB.getCompileCommand(File, &PI);
@@ -584,25 +890,59 @@ BackgroundIndex::loadShards(std::vector<std::string> ChangedFiles) {
       continue;
     BackgroundIndexStorage *IndexStorage = IndexStorageFactory(PI.SourceRoot);
     auto Dependencies = loadShard(*Cmd, IndexStorage, LoadedShards);
-    for (const auto &Dependency : Dependencies) {
-      if (!Dependency.NeedsReIndexing || FilesToIndex.count(Dependency.Path))
-        continue;
-      // FIXME: Currently, we simply schedule indexing on a TU whenever any of
-      // its dependencies needs re-indexing. We might do it smarter by figuring
-      // out a minimal set of TUs that will cover all the stale dependencies.
-      vlog("Enqueueing TU {0} because its dependency {1} needs re-indexing.",
-           Cmd->Filename, Dependency.Path);
-      NeedsReIndexing.push_back({std::move(*Cmd), IndexStorage});
-      // Mark all of this TU's dependencies as to-be-indexed so that we won't
-      // try to re-index those.
-      for (const auto &Dependency : Dependencies)
-        FilesToIndex.insert(Dependency.Path);
-      break;
-    }
+    for (const auto &Dependency : Dependencies)
+      if (Dependency.NeedsReIndexing)
+        StaleFiles.insert(Dependency.Path);
+    TUs.push_back({std::move(*Cmd), IndexStorage, std::move(Dependencies)});
   }
   vlog("Loaded all shards");
   reset(IndexedSymbols.buildIndex(IndexType::Light, DuplicateHandling::Merge));
 
+  auto InternPaths = [this](const std::vector<Source> &Dependencies) {
+    return std::make_shared<const DependencyList>(*this, Dependencies);
+  };
+  std::vector<ReindexRequest> NeedsReIndexing;
+  // Keeps track of the files that will be reindexed, to make sure we won't
+  // re-index same dependencies more than once. Keys are AbsolutePaths.
+  llvm::StringSet<> FilesToIndex;
+  // TUs that changed themselves are re-indexed as a whole, which also covers
+  // all of their dependencies.
+  std::vector<LoadedTU *> UpToDateTUs;
+  for (auto &TU : TUs) {
+    llvm::StringRef MainFile = TU.Dependencies.front().Path;
+    if (!StaleFiles.count(MainFile) || FilesToIndex.count(MainFile)) {
+      UpToDateTUs.push_back(&TU);
+      continue;
+    }
+    vlog("Enqueueing TU {0} because it needs re-indexing.", TU.Cmd.Filename);
+    for (const auto &Dependency : TU.Dependencies)
+      FilesToIndex.insert(Dependency.Path);
+    NeedsReIndexing.push_back(
+        {std::move(TU.Cmd), TU.Storage, {}, InternPaths(TU.Dependencies)});
+  }
+  // The remaining stale files are headers. Rather than re-indexing every TU
+  // that includes them, refresh each header through a single TU and leave the
+  // shards of the other files alone. Parsing cost grows with the number of
+  // dependencies, so prefer TUs with fewer of them. Dependencies holds the
+  // whole include graph of each TU, including shards loaded for earlier TUs.
+  llvm::sort(UpToDateTUs, [](const LoadedTU *L, const LoadedTU *R) {
+    return L->Dependencies.size() < R->Dependencies.size();
+  });
+  for (LoadedTU *TU : UpToDateTUs) {
+    std::vector<std::string> StaleHeaders;
+    for (const auto &Dependency : TU->Dependencies)
+      if (StaleFiles.count(Dependency.Path) &&
+          FilesToIndex.insert(Dependency.Path).second)
+        StaleHeaders.push_back(Dependency.Path);
+    if (StaleHeaders.empty())
+      continue;
+    vlog("Enqueueing TU {0} to re-index {1} of its headers, e.g. {2}.",
+         TU->Cmd.Filename, StaleHeaders.size(), StaleHeaders.front());
+    NeedsReIndexing.push_back({std::move(TU->Cmd), TU->Storage,
+                               std::move(StaleHeaders),
+                               InternPaths(TU->Dependencies)});
+  }
+
   return NeedsReIndexing;
 }
 
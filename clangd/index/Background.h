@@ -11,6 +11,7 @@
 
 #include "Context.h"
 #include "FSProvider.h"
+#include "FileDistance.h"
 #include "GlobalCompilationDatabase.h"
 #include "Threading.h"
 #include "index/FileIndex.h"
@@ -18,11 +19,14 @@
 #include "index/Serialization.h"
 #include "clang/Tooling/CompilationDatabase.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/SHA1.h"
 #include "llvm/Support/Threading.h"
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -58,6 +62,21 @@ public:
   static Factory createDiskBackedStorageFactory();
 };
 
+// Limits the resources consumed by background indexing, so that it doesn't
+// compete with interactive work on the user's machine.
+struct BackgroundIndexLimits {
+  // Maximum number of TUs indexed at the same time. 0 means no limit other
+  // than the size of the thread pool.
+  unsigned MaxConcurrentTUs = 0;
+  // Upper bound, in bytes, on the estimated memory held by TUs that are being
+  // indexed at the same time. 0 means no limit. A single TU is always allowed
+  // to run, even if its estimate exceeds the budget.
+  size_t MaxMemoryBytes = 0;
+  // Fraction of each thread's wall time that may be spent indexing TUs, in
+  // (0, 1]. Threads sleep after each TU to stay within the share.
+  double CPUShare = 1.0;
+};
+
 // Builds an in-memory index by by running the static indexer action over
 // all commands in a compilation database. Indexing happens in the background.
 // FIXME: it should also persist its state on disk for fast start.
@@ -72,7 +91,8 @@ public:
       const GlobalCompilationDatabase &CDB,
       BackgroundIndexStorage::Factory IndexStorageFactory,
       size_t BuildIndexPeriodMs = 0,
-      size_t ThreadPoolSize = llvm::heavyweight_hardware_concurrency());
+      size_t ThreadPoolSize = llvm::heavyweight_hardware_concurrency(),
+      BackgroundIndexLimits Limits = {});
   ~BackgroundIndex(); // Blocks while the current task finishes.
 
   // Enqueue translation units for indexing.
@@ -84,16 +104,45 @@ public:
   // tasks will be discarded.
   void stop();
 
+  // Called when \p File is opened or edited. TUs close to the recently edited
+  // files, in the directory tree or through their includes, are indexed first.
+  void boostRelated(PathRef File);
+
+  // Holds back indexing of TUs that haven't started yet, e.g. while the user is
+  // typing and interactive requests are pending. Calls nest: indexing resumes
+  // once each pause() has been matched by a resume().
+  void pause();
+  void resume();
+
+  struct Stats {
+    // Number of tasks waiting in the queue.
+    size_t QueueDepth = 0;
+    // Number of tasks currently running.
+    unsigned ActiveTasks = 0;
+    // Sum of memory estimates of the TUs currently being indexed.
+    size_t EstimatedBytesInFlight = 0;
+    bool Paused = false;
+    // How many times indexing was paused, and for how long overall.
+    unsigned TimesPaused = 0;
+    std::chrono::steady_clock::duration TimePaused{0};
+    // Time from the last boostRelated() call until a TU that is, or includes,
+    // the boosted file was indexed. Zero if that didn't happen yet.
+    std::chrono::steady_clock::duration TimeToRelatedResult{0};
+  };
+  Stats stats() const;
+
   // Wait until the queue is empty, to allow deterministic testing.
   LLVM_NODISCARD bool
   blockUntilIdleForTest(llvm::Optional<double> TimeoutSeconds = 10);
 
 private:
   /// Given index results from a TU, only update symbols coming from files with
-  /// different digests than \p DigestsSnapshot. Also stores new index
-  /// information on IndexStorage.
+  /// different digests than \p DigestsSnapshot. If \p OnlyFiles is non-empty,
+  /// other files in \p DigestsSnapshot are left untouched. Also stores new
+  /// index information on IndexStorage.
   void update(llvm::StringRef MainFile, IndexFileIn Index,
               const llvm::StringMap<FileDigest> &DigestsSnapshot,
+              const llvm::StringSet<> &OnlyFiles,
               BackgroundIndexStorage *IndexStorage);
 
   // configuration
@@ -102,8 +151,12 @@ private:
   Context BackgroundContext;
 
   // index state
+  // Indexes the TU. If \p OnlyFiles is non-empty, the TU is only used to
+  // refresh symbols of those files (absolute paths), and of files that were
+  // never indexed.
   llvm::Error index(tooling::CompileCommand,
-                    BackgroundIndexStorage *IndexStorage);
+                    BackgroundIndexStorage *IndexStorage,
+                    const llvm::StringSet<> &OnlyFiles);
   void buildIndex(); // Rebuild index periodically every BuildIndexPeriodMs.
   const size_t BuildIndexPeriodMs;
   std::atomic<bool> SymbolsUpdatedSinceLastIndex;
@@ -123,25 +176,104 @@ private:
   };
   // Loads the shards for a single TU and all of its dependencies. Returns the
   // list of sources and whether they need to be re-indexed.
-  std::vector<Source> loadShard(const tooling::CompileCommand &Cmd,
-                                BackgroundIndexStorage *IndexStorage,
-                                llvm::StringSet<> &LoadedShards);
+  // \p LoadedShards maps the shards loaded for earlier TUs, or that failed to
+  // load, to their direct includes. They are not loaded again, but the
+  // dependencies of the TU still include them and their includes.
+  std::vector<Source>
+  loadShard(const tooling::CompileCommand &Cmd,
+            BackgroundIndexStorage *IndexStorage,
+            llvm::StringMap<std::vector<std::string>> &LoadedShards);
+  // A TU followed by the files it depends on. The paths are interned in
+  // DependencyPaths, and dropped from it once no list refers to them anymore.
+  class DependencyList {
+  public:
+    DependencyList(BackgroundIndex &Owner,
+                   const std::vector<Source> &Dependencies);
+    ~DependencyList();
+    llvm::ArrayRef<llvm::StringRef> paths() const { return Paths; }
+
+  private:
+    BackgroundIndex &Owner;
+    std::vector<llvm::StringRef> Paths;
+  };
+  // A TU that needs to be (re-)indexed.
+  struct ReindexRequest {
+    tooling::CompileCommand Cmd;
+    BackgroundIndexStorage *Storage;
+    // If non-empty, the TU itself is up-to-date and was only picked to refresh
+    // these headers (absolute paths). Shards of other indexed files are left
+    // alone.
+    std::vector<std::string> StaleHeaders;
+    // The TU and the files it depends on, used for prioritization.
+    std::shared_ptr<const DependencyList> Dependencies;
+  };
   // Tries to load shards for the ChangedFiles.
-  std::vector<std::pair<tooling::CompileCommand, BackgroundIndexStorage *>>
-  loadShards(std::vector<std::string> ChangedFiles);
-  void enqueue(tooling::CompileCommand Cmd, BackgroundIndexStorage *Storage);
+  std::vector<ReindexRequest> loadShards(std::vector<std::string> ChangedFiles);
+  void enqueue(ReindexRequest Request);
+  // Paths of the files the queued TUs depend on, and how many DependencyLists
+  // refer to each. Most TUs share many headers.
+  llvm::StringMap<unsigned> DependencyPaths;
+  std::mutex DependencyPathsMu;
 
   // queue management
   using Task = std::function<void()>;
+  struct QueuedTask {
+    Task Run;
+    ThreadPriority Priority;
+    // Estimated memory needed to run the task, zero if unknown.
+    size_t EstimatedBytes;
+    // For indexing tasks, the TU followed by the files it depends on.
+    std::shared_ptr<const DependencyList> Files;
+    // Distance of Files to the recently edited files, as of the given
+    // RecentFilesVersion.
+    unsigned Distance;
+    unsigned DistanceVersion;
+  };
   void run(); // Main loop executed by Thread. Runs tasks from Queue.
-  void enqueueTask(Task T, ThreadPriority Prioirty);
-  void enqueueLocked(tooling::CompileCommand Cmd,
-                     BackgroundIndexStorage *IndexStorage);
-  std::mutex QueueMu;
+  void enqueueTask(Task T, ThreadPriority Prioirty, size_t EstimatedBytes = 0,
+                   std::shared_ptr<const DependencyList> Files = nullptr);
+  // Whether \p L should be run before \p R.
+  static bool runsBefore(const QueuedTask &L, const QueuedTask &R);
+  // Recomputes the outdated distances of the queued tasks and sorts the queue
+  // again. \p Lock holds QueueMu, it is released during the computation.
+  void updateDistances(std::unique_lock<std::mutex> &Lock);
+  // Whether the limits allow the task at the front of the queue to start now.
+  bool canRunFrontLocked() const;
+  // Estimates the memory needed to index the TU, based on earlier runs.
+  size_t estimateBytesLocked(llvm::StringRef MainFile) const;
+  void recordBytes(llvm::StringRef MainFile, size_t Bytes);
+
+  const BackgroundIndexLimits Limits;
+  mutable std::mutex QueueMu;
   unsigned NumActiveTasks = 0; // Only idle when queue is empty *and* no tasks.
+  unsigned NumActiveLowPriorityTasks = 0;
+  size_t BytesInFlight = 0;
   std::condition_variable QueueCV;
   bool ShouldStop = false;
-  std::deque<std::pair<Task, ThreadPriority>> Queue;
+  std::deque<QueuedTask> Queue;
+  // Memory used by the last indexing run of each TU. Keys are absolute paths.
+  llvm::StringMap<size_t> BytesPerTU;
+  size_t TotalRecordedBytes = 0;
+  unsigned PauseCount = 0;
+  unsigned TimesPaused = 0;
+  std::chrono::steady_clock::time_point PausedSince;
+  std::chrono::steady_clock::duration TimePaused{0};
+  // Most recently edited files first.
+  std::vector<std::string> RecentFiles;
+  static constexpr unsigned MaxRecentFiles = 10;
+  // Extra distance for each file that was edited more recently.
+  static constexpr unsigned RecencyCost = 4;
+  // Incremented whenever RecentFiles changes.
+  unsigned RecentFilesVersion = 0;
+  // Whether some distances in Queue predate RecentFilesVersion. A worker
+  // updates them before taking a task, without holding QueueMu meanwhile, so
+  // that switching files and enqueueing stay cheap.
+  bool DistancesOutdated = false;
+  bool UpdatingDistances = false;
+  std::string BoostedFile;
+  std::chrono::steady_clock::time_point BoostedAt;
+  bool WaitingForRelatedResult = false;
+  std::chrono::steady_clock::duration TimeToRelatedResult{0};
   std::vector<std::thread> ThreadPool; // FIXME: Abstract this away.
   GlobalCompilationDatabase::CommandChanged::Subscription CommandsChanged;
 };
@@ -10,6 +10,7 @@
 #include "ClangdUnit.h"
 #include "Logger.h"
 #include "SymbolCollector.h"
+#include "Trace.h"
 #include "index/CanonicalIncludes.h"
 #include "index/Index.h"
 #include "index/MemIndex.h"
@@ -97,16 +98,34 @@ void FileSymbols::update(PathRef Path, std::unique_ptr<SymbolSlab> Symbols,
     FileToRefs[Path] = std::move(Refs);
 }
 
+void FileSymbols::share(PathRef Path, PathRef From) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  std::shared_ptr<SymbolSlab> Symbols = FileToSymbols.lookup(From);
+  std::shared_ptr<RefSlab> Refs = FileToRefs.lookup(From);
+  if (!Symbols)
+    FileToSymbols.erase(Path);
+  else
+    FileToSymbols[Path] = std::move(Symbols);
+  if (!Refs)
+    FileToRefs.erase(Path);
+  else
+    FileToRefs[Path] = std::move(Refs);
+}
+
 std::unique_ptr<SymbolIndex>
 FileSymbols::buildIndex(IndexType Type, DuplicateHandling DuplicateHandle) {
   std::vector<std::shared_ptr<SymbolSlab>> SymbolSlabs;
   std::vector<std::shared_ptr<RefSlab>> RefSlabs;
   {
     std::lock_guard<std::mutex> Lock(Mutex);
+    // Files that share a preamble share its slabs, only take them once.
+    llvm::DenseSet<const void *> Seen;
     for (const auto &FileAndSymbols : FileToSymbols)
-      SymbolSlabs.push_back(FileAndSymbols.second);
+      if (Seen.insert(FileAndSymbols.second.get()).second)
+        SymbolSlabs.push_back(FileAndSymbols.second);
     for (const auto &FileAndRefs : FileToRefs)
-      RefSlabs.push_back(FileAndRefs.second);
+      if (Seen.insert(FileAndRefs.second.get()).second)
+        RefSlabs.push_back(FileAndRefs.second);
   }
   std::vector<const Symbol *> AllSymbols;
   std::vector<Symbol> SymsStorage;
@@ -187,10 +206,39 @@ FileSymbols::buildIndex(IndexType Type, DuplicateHandling DuplicateHandle) {
   llvm_unreachable("Unknown clangd::IndexType");
 }
 
-FileIndex::FileIndex(bool UseDex)
+FileIndex::FileIndex(bool UseDex, bool AsyncRebuilds)
     : MergedIndex(&MainFileIndex, &PreambleIndex), UseDex(UseDex),
       PreambleIndex(llvm::make_unique<MemIndex>()),
-      MainFileIndex(llvm::make_unique<MemIndex>()) {}
+      MainFileIndex(llvm::make_unique<MemIndex>()) {
+  if (AsyncRebuilds)
+    RebuildTasks.emplace();
+}
+
+void FileIndex::rebuild(RebuildState &State,
+                        llvm::unique_function<void()> Build) {
+  if (!RebuildTasks)
+    return Build();
+  {
+    std::lock_guard<std::mutex> Lock(State.Mu);
+    // The scheduled rebuild hasn't read the symbols yet, it will see ours.
+    if (State.Scheduled)
+      return;
+    State.Scheduled = true;
+  }
+  auto Task = [&State](llvm::unique_function<void()> Build) {
+    std::lock_guard<std::mutex> BuildLock(State.BuildMu);
+    {
+      std::lock_guard<std::mutex> Lock(State.Mu);
+      State.Scheduled = false;
+    }
+    Build();
+  };
+  RebuildTasks->runAsync("index-rebuild", Bind(Task, std::move(Build)));
+}
+
+bool FileIndex::blockUntilIdleForTest(Deadline D) const {
+  return !RebuildTasks || RebuildTasks->wait(D);
+}
 
 void FileIndex::updatePreamble(PathRef Path, ASTContext &AST,
                                std::shared_ptr<Preprocessor> PP,
@@ -199,9 +247,22 @@ void FileIndex::updatePreamble(PathRef Path, ASTContext &AST,
   PreambleSymbols.update(Path,
                          llvm::make_unique<SymbolSlab>(std::move(Symbols)),
                          llvm::make_unique<RefSlab>());
-  PreambleIndex.reset(
-      PreambleSymbols.buildIndex(UseDex ? IndexType::Heavy : IndexType::Light,
-                                 DuplicateHandling::PickOne));
+  rebuild(PreambleRebuild, [this] {
+    trace::Span Tracer("RebuildPreambleIndex");
+    PreambleIndex.reset(
+        PreambleSymbols.buildIndex(UseDex ? IndexType::Heavy : IndexType::Light,
+                                   DuplicateHandling::PickOne));
+  });
+}
+
+void FileIndex::sharePreamble(PathRef Path, PathRef From) {
+  PreambleSymbols.share(Path, From);
+  rebuild(PreambleRebuild, [this] {
+    trace::Span Tracer("RebuildPreambleIndex");
+    PreambleIndex.reset(
+        PreambleSymbols.buildIndex(UseDex ? IndexType::Heavy : IndexType::Light,
+                                   DuplicateHandling::PickOne));
+  });
 }
 
 void FileIndex::updateMain(PathRef Path, ParsedAST &AST) {
@@ -209,8 +270,11 @@ void FileIndex::updateMain(PathRef Path, ParsedAST &AST) {
   MainFileSymbols.update(
       Path, llvm::make_unique<SymbolSlab>(std::move(Contents.first)),
       llvm::make_unique<RefSlab>(std::move(Contents.second)));
-  MainFileIndex.reset(
-      MainFileSymbols.buildIndex(IndexType::Light, DuplicateHandling::PickOne));
+  rebuild(MainFileRebuild, [this] {
+    trace::Span Tracer("RebuildMainFileIndex");
+    MainFileIndex.reset(MainFileSymbols.buildIndex(IndexType::Light,
+                                                   DuplicateHandling::PickOne));
+  });
 }
 
 } // namespace clangd
@@ -19,6 +19,7 @@
 #include "Index.h"
 #include "MemIndex.h"
 #include "Merge.h"
+#include "Threading.h"
 #include "index/CanonicalIncludes.h"
 #include "clang/Lex/Preprocessor.h"
 #include <memory>
@@ -62,6 +63,9 @@ public:
   void update(PathRef Path, std::unique_ptr<SymbolSlab> Slab,
               std::unique_ptr<RefSlab> Refs);
 
+  /// Makes \p Path refer to the current symbols and refs of \p From.
+  void share(PathRef Path, PathRef From);
+
   // The index keeps the symbols alive.
   std::unique_ptr<SymbolIndex>
   buildIndex(IndexType,
@@ -80,7 +84,10 @@ private:
 /// FIXME: Expose an interface to remove files that are closed.
 class FileIndex : public MergedIndex {
 public:
-  FileIndex(bool UseDex = true);
+  /// If \p AsyncRebuilds is true, the updates only collect the symbols of the
+  /// files, and the indexes are rebuilt from them on separate threads. Queries
+  /// see the new symbols once the rebuilds finish.
+  FileIndex(bool UseDex = true, bool AsyncRebuilds = false);
 
   /// Update preamble symbols of file \p Path with all declarations in \p AST
   /// and macros in \p PP.
@@ -88,11 +95,29 @@ public:
                       std::shared_ptr<Preprocessor> PP,
                       const CanonicalIncludes &Includes);
 
+  /// Update preamble symbols of file \p Path with those of \p From, whose
+  /// preamble it uses.
+  void sharePreamble(PathRef Path, PathRef From);
+
   /// Update symbols and references from main file \p Path with
   /// `indexMainDecls`.
   void updateMain(PathRef Path, ParsedAST &AST);
 
+  /// Waits until the pending index rebuilds finish. Only for use in tests.
+  LLVM_NODISCARD bool blockUntilIdleForTest(Deadline D) const;
+
 private:
+  /// Coalesces the rebuilds of an index requested while one is pending.
+  struct RebuildState {
+    std::mutex Mu;
+    bool Scheduled = false; /* GUARDED_BY(Mu) */
+    /// Held while rebuilding, so that the last rebuild to finish is the last
+    /// one to have started and has seen all the updates.
+    std::mutex BuildMu;
+  };
+  /// Runs \p Build now, or on a separate thread if rebuilds are asynchronous.
+  void rebuild(RebuildState &State, llvm::unique_function<void()> Build);
+
   bool UseDex; // FIXME: this should be always on.
 
   // Contains information from each file's preamble only.
@@ -117,6 +142,12 @@ private:
   // (Note that symbols *only* in the main file are not indexed).
   FileSymbols MainFileSymbols;
   SwapIndex MainFileIndex;
+
+  RebuildState PreambleRebuild;
+  RebuildState MainFileRebuild;
+  // None when rebuilding synchronously. Declared last, so that the destructor
+  // waits for the rebuilds before the symbols are destroyed.
+  llvm::Optional<AsyncTaskRunner> RebuildTasks;
 };
 
 /// Retrieves symbols and refs of local top level decls in \p AST (i.e.
@@ -43,8 +43,9 @@ const Token RestrictedForCodeCompletion =
 // trigrams and scopes.
 // FIXME(kbobyrev): Support more token types:
 // * Namespace proximity
-std::vector<Token> generateSearchTokens(const Symbol &Sym) {
-  std::vector<Token> Result = generateIdentifierTrigrams(Sym.Name);
+std::vector<Token> generateSearchTokens(const Symbol &Sym,
+                                        const SegmentedWord &Name) {
+  std::vector<Token> Result = generateIdentifierTrigrams(Name);
   Result.emplace_back(Token::Kind::Scope, Sym.Scope);
   // Skip token generation for symbols with unknown declaration location.
   if (!llvm::StringRef(Sym.CanonicalDeclaration.FileURI).empty())
@@ -80,13 +81,14 @@ void Dex::buildIndex() {
   for (size_t I = 0; I < ScoredSymbols.size(); ++I) {
     SymbolQuality[I] = ScoredSymbols[I].first;
     Symbols[I] = ScoredSymbols[I].second;
+    Names.push_back(Symbols[I]->Name);
   }
 
   // Populate TempInvertedIndex with lists for index symbols.
   llvm::DenseMap<Token, std::vector<DocID>> TempInvertedIndex;
   for (DocID SymbolRank = 0; SymbolRank < Symbols.size(); ++SymbolRank) {
     const auto *Sym = Symbols[SymbolRank];
-    for (const auto &Token : generateSearchTokens(*Sym))
+    for (const auto &Token : generateSearchTokens(*Sym, Names[SymbolRank]))
       TempInvertedIndex[Token].push_back(SymbolRank);
   }
 
@@ -120,9 +122,10 @@ std::unique_ptr<Iterator> Dex::createFileProximityIterator(
   // for all parameters except for Proximity Path distance signal.
   SymbolRelevanceSignals PathProximitySignals;
   // DistanceCalculator will find the shortest distance from ProximityPaths to
-  // any URI extracted from the ProximityPaths.
-  URIDistance DistanceCalculator(Sources);
-  PathProximitySignals.FileProximityMatch = &DistanceCalculator;
+  // any URI extracted from the ProximityPaths. Successive requests usually
+  // have the same ProximityPaths, so they share it.
+  auto DistanceCalculator = ProximityDistances.get(std::move(Sources));
+  PathProximitySignals.FileProximityMatch = DistanceCalculator.get();
   // Try to build BOOST iterator for each Proximity Path provided by
   // ProximityPaths. Boosting factor should depend on the distance to the
   // Proximity Path: the closer processed path is, the higher boosting factor.
@@ -214,8 +217,7 @@ bool Dex::fuzzyFind(const FuzzyFindRequest &Req,
       Req.Limit ? *Req.Limit : std::numeric_limits<size_t>::max(), Compare);
   for (const auto &IDAndScore : IDAndScores) {
     const DocID SymbolDocID = IDAndScore.first;
-    const auto *Sym = Symbols[SymbolDocID];
-    const llvm::Optional<float> Score = Filter.match(Sym->Name);
+    const llvm::Optional<float> Score = Filter.match(Names[SymbolDocID]);
     if (!Score)
       continue;
     // Combine Fuzzy Matching score, precomputed symbol quality and boosting
@@ -262,6 +264,7 @@ void Dex::refs(const RefsRequest &Req,
 size_t Dex::estimateMemoryUsage() const {
   size_t Bytes = Symbols.size() * sizeof(const Symbol *);
   Bytes += SymbolQuality.size() * sizeof(float);
+  Bytes += Names.bytes();
   Bytes += LookupTable.getMemorySize();
   Bytes += InvertedIndex.getMemorySize();
   for (const auto &TokenToPostingList : InvertedIndex)
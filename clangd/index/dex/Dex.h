@@ -20,6 +20,8 @@
 #ifndef LLVM_CLANG_TOOLS_EXTRA_CLANGD_INDEX_DEX_DEX_H
 #define LLVM_CLANG_TOOLS_EXTRA_CLANGD_INDEX_DEX_DEX_H
 
+#include "FileDistance.h"
+#include "FuzzyMatch.h"
 #include "Iterator.h"
 #include "PostingList.h"
 #include "Token.h"
@@ -86,6 +88,8 @@ private:
   std::vector<const Symbol *> Symbols;
   /// SymbolQuality[I] is the quality of Symbols[I].
   std::vector<float> SymbolQuality;
+  /// Names[I] is the name of Symbols[I], segmented once for fuzzy matching.
+  SegmentedWords Names;
   llvm::DenseMap<SymbolID, const Symbol *> LookupTable;
   /// Inverted index is a mapping from the search token to the posting list,
   /// which contains all items which can be characterized by such search token.
@@ -96,6 +100,8 @@ private:
   llvm::DenseMap<Token, PostingList> InvertedIndex;
   dex::Corpus Corpus;
   llvm::DenseMap<SymbolID, llvm::ArrayRef<Ref>> Refs;
+  /// File proximity scorers for the recent ProximityPaths of requests.
+  mutable URIDistanceCache ProximityDistances{/*MaxSize=*/4};
   std::shared_ptr<void> KeepAlive; // poor man's move-only std::any
   // Size of memory retained by KeepAlive.
   size_t BackingDataSize = 0;
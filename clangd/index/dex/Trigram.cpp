@@ -22,11 +22,15 @@ namespace dex {
 
 std::vector<Token> generateIdentifierTrigrams(llvm::StringRef Identifier) {
   // Apply fuzzy matching text segmentation.
-  std::vector<CharRole> Roles(Identifier.size());
-  calculateRoles(Identifier,
-                 llvm::makeMutableArrayRef(Roles.data(), Identifier.size()));
+  SegmentedWords Segmented;
+  Segmented.push_back(Identifier);
+  return generateIdentifierTrigrams(Segmented[0]);
+}
 
-  std::string LowercaseIdentifier = Identifier.lower();
+std::vector<Token> generateIdentifierTrigrams(const SegmentedWord &Identifier) {
+  const CharRole *Roles = Identifier.Roles;
+  llvm::StringRef LowercaseIdentifier(Identifier.LowWord,
+                                      Identifier.Word.size());
 
   // For each character, store indices of the characters to which fuzzy matching
   // algorithm can jump. There are 3 possible variants:
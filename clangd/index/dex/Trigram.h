@@ -23,6 +23,7 @@
 #ifndef LLVM_CLANG_TOOLS_EXTRA_CLANGD_DEX_TRIGRAM_H
 #define LLVM_CLANG_TOOLS_EXTRA_CLANGD_DEX_TRIGRAM_H
 
+#include "FuzzyMatch.h"
 #include "Token.h"
 
 #include <string>
@@ -48,6 +49,8 @@ namespace dex {
 /// Trigrams are lowercase, as trigram matching is case-insensitive.
 /// Trigrams in the returned list are deduplicated.
 std::vector<Token> generateIdentifierTrigrams(llvm::StringRef Identifier);
+/// Like above, for an identifier that was already segmented.
+std::vector<Token> generateIdentifierTrigrams(const SegmentedWord &Identifier);
 
 /// Returns list of unique fuzzy-search trigrams given a query.
 ///
@@ -109,6 +109,36 @@ static llvm::cl::opt<PCHStorageFlag> PCHStorage(
         clEnumValN(PCHStorageFlag::Memory, "memory", "store PCHs in memory")),
     llvm::cl::init(PCHStorageFlag::Disk));
 
+static llvm::cl::opt<unsigned> RetainedPreamblesMB(
+    "retained-preambles-mb",
+    llvm::cl::desc("Size in MB of the recently used preambles kept after "
+                   "their files are closed, to make reopening them faster"),
+    llvm::cl::init(256), llvm::cl::Hidden);
+
+static llvm::cl::opt<unsigned> RetainedASTsMB(
+    "retained-asts-mb",
+    llvm::cl::desc("Total size in MB of the ASTs of idle files kept in memory, "
+                   "on top of the limit on their number. 0 means no limit"),
+    llvm::cl::init(1024), llvm::cl::Hidden);
+
+static llvm::cl::opt<unsigned> MaxMemoryMB(
+    "max-memory-mb",
+    llvm::cl::desc("Drop the ASTs of idle files while the heap is larger than "
+                   "this, in MB. 0 means no limit"),
+    llvm::cl::init(0), llvm::cl::Hidden);
+
+static llvm::cl::opt<unsigned> FileStatusCacheMS(
+    "file-status-cache-ms",
+    llvm::cl::desc("How long in ms the status of a file on disk is reused by "
+                   "all requests before checking it again. 0 disables this"),
+    llvm::cl::init(1000), llvm::cl::Hidden);
+
+static llvm::cl::opt<unsigned> FileCacheMB(
+    "file-cache-mb",
+    llvm::cl::desc("Total size in MB of the statuses and contents of the "
+                   "files on disk that are kept in memory"),
+    llvm::cl::init(128), llvm::cl::Hidden);
+
 static llvm::cl::opt<int> LimitResults(
     "limit-results",
     llvm::cl::desc("Limit the number of results returned by clangd. "
@@ -148,6 +178,13 @@ static llvm::cl::opt<bool> AllScopesCompletion(
         "can insert scope qualifiers."),
     llvm::cl::init(true));
 
+static llvm::cl::opt<bool> DeferCompletionDocs(
+    "defer-completion-docs",
+    llvm::cl::desc("Send the documentation of index completion results only "
+                   "when the client resolves the completion item. Needs a "
+                   "client that sends completionItem/resolve requests."),
+    llvm::cl::init(CodeCompleteOptions().DeferIndexComments), llvm::cl::Hidden);
+
 static llvm::cl::opt<bool> ShowOrigins(
     "debug-origin", llvm::cl::desc("Show origins of completion items"),
     llvm::cl::init(CodeCompleteOptions().ShowOrigins), llvm::cl::Hidden);
@@ -213,6 +250,13 @@ static llvm::cl::opt<bool> EnableClangTidy(
     llvm::cl::desc("Enable clang-tidy diagnostics."),
     llvm::cl::init(false));
 
+static llvm::cl::opt<unsigned> SkipUnchangedBodiesKB(
+    "skip-unchanged-bodies-kb",
+    llvm::cl::desc("Reparse files of at least this size in KB without the "
+                   "function bodies that were not edited first, then parse "
+                   "them in full. 0 disables this"),
+    llvm::cl::init(0), llvm::cl::Hidden);
+
 static llvm::cl::opt<bool> SuggestMissingIncludes(
     "suggest-missing-includes",
     llvm::cl::desc("Attempts to fix diagnostic errors caused by missing "
@@ -391,6 +435,14 @@ int main(int argc, char *argv[]) {
     Opts.StorePreamblesInMemory = false;
     break;
   }
+  Opts.RetentionPolicy.MaxRetainedPreambleBytes =
+      static_cast<std::size_t>(RetainedPreamblesMB) * 1024 * 1024;
+  // The default count limit stays in place, the size limit only evicts large
+  // ASTs earlier.
+  Opts.RetentionPolicy.MaxRetainedASTBytes =
+      static_cast<std::size_t>(RetainedASTsMB) * 1024 * 1024;
+  Opts.RetentionPolicy.MaxProcessMemoryBytes =
+      static_cast<std::size_t>(MaxMemoryMB) * 1024 * 1024;
   if (!ResourceDir.empty())
     Opts.ResourceDir = ResourceDir;
   Opts.BuildDynamicSymbolIndex = EnableIndex;
@@ -418,15 +470,19 @@ int main(int argc, char *argv[]) {
   CCOpts.Limit = LimitResults;
   CCOpts.BundleOverloads = CompletionStyle != Detailed;
   CCOpts.ShowOrigins = ShowOrigins;
+  CCOpts.DeferIndexComments = DeferCompletionDocs;
   if (!HeaderInsertionDecorators) {
     CCOpts.IncludeIndicator.Insert.clear();
     CCOpts.IncludeIndicator.NoInsert.clear();
   }
   CCOpts.SpeculativeIndexRequest = Opts.StaticIndex;
+  CCOpts.ReuseCandidates = true;
   CCOpts.EnableFunctionArgSnippets = EnableFunctionArgSnippets;
   CCOpts.AllScopes = AllScopesCompletion;
 
-  RealFileSystemProvider FSProvider;
+  RealFileSystemProvider FSProvider(
+      std::chrono::milliseconds(FileStatusCacheMS),
+      static_cast<std::size_t>(FileCacheMB) * 1024 * 1024);
   // Initialize and run ClangdLSPServer.
   // Change stdin to binary to not lose \r\n on windows.
   llvm::sys::ChangeStdinToBinary();
@@ -458,6 +514,8 @@ int main(int argc, char *argv[]) {
   }
   Opts.ClangTidyOptProvider = ClangTidyOptProvider.get();
   Opts.SuggestMissingIncludes = SuggestMissingIncludes;
+  Opts.SkipUnchangedBodiesMinSize =
+      static_cast<std::size_t>(SkipUnchangedBodiesKB) * 1024;
   ClangdLSPServer LSPServer(
       *TransportLayer, FSProvider, CCOpts, CompileCommandsDirPath,
       /*UseDirBasedCDB=*/CompileArgsFrom == FilesystemCompileArgs, Opts);
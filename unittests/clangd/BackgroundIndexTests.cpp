@@ -64,6 +64,48 @@ public:
   }
 };
 
+// Records how many TUs store their shards at the same time. Storing is slowed
+// down, so that TUs that are indexed concurrently overlap.
+class ConcurrencyRecordingStorage : public MemoryShardStorage {
+public:
+  using MemoryShardStorage::MemoryShardStorage;
+  llvm::Error storeShard(llvm::StringRef ShardIdentifier,
+                         IndexFileOut Shard) const override {
+    {
+      std::lock_guard<std::mutex> Lock(Mu);
+      MaxInFlight = std::max(MaxInFlight, ++InFlight);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    {
+      std::lock_guard<std::mutex> Lock(Mu);
+      --InFlight;
+    }
+    return MemoryShardStorage::storeShard(ShardIdentifier, Shard);
+  }
+
+  unsigned maxInFlight() const {
+    std::lock_guard<std::mutex> Lock(Mu);
+    return MaxInFlight;
+  }
+  void resetMaxInFlight() {
+    std::lock_guard<std::mutex> Lock(Mu);
+    MaxInFlight = 0;
+  }
+
+private:
+  mutable std::mutex Mu;
+  mutable unsigned InFlight = 0;
+  mutable unsigned MaxInFlight = 0;
+};
+
+tooling::CompileCommand compileCommand(llvm::StringRef File) {
+  tooling::CompileCommand Cmd;
+  Cmd.Filename = testPath(File);
+  Cmd.Directory = testPath("root");
+  Cmd.CommandLine = {"clang++", testPath(File)};
+  return Cmd;
+}
+
 class BackgroundIndexTest : public ::testing::Test {
 protected:
   BackgroundIndexTest() { preventThreadStarvationInTests(); }
@@ -428,5 +470,243 @@ TEST_F(BackgroundIndexTest, ShardStorageEmptyFile) {
               Contains(AllOf(Named("new_func"), Declared(), Not(Defined()))));
 }
 
+TEST_F(BackgroundIndexTest, HeaderOnlyReindexing) {
+  MockFSProvider FS;
+  FS.Files[testPath("root/A.h")] = "void a_h();";
+  FS.Files[testPath("root/B.h")] = "void b_h();";
+  FS.Files[testPath("root/A.cc")] = "#include \"A.h\"\nvoid a_cc();";
+  FS.Files[testPath("root/B.cc")] =
+      "#include \"A.h\"\n#include \"B.h\"\nvoid b_cc();";
+
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  MemoryShardStorage MSS(Storage, CacheHits);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  for (const char *File : {"root/A.cc", "root/B.cc"}) {
+    tooling::CompileCommand Cmd;
+    Cmd.Filename = testPath(File);
+    Cmd.Directory = testPath("root");
+    Cmd.CommandLine = {"clang++", testPath(File)};
+    CDB.setCompileCommand(testPath(File), Cmd);
+  }
+  std::vector<std::string> TUs = {testPath("root/A.cc"),
+                                  testPath("root/B.cc")};
+  {
+    BackgroundIndex Idx(Context::empty(), FS, CDB,
+                        [&](llvm::StringRef) { return &MSS; });
+    Idx.enqueue(TUs);
+    ASSERT_TRUE(Idx.blockUntilIdleForTest());
+  }
+  std::string ACCShard = Storage[testPath("root/A.cc")];
+  std::string BCCShard = Storage[testPath("root/B.cc")];
+  std::string BHShard = Storage[testPath("root/B.h")];
+
+  // Only the header changed: it is refreshed through a single TU, the shards
+  // of the other files are left untouched.
+  FS.Files[testPath("root/A.h")] = "void a_h_changed();";
+  {
+    BackgroundIndex Idx(Context::empty(), FS, CDB,
+                        [&](llvm::StringRef) { return &MSS; });
+    Idx.enqueue(TUs);
+    ASSERT_TRUE(Idx.blockUntilIdleForTest());
+    EXPECT_THAT(runFuzzyFind(Idx, ""),
+                UnorderedElementsAre(Named("a_h_changed"), Named("b_h"),
+                                     Named("a_cc"), Named("b_cc")));
+  }
+  EXPECT_EQ(Storage[testPath("root/A.cc")], ACCShard);
+  EXPECT_EQ(Storage[testPath("root/B.cc")], BCCShard);
+  EXPECT_EQ(Storage[testPath("root/B.h")], BHShard);
+  auto ShardHeader = MSS.loadShard(testPath("root/A.h"));
+  ASSERT_NE(ShardHeader, nullptr);
+  EXPECT_THAT(*ShardHeader->Symbols,
+              UnorderedElementsAre(Named("a_h_changed")));
+}
+
+TEST_F(BackgroundIndexTest, HeaderOnlyReindexingIndexesNewIncludes) {
+  MockFSProvider FS;
+  FS.Files[testPath("root/A.h")] = "void a_h();";
+  FS.Files[testPath("root/A.cc")] = "#include \"A.h\"\nvoid a_cc();";
+
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  MemoryShardStorage MSS(Storage, CacheHits);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  CDB.setCompileCommand(testPath("root/A.cc"), compileCommand("root/A.cc"));
+  {
+    BackgroundIndex Idx(Context::empty(), FS, CDB,
+                        [&](llvm::StringRef) { return &MSS; });
+    Idx.enqueue({testPath("root/A.cc")});
+    ASSERT_TRUE(Idx.blockUntilIdleForTest());
+  }
+  std::string ACCShard = Storage[testPath("root/A.cc")];
+
+  // The stale header now includes a header that was never indexed.
+  FS.Files[testPath("root/A.h")] = "#include \"C.h\"\nvoid a_h_changed();";
+  FS.Files[testPath("root/C.h")] = "void c_h();";
+  {
+    BackgroundIndex Idx(Context::empty(), FS, CDB,
+                        [&](llvm::StringRef) { return &MSS; });
+    Idx.enqueue({testPath("root/A.cc")});
+    ASSERT_TRUE(Idx.blockUntilIdleForTest());
+    EXPECT_THAT(runFuzzyFind(Idx, ""),
+                UnorderedElementsAre(Named("a_h_changed"), Named("c_h"),
+                                     Named("a_cc")));
+  }
+  EXPECT_EQ(Storage[testPath("root/A.cc")], ACCShard);
+  auto ShardHeader = MSS.loadShard(testPath("root/C.h"));
+  ASSERT_NE(ShardHeader, nullptr);
+  EXPECT_THAT(*ShardHeader->Symbols, UnorderedElementsAre(Named("c_h")));
+}
+
+TEST_F(BackgroundIndexTest, PauseHoldsBackIndexing) {
+  MockFSProvider FS;
+  FS.Files[testPath("root/A.cc")] = "void foo();";
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  MemoryShardStorage MSS(Storage, CacheHits);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  BackgroundIndex Idx(Context::empty(), FS, CDB,
+                      [&](llvm::StringRef) { return &MSS; });
+
+  tooling::CompileCommand Cmd;
+  Cmd.Filename = testPath("root/A.cc");
+  Cmd.Directory = testPath("root");
+  Cmd.CommandLine = {"clang++", testPath("root/A.cc")};
+
+  Idx.pause();
+  CDB.setCompileCommand(testPath("root/A.cc"), Cmd);
+  // Shards are still loaded, but the TU is not indexed while paused.
+  EXPECT_FALSE(Idx.blockUntilIdleForTest(/*TimeoutSeconds=*/0.5));
+  EXPECT_TRUE(Idx.stats().Paused);
+  EXPECT_EQ(Idx.stats().QueueDepth, 1U);
+  EXPECT_THAT(runFuzzyFind(Idx, "foo"), ElementsAre());
+
+  Idx.resume();
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+  EXPECT_THAT(runFuzzyFind(Idx, "foo"), ElementsAre(Named("foo")));
+  EXPECT_FALSE(Idx.stats().Paused);
+  EXPECT_EQ(Idx.stats().TimesPaused, 1U);
+  EXPECT_EQ(Idx.stats().QueueDepth, 0U);
+}
+
+TEST_F(BackgroundIndexTest, LimitsConcurrentTUs) {
+  MockFSProvider FS;
+  std::vector<std::string> Files = {"root/A.cc", "root/B.cc", "root/C.cc"};
+  for (const auto &File : Files)
+    FS.Files[testPath(File)] = "void " + File.substr(5, 1) + "();";
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  ConcurrencyRecordingStorage MSS(Storage, CacheHits);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  BackgroundIndexLimits Limits;
+  Limits.MaxConcurrentTUs = 1;
+  Limits.CPUShare = 0.5;
+  BackgroundIndex Idx(
+      Context::empty(), FS, CDB, [&](llvm::StringRef) { return &MSS; },
+      /*BuildIndexPeriodMs=*/0, /*ThreadPoolSize=*/3, Limits);
+  for (const auto &File : Files)
+    CDB.setCompileCommand(testPath(File), compileCommand(File));
+
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+  EXPECT_THAT(runFuzzyFind(Idx, ""),
+              UnorderedElementsAre(Named("A"), Named("B"), Named("C")));
+  EXPECT_EQ(MSS.maxInFlight(), 1U);
+}
+
+TEST_F(BackgroundIndexTest, LimitsMemoryOfConcurrentTUs) {
+  MockFSProvider FS;
+  std::vector<std::string> Files = {"root/A.cc", "root/B.cc", "root/C.cc"};
+  for (const auto &File : Files)
+    FS.Files[testPath(File)] = "void " + File.substr(5, 1) + "();";
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  ConcurrencyRecordingStorage MSS(Storage, CacheHits);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  BackgroundIndexLimits Limits;
+  Limits.MaxMemoryBytes = 1; // Only a single TU fits at a time.
+  BackgroundIndex Idx(
+      Context::empty(), FS, CDB, [&](llvm::StringRef) { return &MSS; },
+      /*BuildIndexPeriodMs=*/0, /*ThreadPoolSize=*/3, Limits);
+  for (const auto &File : Files)
+    CDB.setCompileCommand(testPath(File), compileCommand(File));
+  // The memory needed by a TU is only known once it was indexed.
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+
+  MSS.resetMaxInFlight();
+  for (const auto &File : Files)
+    FS.Files[testPath(File)] = "void " + File.substr(5, 1) + "_changed();";
+  Idx.enqueue({testPath("root/A.cc"), testPath("root/B.cc"),
+               testPath("root/C.cc")});
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+  EXPECT_THAT(runFuzzyFind(Idx, "changed"),
+              UnorderedElementsAre(Named("A_changed"), Named("B_changed"),
+                                   Named("C_changed")));
+  EXPECT_EQ(MSS.maxInFlight(), 1U);
+}
+
+TEST_F(BackgroundIndexTest, BoostRelatedIndexesCloseTUsFirst) {
+  MockFSProvider FS;
+  // The includer is in another directory than the edited header, so it is
+  // only close to it through its include.
+  FS.Files[testPath("root/h/H.h")] = "void h();";
+  FS.Files[testPath("root/a/A.cc")] = "void a();";
+  FS.Files[testPath("root/b/B.cc")] = "#include \"../h/H.h\"\nvoid b();";
+
+  std::vector<std::string> StoreOrder;
+  std::mutex StoreOrderMu;
+  class RecordingShardStorage : public MemoryShardStorage {
+  public:
+    RecordingShardStorage(llvm::StringMap<std::string> &Storage,
+                          size_t &CacheHits,
+                          std::vector<std::string> &StoreOrder,
+                          std::mutex &StoreOrderMu)
+        : MemoryShardStorage(Storage, CacheHits), StoreOrder(StoreOrder),
+          StoreOrderMu(StoreOrderMu) {}
+    llvm::Error storeShard(llvm::StringRef ShardIdentifier,
+                           IndexFileOut Shard) const override {
+      {
+        std::lock_guard<std::mutex> Lock(StoreOrderMu);
+        StoreOrder.push_back(ShardIdentifier);
+      }
+      return MemoryShardStorage::storeShard(ShardIdentifier, Shard);
+    }
+
+  private:
+    std::vector<std::string> &StoreOrder;
+    std::mutex &StoreOrderMu;
+  };
+  llvm::StringMap<std::string> Storage;
+  size_t CacheHits = 0;
+  RecordingShardStorage MSS(Storage, CacheHits, StoreOrder, StoreOrderMu);
+  OverlayCDB CDB(/*Base=*/nullptr);
+  for (const char *File : {"root/a/A.cc", "root/b/B.cc"})
+    CDB.setCompileCommand(testPath(File), compileCommand(File));
+  BackgroundIndex Idx(
+      Context::empty(), FS, CDB, [&](llvm::StringRef) { return &MSS; },
+      /*BuildIndexPeriodMs=*/0, /*ThreadPoolSize=*/1);
+  std::vector<std::string> TUs = {testPath("root/a/A.cc"),
+                                  testPath("root/b/B.cc")};
+  // Index once, so that the shards of the TUs record their includes.
+  Idx.enqueue(TUs);
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+
+  FS.Files[testPath("root/a/A.cc")] = "void a_changed();";
+  FS.Files[testPath("root/b/B.cc")] =
+      "#include \"../h/H.h\"\nvoid b_changed();";
+  StoreOrder.clear();
+  Idx.pause();
+  Idx.enqueue(TUs);
+  EXPECT_FALSE(Idx.blockUntilIdleForTest(/*TimeoutSeconds=*/0.5));
+  // B.cc includes the edited header, so it is indexed first.
+  Idx.boostRelated(testPath("root/h/H.h"));
+  Idx.resume();
+  ASSERT_TRUE(Idx.blockUntilIdleForTest());
+
+  // The shard of the unchanged header isn't written again.
+  EXPECT_THAT(StoreOrder,
+              ElementsAre(testPath("root/b/B.cc"), testPath("root/a/A.cc")));
+  EXPECT_GT(Idx.stats().TimeToRelatedResult.count(), 0);
+}
+
 } // namespace clangd
 } // namespace clang
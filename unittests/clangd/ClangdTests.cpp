@@ -971,6 +971,31 @@ TEST_F(ClangdVFSTest, ChangedHeaderFromISystem) {
 #ifndef _WIN32
 // Check that running code completion doesn't stat() a bunch of files from the
 // preamble again. (They should be using the preamble's stat-cache)
+TEST(ClangdTests, SyncModeDoesNotStallBackgroundIndex) {
+  MockFSProvider FS;
+  ErrorCheckingDiagConsumer DiagConsumer;
+  OverlayCDB CDB(/*Base=*/nullptr);
+  auto Opts = ClangdServer::optsForTest();
+  Opts.AsyncThreadsCount = 0;
+  Opts.BackgroundIndex = true;
+  ClangdServer Server(CDB, FS, DiagConsumer, Opts);
+
+  // The background index is paused while the open file is busy.
+  auto Foo = testPath("foo.cpp");
+  FS.Files[Foo] = "int foo;";
+  Server.addDocument(Foo, FS.Files[Foo]);
+
+  // Once the file is idle again, other TUs get indexed.
+  auto Bar = testPath("bar.cpp");
+  FS.Files[Bar] = "int bar;";
+  tooling::CompileCommand Cmd;
+  Cmd.Filename = Bar;
+  Cmd.Directory = testRoot();
+  Cmd.CommandLine = {"clang++", "-fsyntax-only", Bar};
+  CDB.setCompileCommand(Bar, Cmd);
+  EXPECT_TRUE(Server.blockUntilIdleForTest());
+}
+
 TEST(ClangdTests, PreambleVFSStatCache) {
   class ListenStatsFSProvider : public FileSystemProvider {
   public:
@@ -7,9 +7,12 @@
 //===----------------------------------------------------------------------===//
 
 #include "Annotations.h"
+#include "Cancellation.h"
 #include "ClangdUnit.h"
 #include "SourceCode.h"
+#include "TestFS.h"
 #include "TestTU.h"
+#include "clang/Frontend/PCHContainerOperations.h"
 #include "llvm/Support/ScopedPrinter.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -81,6 +84,102 @@ TEST(ClangdUnitTest, TopLevelDecls) {
   EXPECT_THAT(AST.getLocalTopLevelDecls(), ElementsAre(DeclNamed("main")));
 }
 
+TEST(ClangdUnitTest, SkippedFunctionBodies) {
+  Annotations Code(R"cpp(
+    int skipped() { return "error"; }
+    int edited() { $edit[[return "error";]] }
+    struct S {
+      void skippedMethod() { int X = "error"; }
+      S() : X("error") {}
+      int X;
+    };
+    constexpr int Constexpr() { return 0; }
+    auto Deduced() { return 0; }
+    int Call = Deduced() + Constexpr();
+  )cpp");
+  TestTU TU = TestTU::withCode(Code.code());
+  TU.ExtraArgs.push_back("-std=c++14");
+  auto Full = TU.build();
+  EXPECT_THAT(Full.getSkippedFunctionBodies(), testing::IsEmpty());
+  ASSERT_EQ(Full.getDiagnostics().size(), 4u);
+
+  Range Edit = Code.range("edit");
+  TU.ParseBodiesIn =
+      std::make_pair(cantFail(positionToOffset(Code.code(), Edit.start)),
+                     cantFail(positionToOffset(Code.code(), Edit.end)));
+  auto Partial = TU.build();
+  // Constructors with initializers and the functions that can't be skipped
+  // are parsed.
+  EXPECT_EQ(Partial.getSkippedFunctionBodies().size(), 2u);
+  // Compare against the full parse: the missing diagnostics are exactly the
+  // ones in the skipped bodies.
+  for (const Diag &D : Full.getDiagnostics()) {
+    bool InSkippedBody = llvm::any_of(
+        Partial.getSkippedFunctionBodies(),
+        [&](const Range &Body) { return Body.contains(D.Range); });
+    bool Reported = llvm::any_of(Partial.getDiagnostics(), [&](const Diag &P) {
+      return P.Range == D.Range && P.Message == D.Message;
+    });
+    EXPECT_NE(InSkippedBody, Reported) << D;
+  }
+}
+
+TEST(ClangdUnitTest, CancelledBuild) {
+  ParseInputs Inputs;
+  Inputs.CompileCommand.Filename = testPath("foo.cpp");
+  Inputs.CompileCommand.Directory = testRoot();
+  Inputs.CompileCommand.CommandLine = {"clang", testPath("foo.cpp")};
+  Inputs.Contents = "int a; int b;";
+  Inputs.FS = buildTestFS({{testPath("foo.cpp"), Inputs.Contents}});
+  auto CI = buildCompilerInvocation(Inputs);
+  ASSERT_TRUE(CI);
+
+  auto Task = cancelableTask();
+  WithContext Cancelable(std::move(Task.first));
+  Task.second();
+  EXPECT_FALSE(buildAST(testPath("foo.cpp"), std::move(CI), Inputs,
+                        /*Preamble=*/nullptr,
+                        std::make_shared<PCHContainerOperations>()));
+}
+
+TEST(ClangdUnitTest, PatchedPreamble) {
+  std::string MainFile = testPath("foo.cpp");
+  ParseInputs Inputs;
+  Inputs.CompileCommand.Filename = MainFile;
+  Inputs.CompileCommand.Directory = testRoot();
+  Inputs.CompileCommand.CommandLine = {"clang", MainFile};
+  Inputs.FS = buildTestFS({{testPath("a.h"), "int a;"},
+                           {testPath("b.h"), "int b;"}});
+  Inputs.Contents = "#include \"a.h\"\nint x = a;\n";
+  auto PCHs = std::make_shared<PCHContainerOperations>();
+  auto CI = buildCompilerInvocation(Inputs);
+  ASSERT_TRUE(CI);
+  auto Preamble =
+      buildPreamble(MainFile, *CI, /*OldPreamble=*/nullptr,
+                    Inputs.CompileCommand, Inputs, PCHs,
+                    /*StoreInMemory=*/true, /*PreambleCallback=*/nullptr);
+  ASSERT_TRUE(Preamble);
+
+  Inputs.Contents = "#include \"a.h\"\n#include \"b.h\"\nint x = a + b;\n";
+  CI = buildCompilerInvocation(Inputs);
+  ASSERT_TRUE(CI);
+  EXPECT_FALSE(isPreambleCompatible(*Preamble, Inputs, *CI));
+  ASSERT_TRUE(canPatchPreamble(*Preamble, Inputs, *CI));
+  auto AST = buildAST(MainFile, std::move(CI), Inputs, Preamble, PCHs);
+  ASSERT_TRUE(AST);
+  EXPECT_THAT(AST->getDiagnostics(), testing::IsEmpty());
+  std::vector<std::string> Includes;
+  for (const auto &Inc : AST->getIncludeStructure().MainFileIncludes)
+    Includes.push_back(Inc.Written);
+  EXPECT_THAT(Includes, ElementsAre("\"a.h\"", "\"b.h\""));
+
+  // Removed includes would still be visible through the preamble.
+  Inputs.Contents = "int x = a;\n";
+  CI = buildCompilerInvocation(Inputs);
+  ASSERT_TRUE(CI);
+  EXPECT_FALSE(canPatchPreamble(*Preamble, Inputs, *CI));
+}
+
 } // namespace
 } // namespace clangd
 } // namespace clang
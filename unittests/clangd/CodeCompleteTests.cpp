@@ -17,8 +17,11 @@
 #include "SyncAPI.h"
 #include "TestFS.h"
 #include "TestIndex.h"
+#include "Trace.h"
 #include "index/MemIndex.h"
+#include "index/dex/Dex.h"
 #include "clang/Sema/CodeCompleteConsumer.h"
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Testing/Support/Error.h"
 #include "gmock/gmock.h"
@@ -736,6 +739,38 @@ TEST(CompletionTest, Documentation) {
               Contains(AllOf(Named("baz"), Doc("Multi-line\nblock comment"))));
 }
 
+TEST(CompletionTest, DeferIndexComments) {
+  MockFSProvider FS;
+  MockCompilationDatabase CDB;
+  IgnoreDiagnostics DiagConsumer;
+  auto Opts = ClangdServer::optsForTest();
+  Opts.BuildDynamicSymbolIndex = true;
+  ClangdServer Server(CDB, FS, DiagConsumer, Opts);
+
+  auto File = testPath("foo.cpp");
+  Annotations Test(R"cpp(
+      /// Doc of fooooo.
+      void fooooo();
+      void f() { foooo^ }
+  )cpp");
+  runAddDocument(Server, File, Test.code());
+
+  clangd::CodeCompleteOptions CCOpts;
+  CCOpts.DeferIndexComments = true;
+  auto Results = cantFail(runCodeComplete(Server, File, Test.point(), CCOpts));
+  ASSERT_THAT(Results.Completions, ElementsAre(Named("fooooo")));
+  const CodeCompletion &C = Results.Completions.front();
+  EXPECT_EQ(C.Documentation, "");
+  ASSERT_TRUE(C.DeferredDocumentation);
+
+  CompletionItem Item = C.render(CCOpts);
+  EXPECT_EQ(Item.data, C.DeferredDocumentation);
+  CompletionItem Resolved =
+      cantFail(runResolveCompletion(Server, std::move(Item)));
+  EXPECT_EQ(Resolved.filterText, "fooooo");
+  EXPECT_EQ(Resolved.documentation, "Doc of fooooo.");
+}
+
 TEST(CompletionTest, GlobalCompletionFiltering) {
 
   Symbol Class = cls("XYZ");
@@ -1655,6 +1690,175 @@ TEST(CompletionTest, CompletionTokenRange) {
   }
 }
 
+// Delays the fuzzyFind results of another index.
+class SlowIndex : public SymbolIndex {
+public:
+  SlowIndex(const SymbolIndex &Base, std::chrono::milliseconds Delay)
+      : Base(Base), Delay(Delay) {}
+
+  bool
+  fuzzyFind(const FuzzyFindRequest &Req,
+            llvm::function_ref<void(const Symbol &)> Callback) const override {
+    std::this_thread::sleep_for(Delay);
+    return Base.fuzzyFind(Req, Callback);
+  }
+
+  void
+  lookup(const LookupRequest &Req,
+         llvm::function_ref<void(const Symbol &)> Callback) const override {
+    Base.lookup(Req, Callback);
+  }
+
+  void refs(const RefsRequest &Req,
+            llvm::function_ref<void(const Ref &)> Callback) const override {
+    Base.refs(Req, Callback);
+  }
+
+  size_t estimateMemoryUsage() const override {
+    return Base.estimateMemoryUsage();
+  }
+
+private:
+  const SymbolIndex &Base;
+  std::chrono::milliseconds Delay;
+};
+
+// Records the args of the CodeCompleteFlow spans.
+class CompletionSpanRecorder : public trace::EventTracer {
+public:
+  Context beginSpan(llvm::StringRef Name, llvm::json::Object *Args) override {
+    if (Name != "CodeCompleteFlow")
+      return Context::current().clone();
+    return Context::current().derive(llvm::make_scope_exit([this, Args] {
+      std::lock_guard<std::mutex> Lock(Mut);
+      Spans.push_back(std::move(*Args));
+    }));
+  }
+
+  void instant(llvm::StringRef, llvm::json::Object &&) override {}
+
+  std::vector<llvm::json::Object> consumeSpans() {
+    std::lock_guard<std::mutex> Lock(Mut);
+    auto Result = std::move(Spans);
+    Spans.clear();
+    return Result;
+  }
+
+private:
+  std::mutex Mut;
+  std::vector<llvm::json::Object> Spans;
+};
+
+TEST(CompletionTest, ReuseCandidates) {
+  CompletionSpanRecorder Recorder;
+  trace::Session Session(Recorder);
+  MockFSProvider FS;
+  MockCompilationDatabase CDB;
+  IgnoreDiagnostics DiagConsumer;
+  ClangdServer Server(CDB, FS, DiagConsumer, ClangdServer::optsForTest());
+  clangd::CodeCompleteOptions Opts;
+  Opts.Limit = 2;
+  Opts.ReuseCandidates = true;
+
+  auto Results = completions(Server, R"cpp(
+    struct ClassWithMembers { int AAA(); int BBB(); int CCBB(); int CCC(); };
+    int main() { ClassWithMembers().[[]]^ }
+  )cpp",
+                             /*IndexSymbols=*/{}, Opts);
+  EXPECT_TRUE(Results.HasMore);
+  EXPECT_THAT(Results.Completions, ElementsAre(Named("AAA"), Named("BBB")));
+  EXPECT_EQ(Recorder.consumeSpans().size(), 1u);
+
+  // Typing more of the identifier filters the candidates we had, without
+  // running Sema again.
+  Annotations Typed(R"cpp(
+    struct ClassWithMembers { int AAA(); int BBB(); int CCBB(); int CCC(); };
+    int main() { ClassWithMembers().[[CC]]^ }
+  )cpp");
+  Results = completions(Server, Typed.code(), Typed.point(), {}, Opts);
+  EXPECT_FALSE(Results.HasMore);
+  EXPECT_THAT(Results.Completions,
+              UnorderedElementsAre(Named("CCBB"), Named("CCC")));
+  EXPECT_EQ(Results.Completions.front().CompletionTokenRange, Typed.range());
+  EXPECT_THAT(Recorder.consumeSpans(), IsEmpty());
+
+  // Other edits start over.
+  Results = completions(Server, R"cpp(
+    struct ClassWithMembers { int AAA(); int BBB(); int CCBB(); int CCD(); };
+    int main() { ClassWithMembers().CC^ }
+  )cpp",
+                        /*IndexSymbols=*/{}, Opts);
+  EXPECT_THAT(Results.Completions,
+              UnorderedElementsAre(Named("CCBB"), Named("CCD")));
+  EXPECT_EQ(Recorder.consumeSpans().size(), 1u);
+}
+
+TEST(CompletionTest, ReuseCandidatesNotAfterReopen) {
+  CompletionSpanRecorder Recorder;
+  trace::Session Session(Recorder);
+  MockFSProvider FS;
+  MockCompilationDatabase CDB;
+  IgnoreDiagnostics DiagConsumer;
+  ClangdServer Server(CDB, FS, DiagConsumer, ClangdServer::optsForTest());
+  clangd::CodeCompleteOptions Opts;
+  Opts.ReuseCandidates = true;
+
+  completions(Server, R"cpp(
+    struct ClassWithMembers { int AAA(); int BBB(); };
+    int main() { ClassWithMembers().^ }
+  )cpp",
+              /*IndexSymbols=*/{}, Opts);
+  EXPECT_EQ(Recorder.consumeSpans().size(), 1u);
+
+  // The candidates of the closed file are dropped, Sema runs again.
+  Server.removeDocument(testPath("foo.cpp"));
+  auto Results = completions(Server, R"cpp(
+    struct ClassWithMembers { int AAA(); int BBB(); };
+    int main() { ClassWithMembers().A^ }
+  )cpp",
+                             /*IndexSymbols=*/{}, Opts);
+  EXPECT_THAT(Results.Completions, ElementsAre(Named("AAA")));
+  EXPECT_EQ(Recorder.consumeSpans().size(), 1u);
+}
+
+TEST(CompletionTest, ReuseCandidatesWithDex) {
+  CompletionSpanRecorder Recorder;
+  trace::Session Session(Recorder);
+  MockFSProvider FS;
+  MockCompilationDatabase CDB;
+  IgnoreDiagnostics DiagConsumer;
+  ClangdServer Server(CDB, FS, DiagConsumer, ClangdServer::optsForTest());
+  SymbolSlab::Builder Slab;
+  Slab.insert(func("ns::fooBar"));
+  Slab.insert(func("ns::getFoo"));
+  auto Index = dex::Dex::build(std::move(Slab).build(), RefSlab());
+  clangd::CodeCompleteOptions Opts;
+  Opts.Index = Index.get();
+  Opts.ReuseCandidates = true;
+  Opts.SpeculativeIndexRequest = true;
+
+  auto Complete = [&](llvm::StringRef Filter) {
+    std::string Code =
+        ("namespace ns {}\nvoid f() { ns::" + Filter + "^ }").str();
+    return completions(Server, Code, /*IndexSymbols=*/{}, Opts).Completions;
+  };
+
+  // Unrelated edits start over, but the speculative index query for "f" uses
+  // the scopes of the earlier completion.
+  Complete("x");
+  EXPECT_THAT(Complete("f"), ElementsAre(Named("fooBar")));
+  EXPECT_EQ(Recorder.consumeSpans().size(), 2u);
+
+  // Dex only finds getFoo() for longer filters, the index is queried again.
+  EXPECT_THAT(Complete("foo"),
+              UnorderedElementsAre(Named("fooBar"), Named("getFoo")));
+  EXPECT_EQ(Recorder.consumeSpans().size(), 1u);
+
+  // These candidates are reused, neither Sema nor the index run.
+  EXPECT_THAT(Complete("fooB"), ElementsAre(Named("fooBar")));
+  EXPECT_THAT(Recorder.consumeSpans(), IsEmpty());
+}
+
 TEST(SignatureHelpTest, OverloadsOrdering) {
   const auto Results = signatures(R"cpp(
     void foo(int x);
@@ -1981,6 +2185,53 @@ TEST(CompletionTest, EnableSpeculativeIndexRequest) {
   ASSERT_EQ(Reqs3.size(), 2u);
 }
 
+TEST(CompletionTest, IndexTimingSpanArgs) {
+  CompletionSpanRecorder Recorder;
+  trace::Session Session(Recorder);
+  MockFSProvider FS;
+  MockCompilationDatabase CDB;
+  IgnoreDiagnostics DiagConsumer;
+  ClangdServer Server(CDB, FS, DiagConsumer, ClangdServer::optsForTest());
+
+  auto File = testPath("foo.cpp");
+  Annotations Test(R"cpp(
+      namespace ns { int xyz; }
+      void f() { ns::xy$1^; ns::xy$2^; }
+  )cpp");
+  runAddDocument(Server, File, Test.code());
+  auto Index = memIndex({var("ns::xyz")});
+  SlowIndex Slow(*Index, std::chrono::milliseconds(50));
+  clangd::CodeCompleteOptions Opts;
+  Opts.Index = &Slow;
+  Opts.SpeculativeIndexRequest = true;
+
+  auto TimingAt = [&](llvm::StringRef P) {
+    auto Results = cantFail(runCodeComplete(Server, File, Test.point(P), Opts));
+    EXPECT_THAT(Results.Completions, Contains(Named("xyz")));
+    auto Spans = Recorder.consumeSpans();
+    EXPECT_EQ(Spans.size(), 1u);
+    std::pair<int64_t, int64_t> Result(-1, -1);
+    if (!Spans.empty()) {
+      Result.first = Spans[0].getInteger("index_overlap_ms").getValueOr(-1);
+      Result.second = Spans[0].getInteger("index_wait_ms").getValueOr(-1);
+    }
+    return Result;
+  };
+
+  // Without a speculative query, the index is queried after Sema, nothing
+  // else runs meanwhile.
+  auto Timing = TimingAt("1");
+  EXPECT_EQ(Timing.first, 0);
+  EXPECT_GE(Timing.second, 50);
+
+  // The speculative query runs while Sema does, the time it took is split
+  // between both. Each is truncated to whole milliseconds.
+  Timing = TimingAt("2");
+  EXPECT_GE(Timing.first, 0);
+  EXPECT_GE(Timing.second, 0);
+  EXPECT_GE(Timing.first + Timing.second, 49);
+}
+
 TEST(CompletionTest, InsertTheMostPopularHeader) {
   std::string DeclFile = URI::create(testPath("foo")).toString();
   Symbol sym = func("Func");
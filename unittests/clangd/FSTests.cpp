@@ -10,6 +10,7 @@
 #include "TestFS.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include <thread>
 
 namespace clang {
 namespace clangd {
@@ -45,6 +46,56 @@ TEST(FSTests, PreambleStatusCache) {
   EXPECT_EQ(Cached->getName(), S.getName());
 }
 
+TEST(FSTests, SharedFileCache) {
+  auto FS = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+  FS->addFile(testPath("x"), 0, llvm::MemoryBuffer::getMemBuffer("old"));
+  SharedFileCache Cache(std::chrono::hours(1), /*MaxBytes=*/1024);
+  auto Before = TraceFileSystemOperations::current();
+  auto FirstFS = Cache.wrap(FS);
+  EXPECT_TRUE(FirstFS->status(testPath("x")));
+  EXPECT_FALSE(FirstFS->status(testPath("missing")));
+  auto Contents = FirstFS->getBufferForFile(testPath("x"));
+  ASSERT_TRUE(Contents);
+  EXPECT_EQ((*Contents)->getBuffer(), "old");
+
+  // Other file systems don't reach the underlying one anymore.
+  auto SecondFS = Cache.wrap(FS);
+  EXPECT_TRUE(SecondFS->status(testPath("x")));
+  EXPECT_FALSE(SecondFS->status(testPath("missing")));
+  Contents = SecondFS->getBufferForFile(testPath("x"));
+  ASSERT_TRUE(Contents);
+  EXPECT_EQ((*Contents)->getBuffer(), "old");
+  auto After = TraceFileSystemOperations::current();
+  EXPECT_EQ(After.Stats - Before.Stats, 2u);
+  EXPECT_EQ(After.Opens - Before.Opens, 1u);
+  EXPECT_EQ(After.CacheHits - Before.CacheHits, 5u);
+
+  auto ChangedFS = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+  ChangedFS->addFile(testPath("x"), 1, llvm::MemoryBuffer::getMemBuffer("new"));
+  Cache.invalidate(testPath("x"));
+  Contents = Cache.wrap(ChangedFS)->getBufferForFile(testPath("x"));
+  ASSERT_TRUE(Contents);
+  EXPECT_EQ((*Contents)->getBuffer(), "new");
+}
+
+TEST(FSTests, SharedFileCacheEvictsExpiredStatuses) {
+  auto FS = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+  // Only fits a few statuses.
+  SharedFileCache Cache(std::chrono::milliseconds(100), /*MaxBytes=*/1024);
+  auto CachedFS = Cache.wrap(FS);
+  for (unsigned I = 0; I < 10; ++I)
+    EXPECT_FALSE(CachedFS->status(testPath("missing" + std::to_string(I))));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  // The expired statuses make room for new ones.
+  auto Before = TraceFileSystemOperations::current();
+  EXPECT_FALSE(CachedFS->status(testPath("new")));
+  EXPECT_FALSE(CachedFS->status(testPath("new")));
+  auto After = TraceFileSystemOperations::current();
+  EXPECT_EQ(After.Stats - Before.Stats, 1u);
+  EXPECT_EQ(After.CacheHits - Before.CacheHits, 1u);
+}
+
 } // namespace
 } // namespace clangd
 } // namespace clang
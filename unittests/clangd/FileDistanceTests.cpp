@@ -108,6 +108,20 @@ TEST(FileDistance, DisallowDownTraversalsFromRoot) {
   EXPECT_EQ(D.distance("/x"), FileDistance::Unreachable);
 }
 
+TEST(URIDistanceCache, SharesSameSources) {
+  URIDistanceCache Cache(/*MaxSize=*/2);
+  SourceParams CostLots;
+  CostLots.Cost = 100;
+  auto A = Cache.get({{"/a", SourceParams()}, {"/b", CostLots}});
+  EXPECT_EQ(A, Cache.get({{"/b", CostLots}, {"/a", SourceParams()}}));
+  EXPECT_NE(A, Cache.get({{"/a", CostLots}, {"/b", CostLots}}));
+  EXPECT_NE(A, Cache.get({{"/a", SourceParams()}}));
+  // The least recently used sources were evicted.
+  auto C = Cache.get({{"/a", SourceParams()}, {"/b", CostLots}});
+  EXPECT_NE(A, C);
+  EXPECT_EQ(A->distance("file:///a/x"), C->distance("file:///a/x"));
+}
+
 TEST(ScopeDistance, Smoke) {
   ScopeDistance D({"x::y::z", "x::", "", "a::"});
   EXPECT_EQ(D.distance("x::y::z::"), 0u);
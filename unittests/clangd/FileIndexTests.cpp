@@ -191,6 +191,19 @@ TEST(FileIndexTest, IndexMultiASTAndDeduplicate) {
       UnorderedElementsAre(QName("ns::f"), QName("ns::X"), QName("ns::ff")));
 }
 
+TEST(FileIndexTest, AsyncRebuilds) {
+  FileIndex M(/*UseDex=*/true, /*AsyncRebuilds=*/true);
+  update(M, "f1", "namespace ns { void f() {} }");
+  update(M, "f2", "namespace ns { void g() {} }");
+  update(M, "f1", "namespace ns { void h() {} }");
+  ASSERT_TRUE(M.blockUntilIdleForTest(Deadline::infinity()));
+
+  FuzzyFindRequest Req;
+  Req.Scopes = {"ns::"};
+  EXPECT_THAT(runFuzzyFind(M, Req),
+              UnorderedElementsAre(QName("ns::g"), QName("ns::h")));
+}
+
 TEST(FileIndexTest, ClassMembers) {
   FileIndex M;
   update(M, "f1", "class X { static int m1; int m2; static void f(); };");
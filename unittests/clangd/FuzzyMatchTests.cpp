@@ -276,6 +276,28 @@ TEST(FuzzyMatch, Scoring) {
   EXPECT_THAT("Abs", matches("[abs]", 2.f));
 }
 
+TEST(FuzzyMatch, SegmentedWords) {
+  const char *Words[] = {"unique_ptr", "XMLHttpRequest", "", "abs",
+                         "editorHoverHighlight", "SVisualLoggerLogsList"};
+  SegmentedWords Segmented;
+  for (const char *Word : Words)
+    Segmented.push_back(Word);
+  ASSERT_EQ(Segmented.size(), llvm::array_lengthof(Words));
+  EXPECT_EQ(Segmented[1].Word, "XMLHttpRequest");
+  EXPECT_EQ(llvm::StringRef(Segmented[1].LowWord, 14), "xmlhttprequest");
+
+  for (llvm::StringRef Pattern : {"", "u_p", "abs", "hr", "LLL", "highlight"}) {
+    FuzzyMatcher Matcher(Pattern);
+    std::vector<llvm::Optional<float>> Scores(Segmented.size());
+    Matcher.match(Segmented, Scores);
+    for (size_t I = 0; I < Segmented.size(); ++I) {
+      EXPECT_EQ(Scores[I], Matcher.match(Words[I]))
+          << Pattern << " vs " << Words[I];
+      EXPECT_EQ(Matcher.match(Segmented[I]), Scores[I]);
+    }
+  }
+}
+
 // Returns pretty-printed segmentation of Text.
 // e.g. std::basic_string --> +--  +---- +-----
 std::string segment(llvm::StringRef Text) {
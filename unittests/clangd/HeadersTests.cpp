@@ -252,6 +252,24 @@ TEST_F(HeadersTest, PreferInserted) {
   EXPECT_TRUE(StringRef(Edit->newText).contains("<y>"));
 }
 
+TEST(IncludePathCacheTest, ComputesOncePerHeader) {
+  IncludePathCache Cache;
+  unsigned Computed = 0;
+  auto Compute = [&](llvm::StringRef Path) {
+    return [&Computed, Path] {
+      ++Computed;
+      return ("\"" + Path + "\"").str();
+    };
+  };
+  EXPECT_EQ(Cache.get("/build", "/sub/bar.h", Compute("bar.h")), "\"bar.h\"");
+  EXPECT_EQ(Cache.get("/build", "/sub/bar.h", Compute("x.h")), "\"bar.h\"");
+  EXPECT_EQ(Computed, 1u);
+  // The same header is spelled differently from another build directory.
+  EXPECT_EQ(Cache.get("/other", "/sub/bar.h", Compute("sub/bar.h")),
+            "\"sub/bar.h\"");
+  EXPECT_EQ(Computed, 2u);
+}
+
 } // namespace
 } // namespace clangd
 } // namespace clang
@@ -27,6 +27,7 @@
 #include "llvm/Support/Casting.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include <cmath>
 #include <vector>
 
 namespace clang {
@@ -234,6 +235,24 @@ TEST(QualityTests, SymbolQualitySignalsSanity) {
   EXPECT_LT(Destructor.evaluate(), Constructor.evaluate());
 }
 
+// The boost for references is precomputed for small counts, it must match the
+// formula exactly so that rankings don't depend on the count's range.
+TEST(QualityTests, ReferencesBoostMatchesFormula) {
+  for (unsigned References : {0u, 9u, 10u, 11u, 500u, 1023u, 1024u, 1025u,
+                              5000u, 1000000u}) {
+    float Expected = 1;
+    if (References >= 10) {
+      float S = std::pow(References, -0.06);
+      Expected *= 6.0 * (1 - S) / (1 + S) + 0.59;
+    }
+    Expected *= 0.1f;
+    SymbolQualitySignals Q;
+    Q.References = References;
+    Q.Deprecated = true;
+    EXPECT_EQ(Q.evaluate(), Expected) << References;
+  }
+}
+
 TEST(QualityTests, SymbolRelevanceSignalsSanity) {
   SymbolRelevanceSignals Default;
   EXPECT_EQ(Default.evaluate(), 1);
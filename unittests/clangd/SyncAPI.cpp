@@ -77,6 +77,13 @@ runCodeComplete(ClangdServer &Server, PathRef File, Position Pos,
   return std::move(*Result);
 }
 
+llvm::Expected<CompletionItem> runResolveCompletion(ClangdServer &Server,
+                                                    CompletionItem Item) {
+  llvm::Optional<llvm::Expected<CompletionItem>> Result;
+  Server.resolveCompletion(std::move(Item), capture(Result));
+  return std::move(*Result);
+}
+
 llvm::Expected<SignatureHelp> runSignatureHelp(ClangdServer &Server,
                                                PathRef File, Position Pos) {
   llvm::Optional<llvm::Expected<SignatureHelp>> Result;
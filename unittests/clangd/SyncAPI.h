@@ -29,6 +29,9 @@ llvm::Expected<CodeCompleteResult>
 runCodeComplete(ClangdServer &Server, PathRef File, Position Pos,
                 clangd::CodeCompleteOptions Opts);
 
+llvm::Expected<CompletionItem> runResolveCompletion(ClangdServer &Server,
+                                                    CompletionItem Item);
+
 llvm::Expected<SignatureHelp> runSignatureHelp(ClangdServer &Server,
                                                PathRef File, Position Pos);
 
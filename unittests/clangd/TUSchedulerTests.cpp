@@ -9,8 +9,10 @@
 #include "Annotations.h"
 #include "Context.h"
 #include "Matchers.h"
+#include "SyncAPI.h"
 #include "TUScheduler.h"
 #include "TestFS.h"
+#include "index/FileIndex.h"
 #include "llvm/ADT/ScopeExit.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -105,7 +107,8 @@ Key<llvm::unique_function<void(PathRef File, std::vector<Diag>)>>
 TEST_F(TUSchedulerTests, MissingFiles) {
   TUScheduler S(getDefaultAsyncThreadsCount(),
                 /*StorePreamblesInMemory=*/true, /*ASTCallbacks=*/nullptr,
-                /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+                /*UpdateDebounce=*/DebouncePolicy::fixed(
+                    std::chrono::steady_clock::duration::zero()),
                 ASTRetentionPolicy());
 
   auto Added = testPath("added.cpp");
@@ -156,7 +159,8 @@ TEST_F(TUSchedulerTests, WantDiagnostics) {
     TUScheduler S(
         getDefaultAsyncThreadsCount(),
         /*StorePreamblesInMemory=*/true, captureDiags(),
-        /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+        /*UpdateDebounce=*/DebouncePolicy::fixed(
+            std::chrono::steady_clock::duration::zero()),
         ASTRetentionPolicy());
     auto Path = testPath("foo.cpp");
     updateWithDiags(S, Path, "", WantDiagnostics::Yes,
@@ -186,7 +190,8 @@ TEST_F(TUSchedulerTests, Debounce) {
   {
     TUScheduler S(getDefaultAsyncThreadsCount(),
                   /*StorePreamblesInMemory=*/true, captureDiags(),
-                  /*UpdateDebounce=*/std::chrono::seconds(1),
+                  /*UpdateDebounce=*/DebouncePolicy::fixed(
+                      std::chrono::seconds(1)),
                   ASTRetentionPolicy());
     // FIXME: we could probably use timeouts lower than 1 second here.
     auto Path = testPath("foo.cpp");
@@ -207,6 +212,41 @@ TEST_F(TUSchedulerTests, Debounce) {
   EXPECT_EQ(2, CallbackCount);
 }
 
+TEST(DebouncePolicyTest, Compute) {
+  DebouncePolicy Policy;
+  Policy.Min = std::chrono::milliseconds(50);
+  Policy.Max = std::chrono::milliseconds(500);
+  Policy.RebuildRatio = 1;
+  Policy.PauseRatio = 2;
+  auto Compute = [&](llvm::Optional<int> BuildMs,
+                     llvm::Optional<int> IntervalMs) {
+    llvm::Optional<DebouncePolicy::clock::duration> Build, Interval;
+    if (BuildMs)
+      Build = std::chrono::milliseconds(*BuildMs);
+    if (IntervalMs)
+      Interval = std::chrono::milliseconds(*IntervalMs);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               Policy.compute(Build, Interval))
+        .count();
+  };
+  // Nothing was measured yet.
+  EXPECT_EQ(500, Compute(None, None));
+  // Follows the build time within the limits.
+  EXPECT_EQ(200, Compute(200, None));
+  EXPECT_EQ(50, Compute(10, None));
+  EXPECT_EQ(500, Compute(2000, None));
+  // Stops waiting soon after the user pauses typing.
+  EXPECT_EQ(160, Compute(2000, 80));
+  EXPECT_EQ(200, Compute(200, 300));
+  EXPECT_EQ(50, Compute(200, 10));
+
+  DebouncePolicy Fixed = DebouncePolicy::fixed(std::chrono::milliseconds(100));
+  EXPECT_EQ(std::chrono::milliseconds(100), Fixed.compute(None, None));
+  EXPECT_EQ(std::chrono::milliseconds(100),
+            Fixed.compute(DebouncePolicy::clock::duration::zero(),
+                          DebouncePolicy::clock::duration::zero()));
+}
+
 static std::vector<std::string> includes(const PreambleData *Preamble) {
   std::vector<std::string> Result;
   if (Preamble)
@@ -222,7 +262,8 @@ TEST_F(TUSchedulerTests, PreambleConsistency) {
     TUScheduler S(
         getDefaultAsyncThreadsCount(), /*StorePreamblesInMemory=*/true,
         /*ASTCallbacks=*/nullptr,
-        /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+        /*UpdateDebounce=*/DebouncePolicy::fixed(
+            std::chrono::steady_clock::duration::zero()),
         ASTRetentionPolicy());
     auto Path = testPath("foo.cpp");
     // Schedule two updates (A, B) and two preamble reads (stale, consistent).
@@ -279,7 +320,8 @@ TEST_F(TUSchedulerTests, Cancellation) {
     TUScheduler S(
         getDefaultAsyncThreadsCount(), /*StorePreamblesInMemory=*/true,
         /*ASTCallbacks=*/captureDiags(),
-        /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+        /*UpdateDebounce=*/DebouncePolicy::fixed(
+            std::chrono::steady_clock::duration::zero()),
         ASTRetentionPolicy());
     auto Path = testPath("foo.cpp");
     // Helper to schedule a named update and return a function to cancel it.
@@ -348,7 +390,8 @@ TEST_F(TUSchedulerTests, ManyUpdates) {
   {
     TUScheduler S(getDefaultAsyncThreadsCount(),
                   /*StorePreamblesInMemory=*/true, captureDiags(),
-                  /*UpdateDebounce=*/std::chrono::milliseconds(50),
+                  /*UpdateDebounce=*/DebouncePolicy::fixed(
+                      std::chrono::milliseconds(50)),
                   ASTRetentionPolicy());
 
     std::vector<std::string> Files;
@@ -440,7 +483,9 @@ TEST_F(TUSchedulerTests, EvictedAST) {
   TUScheduler S(
       /*AsyncThreadsCount=*/1, /*StorePreambleInMemory=*/true,
       /*ASTCallbacks=*/nullptr,
-      /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(), Policy);
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      Policy);
 
   llvm::StringLiteral SourceContents = R"cpp(
     int* a;
@@ -486,11 +531,35 @@ TEST_F(TUSchedulerTests, EvictedAST) {
               UnorderedElementsAre(Foo, AnyOf(Bar, Baz)));
 }
 
+TEST_F(TUSchedulerTests, EvictedASTBySize) {
+  ASTRetentionPolicy Policy;
+  Policy.MaxRetainedASTs = 10;
+  // Any AST is larger than that, so only the most recent one is retained.
+  Policy.MaxRetainedASTBytes = 1;
+  TUScheduler S(
+      /*AsyncThreadsCount=*/1, /*StorePreambleInMemory=*/true,
+      /*ASTCallbacks=*/nullptr,
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      Policy);
+
+  auto Foo = testPath("foo.cpp");
+  auto Bar = testPath("bar.cpp");
+  S.update(Foo, getInputs(Foo, "int a;"), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_THAT(S.getFilesWithCachedAST(), ElementsAre(Foo));
+
+  S.update(Bar, getInputs(Bar, "int b;"), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_THAT(S.getFilesWithCachedAST(), ElementsAre(Bar));
+}
+
 TEST_F(TUSchedulerTests, EmptyPreamble) {
   TUScheduler S(
       /*AsyncThreadsCount=*/4, /*StorePreambleInMemory=*/true,
       /*ASTCallbacks=*/nullptr,
-      /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
       ASTRetentionPolicy());
 
   auto Foo = testPath("foo.cpp");
@@ -535,7 +604,8 @@ TEST_F(TUSchedulerTests, RunWaitsForPreamble) {
   TUScheduler S(
       /*AsyncThreadsCount=*/4, /*StorePreambleInMemory=*/true,
       /*ASTCallbacks=*/nullptr,
-      /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
       ASTRetentionPolicy());
   auto Foo = testPath("foo.cpp");
   auto NonEmptyPreamble = R"cpp(
@@ -567,7 +637,8 @@ TEST_F(TUSchedulerTests, NoopOnEmptyChanges) {
   TUScheduler S(
       /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
       /*StorePreambleInMemory=*/true, captureDiags(),
-      /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
       ASTRetentionPolicy());
 
   auto Source = testPath("foo.cpp");
@@ -616,11 +687,332 @@ TEST_F(TUSchedulerTests, NoopOnEmptyChanges) {
   ASSERT_FALSE(DoUpdate(OtherSourceContents));
 }
 
+TEST_F(TUSchedulerTests, AsyncPreambleBuilds) {
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true, captureDiags(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy(), /*AsyncPreambleBuilds=*/true);
+
+  auto Source = testPath("foo.cpp");
+  auto Header = testPath("foo.h");
+
+  Files[Header] = "int a;";
+  Timestamps[Header] = time_t(0);
+
+  std::string SourceContents = R"cpp(
+      #include "foo.h"
+      int b = a;
+    )cpp";
+
+  std::mutex Mut;
+  std::vector<size_t> DiagCounts;
+  auto DoUpdate = [&](std::string Contents) {
+    updateWithDiags(S, Source, Contents, WantDiagnostics::Yes,
+                    [&](std::vector<Diag> Diags) {
+                      std::lock_guard<std::mutex> Lock(Mut);
+                      DiagCounts.push_back(Diags.size());
+                    });
+    ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  };
+
+  DoUpdate(SourceContents);
+  EXPECT_THAT(DiagCounts, ElementsAre(0u));
+
+  // The header change invalidates the preamble. Diagnostics are first produced
+  // using the stale preamble, and then again once the new one is built.
+  DiagCounts.clear();
+  Files[Header] = "";
+  Timestamps[Header] = time_t(1);
+  DoUpdate(SourceContents + "int c = a;");
+  EXPECT_THAT(DiagCounts, ElementsAre(0u, 2u));
+
+  // Changes to the preamble region are still built synchronously.
+  DiagCounts.clear();
+  Files[Header] = "int a;";
+  DoUpdate("#define FOO\n" + SourceContents);
+  EXPECT_THAT(DiagCounts, ElementsAre(0u));
+}
+
+TEST_F(TUSchedulerTests, SharedPreambles) {
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true, /*ASTCallbacks=*/nullptr,
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy());
+
+  auto Foo = testPath("foo.cpp");
+  auto Bar = testPath("bar.cpp");
+  auto Baz = testPath("baz.cpp");
+  auto Header = testPath("foo.h");
+  Files[Header] = "int a;";
+  Timestamps[Header] = time_t(0);
+
+  auto GetPreamble = [&](PathRef File) {
+    const PreambleData *Result = nullptr;
+    S.runWithPreamble("GetPreamble", File, TUScheduler::Stale,
+                      [&](Expected<InputsAndPreamble> IP) {
+                        Result = cantFail(std::move(IP)).Preamble;
+                      });
+    EXPECT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+    return Result;
+  };
+
+  // Files with the same includes get the same preamble.
+  S.update(Foo, getInputs(Foo, "#include \"foo.h\"\nint b = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  S.update(Bar, getInputs(Bar, "#include \"foo.h\"\nint c = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  ASSERT_NE(GetPreamble(Foo), nullptr);
+  EXPECT_EQ(GetPreamble(Foo), GetPreamble(Bar));
+
+  // Macros in the preamble region point into the file, so they're not shared.
+  S.update(Baz, getInputs(Baz, "#define X\n#include \"foo.h\"\nint d = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_NE(GetPreamble(Baz), GetPreamble(Foo));
+
+  // Once the header changes, the first file rebuilds the preamble and the
+  // other one picks it up.
+  Files[Header] = "int a; int e;";
+  Timestamps[Header] = time_t(1);
+  S.update(Foo, getInputs(Foo, "#include \"foo.h\"\nint b = e;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  S.update(Bar, getInputs(Bar, "#include \"foo.h\"\nint c = e;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_EQ(GetPreamble(Foo), GetPreamble(Bar));
+}
+
+TEST_F(TUSchedulerTests, SharedPreamblesKeepIndexedSymbols) {
+  class IndexPreambles : public ParsingCallbacks {
+  public:
+    IndexPreambles(FileIndex &Index) : Index(Index) {}
+    void onPreambleAST(PathRef Path, ASTContext &Ctx,
+                       std::shared_ptr<clang::Preprocessor> PP,
+                       const CanonicalIncludes &CanonIncludes) override {
+      Index.updatePreamble(Path, Ctx, std::move(PP), CanonIncludes);
+    }
+    void onPreambleReused(PathRef Path, PathRef BuiltFor) override {
+      Index.sharePreamble(Path, BuiltFor);
+    }
+
+  private:
+    FileIndex &Index;
+  };
+
+  FileIndex Index;
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true, llvm::make_unique<IndexPreambles>(Index),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy());
+
+  auto Foo = testPath("foo.cpp");
+  auto Bar = testPath("bar.cpp");
+  Files[testPath("foo.h")] = "int a;";
+  Files[testPath("other.h")] = "int b;";
+
+  auto IndexedNames = [&] {
+    std::vector<std::string> Names;
+    for (const auto &Sym : runFuzzyFind(Index, ""))
+      Names.push_back(Sym.Name);
+    return Names;
+  };
+
+  // Bar reuses the preamble built for Foo, and gets its symbols.
+  S.update(Foo, getInputs(Foo, "#include \"foo.h\"\nint x = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  S.update(Bar, getInputs(Bar, "#include \"foo.h\"\nint y = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_THAT(IndexedNames(), UnorderedElementsAre("a"));
+
+  // Bar still has them once Foo replaces its own preamble symbols.
+  S.update(Foo, getInputs(Foo, "#include \"other.h\"\nint x = b;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_THAT(IndexedNames(), UnorderedElementsAre("a", "b"));
+
+  // Going back, Foo gets the symbols of its old preamble from Bar.
+  S.update(Foo, getInputs(Foo, "#include \"foo.h\"\nint x = a;"),
+           WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_THAT(IndexedNames(), UnorderedElementsAre("a"));
+}
+
+TEST_F(TUSchedulerTests, RetainedPreambles) {
+  class CountPreambles : public ParsingCallbacks {
+  public:
+    CountPreambles(std::atomic<int> &Count) : Count(Count) {}
+    void onPreambleAST(PathRef Path, ASTContext &Ctx,
+                       std::shared_ptr<clang::Preprocessor> PP,
+                       const CanonicalIncludes &) override {
+      ++Count;
+    }
+
+  private:
+    std::atomic<int> &Count;
+  };
+  std::atomic<int> PreambleBuilds(0);
+  ASTRetentionPolicy Policy;
+  Policy.MaxRetainedPreambleBytes = 100 * 1024 * 1024;
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true,
+      llvm::make_unique<CountPreambles>(PreambleBuilds),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      Policy);
+
+  auto Foo = testPath("foo.cpp");
+  auto Header = testPath("foo.h");
+  Files[Header] = "int a;";
+  Timestamps[Header] = time_t(0);
+  auto Contents = "#define FOO\n#include \"foo.h\"\nint b = a;";
+
+  S.update(Foo, getInputs(Foo, Contents), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_EQ(PreambleBuilds, 1);
+
+  // Reopening the file reuses the preamble.
+  S.remove(Foo);
+  S.update(Foo, getInputs(Foo, Contents), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_EQ(PreambleBuilds, 1);
+
+  // Unless the headers changed in the meantime.
+  S.remove(Foo);
+  Files[Header] = "int a; int c;";
+  Timestamps[Header] = time_t(1);
+  S.update(Foo, getInputs(Foo, Contents), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  EXPECT_EQ(PreambleBuilds, 2);
+}
+
+TEST_F(TUSchedulerTests, SkipUnchangedBodies) {
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true, captureDiags(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy());
+
+  auto Foo = testPath("foo.cpp");
+  std::mutex Mut;
+  std::vector<std::vector<Diag>> AllDiags;
+  auto DoUpdate = [&](std::string Contents) {
+    ParseInputs Inputs = getInputs(Foo, Contents);
+    Inputs.Opts.SkipUnchangedBodiesMinSize = 1;
+    updateWithDiags(S, Foo, std::move(Inputs), WantDiagnostics::Yes,
+                    [&](std::vector<Diag> Diags) {
+                      std::lock_guard<std::mutex> Lock(Mut);
+                      AllDiags.push_back(std::move(Diags));
+                    });
+    ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  };
+  auto Ranges = [](const std::vector<Diag> &Diags) {
+    std::vector<Range> Result;
+    for (const auto &D : Diags)
+      Result.push_back(D.Range);
+    return Result;
+  };
+
+  Annotations Before(R"cpp(
+    int edited() { return "error"; }
+    int unchanged() { return $unchanged[["error"]]; }
+  )cpp");
+  DoUpdate(Before.code());
+  ASSERT_EQ(AllDiags.size(), 1u);
+  EXPECT_THAT(Ranges(AllDiags[0]),
+              UnorderedElementsAre(_, Before.range("unchanged")));
+
+  // The edit adds lines before the unchanged function.
+  Annotations After(R"cpp(
+    int edited() {
+      return $edited[["error again"]];
+    }
+    int unchanged() { return $unchanged[["error"]]; }
+  )cpp");
+  AllDiags.clear();
+  DoUpdate(After.code());
+  // The diagnostics of the first parse include the ones carried over from the
+  // unchanged function, the full parse that follows reports the same ones.
+  ASSERT_EQ(AllDiags.size(), 2u);
+  EXPECT_THAT(Ranges(AllDiags[0]),
+              UnorderedElementsAre(After.range("unchanged"),
+                                   After.range("edited")));
+  EXPECT_THAT(Ranges(AllDiags[1]),
+              UnorderedElementsAre(After.range("unchanged"),
+                                   After.range("edited")));
+}
+
+TEST_F(TUSchedulerTests, SkipUnchangedBodiesKeepsUnusedWarnings) {
+  TUScheduler S(
+      /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
+      /*StorePreambleInMemory=*/true, captureDiags(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
+      ASTRetentionPolicy());
+
+  auto Foo = testPath("foo.cpp");
+  CDB.ExtraClangFlags.push_back("-Wunused-function");
+  std::mutex Mut;
+  std::vector<std::vector<Range>> AllRanges;
+  auto DoUpdate = [&](std::string Contents) {
+    ParseInputs Inputs = getInputs(Foo, Contents);
+    Inputs.Opts.SkipUnchangedBodiesMinSize = 1;
+    updateWithDiags(S, Foo, std::move(Inputs), WantDiagnostics::Yes,
+                    [&](std::vector<Diag> Diags) {
+                      std::vector<Range> Ranges;
+                      for (const auto &D : Diags)
+                        Ranges.push_back(D.Range);
+                      std::lock_guard<std::mutex> Lock(Mut);
+                      AllRanges.push_back(std::move(Ranges));
+                    });
+    ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  };
+
+  Annotations Before(R"cpp(
+    static void helper() {}
+    void edited() {}
+    static void $unused[[unused]]() {}
+    void caller() { helper(); }
+  )cpp");
+  DoUpdate(Before.code());
+  ASSERT_EQ(AllRanges.size(), 1u);
+  EXPECT_THAT(AllRanges[0], ElementsAre(Before.range("unused")));
+
+  // helper() is only called from a skipped body, the first parse must not
+  // report it as unused.
+  Annotations After(R"cpp(
+    static void helper() {}
+    void edited() {
+      return;
+    }
+    static void $unused[[unused]]() {}
+    void caller() { helper(); }
+  )cpp");
+  AllRanges.clear();
+  DoUpdate(After.code());
+  ASSERT_EQ(AllRanges.size(), 2u);
+  EXPECT_THAT(AllRanges[0], ElementsAre(After.range("unused")));
+  EXPECT_THAT(AllRanges[1], ElementsAre(After.range("unused")));
+}
+
 TEST_F(TUSchedulerTests, NoChangeDiags) {
   TUScheduler S(
       /*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
       /*StorePreambleInMemory=*/true, captureDiags(),
-      /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+      /*UpdateDebounce=*/DebouncePolicy::fixed(
+          std::chrono::steady_clock::duration::zero()),
       ASTRetentionPolicy());
 
   auto FooCpp = testPath("foo.cpp");
@@ -654,7 +1046,8 @@ TEST_F(TUSchedulerTests, NoChangeDiags) {
 TEST_F(TUSchedulerTests, Run) {
   TUScheduler S(/*AsyncThreadsCount=*/getDefaultAsyncThreadsCount(),
                 /*StorePreambleInMemory=*/true, /*ASTCallbacks=*/nullptr,
-                /*UpdateDebounce=*/std::chrono::steady_clock::duration::zero(),
+                /*UpdateDebounce=*/DebouncePolicy::fixed(
+                    std::chrono::steady_clock::duration::zero()),
                 ASTRetentionPolicy());
   std::atomic<int> Counter(0);
   S.run("add 1", [&] { ++Counter; });
@@ -663,6 +1056,40 @@ TEST_F(TUSchedulerTests, Run) {
   EXPECT_EQ(Counter.load(), 3);
 }
 
+TEST_F(TUSchedulerTests, ConsecutiveReadsRunTogether) {
+  TUScheduler S(/*AsyncThreadsCount=*/1, /*StorePreambleInMemory=*/true,
+                /*ASTCallbacks=*/nullptr,
+                /*UpdateDebounce=*/DebouncePolicy::fixed(
+                    std::chrono::steady_clock::duration::zero()),
+                ASTRetentionPolicy());
+  auto Foo = testPath("foo.cpp");
+  auto Bar = testPath("bar.cpp");
+  S.update(Foo, getInputs(Foo, "int a;"), WantDiagnostics::Yes);
+  S.update(Bar, getInputs(Bar, "int b;"), WantDiagnostics::Yes);
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+
+  std::mutex Mu;
+  std::vector<std::string> Order;
+  auto Read = [&](std::string Name) {
+    return [&, Name](llvm::Expected<InputsAndAST> AST) {
+      EXPECT_TRUE(bool(AST));
+      std::lock_guard<std::mutex> Lock(Mu);
+      Order.push_back(Name);
+    };
+  };
+  Notification Start;
+  S.runWithAST("Block", Foo, [&](llvm::Expected<InputsAndAST> AST) {
+    EXPECT_TRUE(bool(AST));
+    Start.wait();
+  });
+  S.runWithAST("Bar", Bar, Read("bar"));
+  S.runWithAST("Foo", Foo, Read("foo"));
+  Start.notify();
+  ASSERT_TRUE(S.blockUntilIdle(timeoutSeconds(10)));
+  // The read of foo.cpp queued behind "Block" doesn't wait for bar.cpp.
+  EXPECT_THAT(Order, ElementsAre("foo", "bar"));
+}
+
 TEST_F(TUSchedulerTests, TUStatus) {
   class CaptureTUStatus : public DiagnosticsConsumer {
   public:
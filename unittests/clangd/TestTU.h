@@ -49,6 +49,8 @@ struct TestTU {
   std::vector<const char *> ExtraArgs;
 
   llvm::Optional<std::string> ClangTidyChecks;
+  // Only parse the bodies of functions overlapping this range of offsets.
+  llvm::Optional<std::pair<unsigned, unsigned>> ParseBodiesIn;
   // Index to use when building AST.
   const SymbolIndex *ExternalIndex = nullptr;
 
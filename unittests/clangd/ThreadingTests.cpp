@@ -8,6 +8,7 @@
 
 #include "Threading.h"
 #include "gtest/gtest.h"
+#include <atomic>
 #include <mutex>
 
 namespace clang {
@@ -60,5 +61,64 @@ TEST_F(ThreadingTest, TaskRunner) {
   std::lock_guard<std::mutex> Lock(Mutex);
   ASSERT_EQ(Counter, TasksCnt * IncrementsPerTask);
 }
+
+TEST_F(ThreadingTest, WorkerPoolRunsQueuesSequentially) {
+  // Runs a fixed number of tasks and checks that they never overlap.
+  class CountingQueue : public WorkerPool::Queue {
+  public:
+    CountingQueue(int Tasks) : Remaining(Tasks) {}
+
+    llvm::Optional<Deadline> runNext() override {
+      EXPECT_FALSE(Running.exchange(true)) << "Tasks of a queue overlapped";
+      std::this_thread::yield();
+      Running = false;
+      if (--Remaining == 0)
+        return llvm::None;
+      return Deadline::zero();
+    }
+
+    std::atomic<bool> Running = {false};
+    int Remaining;
+  };
+
+  std::vector<std::shared_ptr<CountingQueue>> Queues;
+  {
+    WorkerPool Pool(/*ThreadCount=*/4);
+    for (int I = 0; I < 50; ++I) {
+      Queues.push_back(std::make_shared<CountingQueue>(100));
+      Pool.wake(Queues.back());
+    }
+  }
+  // The destructor has waited for all queues to finish.
+  for (const auto &Q : Queues)
+    EXPECT_EQ(Q->Remaining, 0);
+}
+
+TEST_F(ThreadingTest, WorkerPoolWaitsForDeadlines) {
+  class DelayedQueue : public WorkerPool::Queue {
+  public:
+    llvm::Optional<Deadline> runNext() override {
+      auto Now = std::chrono::steady_clock::now();
+      if (++Runs == 1) {
+        Start = Now;
+        return Deadline(Start + std::chrono::milliseconds(50));
+      }
+      Elapsed = Now - Start;
+      return llvm::None;
+    }
+
+    int Runs = 0;
+    std::chrono::steady_clock::time_point Start;
+    std::chrono::steady_clock::duration Elapsed;
+  };
+
+  auto Q = std::make_shared<DelayedQueue>();
+  {
+    WorkerPool Pool(/*ThreadCount=*/2);
+    Pool.wake(Q);
+  }
+  EXPECT_EQ(Q->Runs, 2);
+  EXPECT_GE(Q->Elapsed, std::chrono::milliseconds(50));
+}
 } // namespace clangd
 } // namespace clang